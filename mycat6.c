@@ -1,142 +1,6333 @@
-// mycat6.c - 一个使用实验确定最佳固定缓冲区大小，并使用posix_fadvise进行优化的cat程序
-
-#include <unistd.h>     // 包含 read, write, open 等系统调用
-#include <fcntl.h>      // 包含文件控制选项，如 O_RDONLY, posix_fadvise
-#include <stdio.h>      // 包含 perror, fprintf 函数
-#include <stdlib.h>     // 包含 exit, malloc, free 函数
-#include <stdint.h>     // 包含 uintptr_t，用于指针和整数之间的安全转换
-#include <errno.h>      // 包含 errno，用于错误处理
-
-// 定义实验确定的最佳缓冲区大小 (2MB)
-// 这个值是基于对系统调用开销的实验测量得出的。
-#define OPTIMAL_BUFFER_SIZE (2 * 1024 * 1024) // 2MB
-
-// get_system_page_size 函数：获取系统内存页大小
-// 这是一个辅助函数，用于 align_alloc 中的页对齐计算。
-// 返回值: 系统的内存页大小，如果获取失败则返回一个默认值 (4096)
-long get_system_page_size() {
-    long page_size = sysconf(_SC_PAGESIZE);
-    if (page_size == -1) {
-        perror("警告: 无法获取系统页大小，将使用默认值 4096 字节进行对齐");
-        return 4096;
-    }
-    return page_size;
-}
-
-// io_blocksize 函数：返回实验确定的最佳缓冲区大小
-// 此函数不再根据文件系统或页大小动态调整，而是返回一个固定的优化值。
-size_t io_blocksize() {
-    return OPTIMAL_BUFFER_SIZE;
-}
-
-// align_alloc 函数：分配一段内存，长度不小于 size 并且返回一个对齐到内存页起始的指针
-// 参数: size - 需要分配的最小字节数
-// 返回值: 对齐到内存页起始的指针，如果分配失败则返回 NULL
-char* align_alloc(size_t size) {
-    // 获取系统页大小，用于内存对齐计算。
-    size_t page_size = (size_t)get_system_page_size();
-
-    // 我们需要分配额外的空间来存储原始的 malloc 指针，以及确保有足够的空间进行对齐。
-    char *original_ptr = (char *)malloc(size + page_size - 1 + sizeof(void*));
-    if (original_ptr == NULL) {
-        return NULL; // 内存分配失败
-    }
-
-    // 计算页对齐后的地址：
-    uintptr_t aligned_addr_val = ((uintptr_t)(original_ptr + sizeof(void*)) + page_size - 1) & ~(page_size - 1);
-    char *aligned_ptr = (char*)aligned_addr_val;
-
-    // 将原始的 malloc 返回的指针存储在对齐地址的前面 sizeof(void*) 的位置。
-    *((char**)(aligned_ptr - sizeof(void*))) = original_ptr;
-
-    return aligned_ptr;
-}
-
-// align_free 函数：释放先前从 align_alloc 返回的内存
-// 参数: ptr - 从 align_alloc 返回的页对齐指针
-void align_free(void* ptr) {
-    if (ptr == NULL) {
-        return; // 处理 NULL 指针，避免崩溃
-    }
-    // 从对齐地址的前面 sizeof(void*) 的位置获取原始 malloc 返回的指针。
-    char *original_ptr = *((char**)((char*)ptr - sizeof(void*)));
-    free(original_ptr); // 释放原始的、由 malloc 分配的内存块。
-}
-
-int main(int argc, char *argv[]) {
-    int fd_in;           // 输入文件描述符
-    char *buffer = NULL; // 缓冲区指针
-    size_t buffer_size;  // 缓冲区大小
-    ssize_t bytes_read;  // read() 函数返回的字节数
-    ssize_t bytes_written; // write() 函数返回的字节数
-
-    // 1. 检查命令行参数数量
-    if (argc != 2) {
-        fprintf(stderr, "用法: %s <文件名>\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
-    // 2. 打开输入文件
-    fd_in = open(argv[1], O_RDONLY);
-    if (fd_in == -1) {
-        perror("打开文件失败");
-        exit(EXIT_FAILURE);
-    }
-
-    // 3. 使用 posix_fadvise 提示文件系统进行顺序读取优化
-    // fd: 文件描述符
-    // offset: 0，从文件开头开始
-    // len: 0，表示从 offset 到文件结尾
-    // advice: POSIX_FADV_SEQUENTIAL，表示文件将以顺序方式读取
-    if (posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL) == -1) {
-        // posix_fadvise 失败通常不是致命错误，打印警告即可。
-        // 例如，某些文件系统或内核版本可能不支持此功能。
-        perror("警告: posix_fadvise (POSIX_FADV_SEQUENTIAL) 失败");
-    } else {
-        fprintf(stderr, "已使用 posix_fadvise(POSIX_FADV_SEQUENTIAL) 提示文件系统。\n");
-    }
-
-    // 4. 获取缓冲区大小（现在是固定值）
-    buffer_size = io_blocksize();
-    fprintf(stderr, "使用实验确定的最佳固定缓冲区大小: %zu 字节\n", buffer_size);
-
-    // 5. 使用 align_alloc 动态分配页对齐的缓冲区内存
-    buffer = align_alloc(buffer_size);
-    if (buffer == NULL) {
-        perror("分配页对齐缓冲区内存失败");
-        close(fd_in);
-        exit(EXIT_FAILURE);
-    }
-
-    // 6. 循环读取文件内容到缓冲区，然后将缓冲区内容写入标准输出
-    while ((bytes_read = read(fd_in, buffer, buffer_size)) > 0) {
-        bytes_written = write(STDOUT_FILENO, buffer, bytes_read);
-        if (bytes_written != bytes_read) {
-            perror("写入标准输出失败或未完全写入");
-            close(fd_in);
-            align_free(buffer);
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    // 7. 检查循环终止原因
-    if (bytes_read == -1) {
-        perror("读取文件失败");
-        close(fd_in);
-        align_free(buffer);
-        exit(EXIT_FAILURE);
-    }
-
-    // 8. 关闭文件
-    if (close(fd_in) == -1) {
-        perror("关闭文件失败");
-        align_free(buffer);
-        exit(EXIT_FAILURE);
-    }
-
-    // 9. 释放动态分配的缓冲区内存
-    align_free(buffer);
-
-    // 程序成功执行完毕
-    return EXIT_SUCCESS;
+// mycat6.c - 一个使用实验确定最佳固定缓冲区大小，并使用posix_fadvise进行优化的cat程序
+
+#define _GNU_SOURCE     // 启用 SCHED_IDLE、sync_file_range 等 Linux 扩展
+#include <unistd.h>     // 包含 read, write, open 等系统调用
+#include <fcntl.h>      // 包含文件控制选项，如 O_RDONLY, posix_fadvise
+#include <stdio.h>      // 包含 perror, fprintf 函数
+#include <stdlib.h>     // 包含 exit, malloc, free 函数
+#include <stdint.h>     // 包含 uintptr_t，用于指针和整数之间的安全转换
+#include <errno.h>      // 包含 errno，用于错误处理
+#include <string.h>     // 包含 memchr, memcpy 函数
+#include <getopt.h>     // 包含 getopt_long，用于解析命令行选项
+#include <pthread.h>    // 包含 pthread_create 等线程函数，用于并行模式
+#include <sys/stat.h>   // 包含 fstat 和 struct stat，用于判断输入是否可定位
+#include <time.h>       // 包含 clock_gettime，用于统计耗时
+#include <sched.h>      // 包含 sched_setscheduler 和 SCHED_IDLE
+#include <sys/resource.h> // 包含 setpriority
+#include <sys/syscall.h>  // 包含 SYS_ioprio_set (glibc 没有提供包装函数)
+#include <sys/mman.h>   // 包含 madvise, mlock, shm_open
+#include <signal.h>     // 包含 sigaction，用于 SIGUSR1 进度报告
+#include <sys/ioctl.h>  // 包含 ioctl，用于查询块设备参数
+#include <linux/fs.h>   // 包含 BLKGETSIZE64, BLKSSZGET, BLKIOOPT
+#include <sys/vfs.h>    // 包含 fstatfs，用于识别 /proc、/sys 等伪文件系统
+#include <poll.h>       // 包含 poll，用于 --flush-interval 的限时攒批
+#include <sys/random.h> // 包含 getrandom，用于生成加密流的随机盐
+#include <setjmp.h>     // 包含 sigsetjmp，用于 mmap 引擎从 SIGBUS 中恢复
+
+// 定义实验确定的最佳缓冲区大小 (2MB)
+// 这个值是基于对系统调用开销的实验测量得出的。
+#define OPTIMAL_BUFFER_SIZE (2 * 1024 * 1024) // 2MB
+
+// get_system_page_size 函数：获取系统内存页大小
+// 这是一个辅助函数，用于 align_alloc 中的页对齐计算。
+// 返回值: 系统的内存页大小，如果获取失败则返回一个默认值 (4096)
+long get_system_page_size() {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size == -1) {
+        perror("警告: 无法获取系统页大小，将使用默认值 4096 字节进行对齐");
+        return 4096;
+    }
+    return page_size;
+}
+
+// 启动时从 cgroup v2 读取的资源限制，以及据此选定的参数 (见 detect_resource_limits)
+struct resource_limits {
+    int in_cgroup;           // 是否找到了本进程的 cgroup v2 目录
+    uint64_t memory_max;     // memory.max，0 表示不受限
+    uint64_t memory_current; // memory.current
+    uint64_t memory_file;    // memory.stat 中的 file，即计入 memory.current 的页缓存
+    uint64_t memory_budget;  // 允许用于缓冲区的内存，0 表示不受限
+    double cpu_limit;        // cpu.max 折算的 CPU 个数，0 表示不受限
+    char io_max[256];        // io.max 的原始内容，空串表示不受限
+    size_t buffer_cap;       // 缓冲区大小上限，0 表示不受限
+};
+
+static struct resource_limits g_limits;
+
+// io_blocksize 函数：返回实验确定的最佳缓冲区大小
+// 此函数不再根据文件系统或页大小动态调整，而是返回一个固定的优化值；
+// 只有当 cgroup 的内存限制放不下时才缩小。
+size_t io_blocksize() {
+    if (g_limits.buffer_cap > 0 && g_limits.buffer_cap < OPTIMAL_BUFFER_SIZE) {
+        return g_limits.buffer_cap;
+    }
+    return OPTIMAL_BUFFER_SIZE;
+}
+
+// align_alloc 函数：分配一段内存，长度不小于 size 并且返回一个对齐到内存页起始的指针
+// 参数: size - 需要分配的最小字节数
+// 返回值: 对齐到内存页起始的指针，如果分配失败则返回 NULL
+char* align_alloc(size_t size) {
+    // 获取系统页大小，用于内存对齐计算。
+    size_t page_size = (size_t)get_system_page_size();
+
+    // 我们需要分配额外的空间来存储原始的 malloc 指针，以及确保有足够的空间进行对齐。
+    char *original_ptr = (char *)malloc(size + page_size - 1 + sizeof(void*));
+    if (original_ptr == NULL) {
+        return NULL; // 内存分配失败
+    }
+
+    // 计算页对齐后的地址：
+    uintptr_t aligned_addr_val = ((uintptr_t)(original_ptr + sizeof(void*)) + page_size - 1) & ~(page_size - 1);
+    char *aligned_ptr = (char*)aligned_addr_val;
+
+    // 将原始的 malloc 返回的指针存储在对齐地址的前面 sizeof(void*) 的位置。
+    *((char**)(aligned_ptr - sizeof(void*))) = original_ptr;
+
+    return aligned_ptr;
+}
+
+// align_free 函数：释放先前从 align_alloc 返回的内存
+// 参数: ptr - 从 align_alloc 返回的页对齐指针
+void align_free(void* ptr) {
+    if (ptr == NULL) {
+        return; // 处理 NULL 指针，避免崩溃
+    }
+    // 从对齐地址的前面 sizeof(void*) 的位置获取原始 malloc 返回的指针。
+    char *original_ptr = *((char**)((char*)ptr - sizeof(void*)));
+    free(original_ptr); // 释放原始的、由 malloc 分配的内存块。
+}
+
+// 命令行选项
+struct cat_options {
+    int number_lines; // -n: 为所有输出行编号
+    int threads;      // -j: 并行模式使用的线程数，0 表示自动选择
+    int stats;        // --stats: 结束时打印统计信息
+    int background;   // --background: 以空闲 I/O 和 CPU 优先级运行，并丢弃用过的页缓存
+    int pin_buffers;  // --pin-buffers: 预缺页并用 mlock 锁定 I/O 缓冲区
+    int engine;       // --engine: 没有变换阶段时使用的复制引擎 (enum copy_engine)
+    int engine_explicit; // 是否显式给出了 --engine (否则可以根据页缓存驻留情况自动选择)
+    int progress_interval; // --progress: 进度报告的间隔秒数，0 表示只响应 SIGUSR1
+    const char *metrics_path; // --metrics-file: Prometheus 文本格式指标的输出路径
+    int metrics_interval;     // --metrics-interval: 指标文件的刷新间隔秒数
+    int shm_stats;            // --shm-stats: 运行期间定期把本进程的计数累加到主机级共享内存段
+    int top;                  // --top: 不复制文件，持续显示共享内存段中的主机级统计
+    int cache_command;        // --warm/--evict/--lock: 不复制文件，管理文件的页缓存 (enum cache_command)
+    int source;               // --source: 输入的来源 (enum source_kind)
+    uint64_t source_size;     // --size: 合成数据源产生的字节数
+    int sink;                 // --sink: 输出的去向 (enum sink_kind)
+    const char *manifest;     // --manifest: 批量复制清单的路径
+    int max_open;             // --max-open: 批量复制同时打开的文件描述符上限，0 表示自动选择
+    int flush_interval;       // --flush-interval: 输入断续到达时，数据最多攒这么多毫秒就写出，0 表示不攒
+    uint64_t first_line;      // --line/--lines: 只输出第 first_line 到 last_line 行 (从 1 开始)，0 表示不启用
+    uint64_t last_line;       // UINT64_MAX 表示到文件结尾
+    const char *index_path;   // --index: 行索引文件的路径，NULL 表示使用默认位置
+    const char *update_path;  // --update: 增量更新的目标文件，只写入与输入不同的块
+};
+
+static struct cat_options g_opts;
+
+// 系统调用耗时直方图的桶上界 (纳秒)，最后还有一个 +Inf 桶
+#define LATENCY_BUCKETS 7
+static const uint64_t g_latency_bounds[LATENCY_BUCKETS - 1] = {
+    10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+enum latency_op { LAT_READ, LAT_WRITE, LAT_OPS };
+
+// 运行统计 (--stats, --metrics-file)
+struct cat_stats {
+    uint64_t bytes_read;
+    uint64_t read_calls;
+    uint64_t bytes_written;
+    uint64_t write_calls;
+    uint64_t errors;    // 失败的读写系统调用次数 (不含 EINTR)
+    uint64_t latency[LAT_OPS][LATENCY_BUCKETS]; // 各桶的调用次数 (不累积)
+    uint64_t latency_sum_ns[LAT_OPS];
+    struct timespec start;
+    size_t buffer_size; // 选定的缓冲区大小
+    size_t tile_size;   // 变换阶段的分片大小 (没有启用变换时为 0)
+    const char *engine; // 实际使用的复制引擎
+    int threads;        // 选定的线程数 (顺序模式为 1)
+    uint64_t minflt_start, majflt_start;     // 启动时的缺页次数
+    uint64_t minflt_prepared, majflt_prepared; // 分配完缓冲区、开始复制前的缺页次数
+    int succeeded;      // 复制是否成功完成 (出错退出时为 0)
+    double residency;   // 开始复制前输入在页缓存中的比例
+    const char *residency_method; // 探测驻留比例的方法，NULL 表示没有探测
+    const char *cache_policy;     // 据此选择的读取策略
+    uint64_t first_byte_ns;       // 第一个输出字节写出时的单调时钟 (纳秒)，0 表示还没有输出
+};
+
+static struct cat_stats g_stats;
+
+// stat_add 函数：累加一个统计计数器，工作线程也会调用，因此使用原子操作
+static inline void stat_add(uint64_t *counter, uint64_t v) {
+    __atomic_fetch_add(counter, v, __ATOMIC_RELAXED);
+}
+
+// set_engine 函数：记录实际使用的复制引擎；指标导出与共享统计的线程会同时读取，因此原子地存储
+static inline void set_engine(const char *name) {
+    __atomic_store_n(&g_stats.engine, name, __ATOMIC_RELAXED);
+}
+
+// current_engine 函数：读取实际使用的复制引擎，还没有选定时返回 NULL
+static inline const char *current_engine() {
+    return __atomic_load_n(&g_stats.engine, __ATOMIC_RELAXED);
+}
+
+// now_ns 函数：返回单调时钟的纳秒数
+uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+// stat_written 函数：累加写出的字节数，并记下第一个字节写出的时间 (首字节时间)
+static inline void stat_written(uint64_t n) {
+    stat_add(&g_stats.bytes_written, n);
+    if (n > 0 && __atomic_load_n(&g_stats.first_byte_ns, __ATOMIC_RELAXED) == 0) {
+        uint64_t zero = 0;
+        __atomic_compare_exchange_n(&g_stats.first_byte_ns, &zero, now_ns(), 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+}
+
+static int g_latency_enabled; // 只有导出指标时才为每次系统调用计时
+
+// latency_start 函数：开始为一次系统调用计时，未启用时返回 0
+static inline uint64_t latency_start() {
+    return g_latency_enabled ? now_ns() : 0;
+}
+
+// latency_record 函数：把从 t0 开始的一次系统调用耗时计入 op 的直方图
+static inline void latency_record(enum latency_op op, uint64_t t0) {
+    if (t0 == 0) {
+        return;
+    }
+    uint64_t ns = latency_start() - t0;
+    int b = 0;
+    while (b < LATENCY_BUCKETS - 1 && ns > g_latency_bounds[b]) {
+        b++;
+    }
+    stat_add(&g_stats.latency[op][b], 1);
+    stat_add(&g_stats.latency_sum_ns[op], ns);
+}
+
+// read_input 函数：带统计的 read
+ssize_t read_input(int fd, char *buf, size_t len) {
+    uint64_t t0 = latency_start();
+    ssize_t n = read(fd, buf, len);
+    latency_record(LAT_READ, t0);
+    stat_add(&g_stats.read_calls, 1);
+    if (n > 0) {
+        stat_add(&g_stats.bytes_read, (uint64_t)n);
+    } else if (n == -1 && errno != EINTR) {
+        stat_add(&g_stats.errors, 1);
+    }
+    return n;
+}
+
+// write_all 函数：将 len 字节完整写入 fd，处理被信号打断和部分写入的情况
+// 返回值: 成功返回 0，失败返回 -1 (errno 由 write 设置)
+int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        uint64_t t0 = latency_start();
+        ssize_t n = write(fd, buf, len);
+        latency_record(LAT_WRITE, t0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            stat_add(&g_stats.errors, 1);
+            return -1;
+        }
+        stat_add(&g_stats.write_calls, 1);
+        stat_written((uint64_t)n);
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// pwrite_all 函数：将 len 字节完整写入 fd 的 offset 处，处理被信号打断和部分写入的情况
+// 返回值: 成功返回 0，失败返回 -1 (errno 由 pwrite 设置)
+int pwrite_all(int fd, const char *buf, size_t len, off_t offset) {
+    while (len > 0) {
+        uint64_t t0 = latency_start();
+        ssize_t n = pwrite(fd, buf, len, offset);
+        latency_record(LAT_WRITE, t0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            stat_add(&g_stats.errors, 1);
+            return -1;
+        }
+        stat_add(&g_stats.write_calls, 1);
+        stat_written((uint64_t)n);
+        buf += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// pread_full 函数：从 offset 处读取最多 len 字节，直到读满或遇到文件结尾
+// 返回值: 实际读取的字节数，失败返回 -1
+ssize_t pread_full(int fd, char *buf, size_t len, off_t offset) {
+    size_t total = 0;
+    while (total < len) {
+        uint64_t t0 = latency_start();
+        ssize_t n = pread(fd, buf + total, len - total, offset + (off_t)total);
+        latency_record(LAT_READ, t0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            stat_add(&g_stats.errors, 1);
+            return -1;
+        }
+        stat_add(&g_stats.read_calls, 1);
+        if (n == 0) {
+            break; // 文件结尾
+        }
+        stat_add(&g_stats.bytes_read, (uint64_t)n);
+        total += (size_t)n;
+    }
+    return (ssize_t)total;
+}
+
+// drop_cache_range 函数：后台模式 (--background) 下丢弃 fd 中 [offset, offset + len) 的页缓存，
+// len 为 0 表示到文件结尾。written 为 1 时先等这段的回写完成，脏页是丢不掉的。
+// 管道等没有页缓存的描述符上调用是无害的 (系统调用返回 ESPIPE)
+void drop_cache_range(int fd, off_t offset, off_t len, int written) {
+    if (!g_opts.background) {
+        return;
+    }
+    if (written) {
+        sync_file_range(fd, offset, len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    }
+    posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+}
+
+// 后台模式下的页缓存丢弃状态: 处理过的数据不再留在页缓存中挤占前台服务
+struct drop_behind {
+    int fd_in;
+    off_t in_offset;     // 已丢弃到的输入偏移
+    int out_regular;     // 标准输出是否为普通文件 (只有它才有可丢弃的页缓存)
+    off_t out_offset;    // 下一次写出的起始偏移
+    off_t out_pending;   // 已经发起回写但尚未丢弃的范围的起点
+};
+
+// drop_behind_init 函数：记录输入、输出的起始偏移；fd_in 为 -1 时只丢弃输出
+void drop_behind_init(struct drop_behind *d, int fd_in) {
+    struct stat st;
+    memset(d, 0, sizeof(*d));
+    d->fd_in = fd_in;
+    d->in_offset = lseek(fd_in, 0, SEEK_CUR);
+    if (d->in_offset == -1) {
+        d->in_offset = 0;
+    }
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)) {
+        d->out_regular = 1;
+        d->out_offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+        d->out_pending = d->out_offset;
+    }
+}
+
+// drop_behind_block 函数：每写出一个块后调用
+// 输入: 刚处理完的范围直接丢弃。
+// 输出: 对本块只发起异步回写；等待上一个块回写完成后再丢弃它，使回写与复制重叠。
+void drop_behind_block(struct drop_behind *d, size_t in_len, size_t out_len) {
+    if (d->fd_in != -1) {
+        posix_fadvise(d->fd_in, d->in_offset, (off_t)in_len, POSIX_FADV_DONTNEED);
+        d->in_offset += (off_t)in_len;
+    }
+
+    if (!d->out_regular || out_len == 0) {
+        return;
+    }
+    sync_file_range(STDOUT_FILENO, d->out_offset, (off_t)out_len, SYNC_FILE_RANGE_WRITE);
+    if (d->out_offset > d->out_pending) {
+        off_t prev_len = d->out_offset - d->out_pending;
+        sync_file_range(STDOUT_FILENO, d->out_pending, prev_len,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(STDOUT_FILENO, d->out_pending, prev_len, POSIX_FADV_DONTNEED);
+        d->out_pending = d->out_offset;
+    }
+    d->out_offset += (off_t)out_len;
+}
+
+// drop_behind_finish 函数：复制结束后丢弃最后一个块的输出页缓存
+void drop_behind_finish(struct drop_behind *d) {
+    if (!d->out_regular || d->out_offset == d->out_pending) {
+        return;
+    }
+    off_t len = d->out_offset - d->out_pending;
+    sync_file_range(STDOUT_FILENO, d->out_pending, len,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+    posix_fadvise(STDOUT_FILENO, d->out_pending, len, POSIX_FADV_DONTNEED);
+    d->out_pending = d->out_offset;
+}
+
+// ---------------------------------------------------------------------------
+// 合成数据源与接收端 (--source / --sink)
+// ---------------------------------------------------------------------------
+
+// 把复制循环的两端分开测量: 数据源在进程内生成数据，不经过任何设备或系统调用；
+// 接收端直接丢弃缓冲区，不发起 write，可选地读一遍每条缓存行。
+// 这相当于把 dd if=/dev/zero of=/dev/null 实验中的两个设备换成了进程内的实现。
+
+enum source_kind {
+    SOURCE_FILE,    // 从输入文件读取 (默认)
+    SOURCE_ZERO,    // 全零
+    SOURCE_RANDOM,  // 固定种子的伪随机数据，每次运行内容相同
+    SOURCE_PATTERN, // 字节值等于流偏移的低 8 位，便于检查输出是否错位
+};
+
+enum sink_kind {
+    SINK_STDOUT, // 写到标准输出 (默认)
+    SINK_NULL,   // 丢弃，不访问数据
+    SINK_TOUCH,  // 丢弃，但读取每条缓存行一次
+};
+
+#define SOURCE_DEFAULT_SIZE (1024ULL * 1024 * 1024) // --size 的默认值 1GB
+#define CACHE_LINE_SIZE 64
+
+static const char *g_source_names[] = { "file", "zero", "random", "pattern" };
+static const char *g_sink_names[] = { "stdout", "null", "touch" };
+
+static uint64_t g_source_offset; // 合成数据源已经产生的字节数
+static uint64_t g_source_rng = 0x9E3779B97F4A7C15ULL; // xorshift64* 的状态
+static volatile unsigned char g_sink_sum; // 防止编译器把 touch 模式的读取优化掉
+
+// source_read 函数：与 read_input 相同的接口，--source 时由进程内生成数据
+// 返回值: 生成的字节数，达到 --size 后返回 0
+ssize_t source_read(int fd, char *buf, size_t len) {
+    if (g_opts.source == SOURCE_FILE) {
+        return read_input(fd, buf, len);
+    }
+    uint64_t left = g_opts.source_size - g_source_offset;
+    if (len > left) {
+        len = (size_t)left;
+    }
+    if (g_opts.source == SOURCE_ZERO) {
+        memset(buf, 0, len);
+    } else if (g_opts.source == SOURCE_RANDOM) {
+        size_t i = 0;
+        for (; i + 8 <= len; i += 8) {
+            g_source_rng ^= g_source_rng >> 12;
+            g_source_rng ^= g_source_rng << 25;
+            g_source_rng ^= g_source_rng >> 27;
+            uint64_t v = g_source_rng * 0x2545F4914F6CDD1DULL;
+            memcpy(buf + i, &v, 8);
+        }
+        for (; i < len; i++) {
+            buf[i] = (char)(g_source_rng >> (8 * (i & 7)));
+        }
+    } else {
+        for (size_t i = 0; i < len; i++) {
+            buf[i] = (char)(g_source_offset + i);
+        }
+    }
+    g_source_offset += len;
+    stat_add(&g_stats.bytes_read, len);
+    return (ssize_t)len;
+}
+
+// emit_output 函数：把 len 字节交给接收端；默认写到标准输出
+// 返回值: 成功返回 0，失败返回 -1 (errno 由 write 设置)
+int emit_output(const char *buf, size_t len) {
+    if (g_opts.sink == SINK_STDOUT) {
+        return write_all(STDOUT_FILENO, buf, len);
+    }
+    if (g_opts.sink == SINK_TOUCH) {
+        unsigned char sum = 0;
+        for (size_t i = 0; i < len; i += CACHE_LINE_SIZE) {
+            sum += (unsigned char)buf[i];
+        }
+        g_sink_sum += sum;
+    }
+    stat_written(len);
+    return 0;
+}
+
+// parse_size 函数：解析带可选 K/M/G 后缀 (1024 进制) 的字节数
+// 返回值: 成功返回 0，格式错误返回 -1
+int parse_size(const char *str, uint64_t *out) {
+    char *end;
+    errno = 0;
+    unsigned long long v = strtoull(str, &end, 10);
+    if (errno != 0 || end == str) {
+        return -1;
+    }
+    switch (*end) {
+    case 'G': case 'g': v *= 1024; /* fall through */
+    case 'M': case 'm': v *= 1024; /* fall through */
+    case 'K': case 'k': v *= 1024; end++; break;
+    case '\0': break;
+    default: return -1;
+    }
+    if (*end != '\0') {
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// 预缺页并锁定的缓冲区 (--pin-buffers)
+// ---------------------------------------------------------------------------
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23 // Linux 5.14 起提供，旧的头文件中没有定义
+#endif
+
+static uint64_t g_locked_peak;     // 进程锁定内存的峰值 (字节)
+static int g_memlock_warned;      // 是否已经报告过无法锁定
+
+// locked_bytes 函数：从 /proc/self/status 的 VmLck 读取本进程当前锁定的内存字节数
+uint64_t locked_bytes() {
+    FILE *f = fopen("/proc/self/status", "r");
+    if (f == NULL) {
+        return 0;
+    }
+    char line[256];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "VmLck: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return (uint64_t)kb * 1024;
+}
+
+// prefault_buffer 函数：让 buf 的每一页立即分配物理内存，避免复制中途的缺页停顿
+void prefault_buffer(char *buf, size_t size) {
+    if (madvise(buf, size, MADV_POPULATE_WRITE) == 0) {
+        return;
+    }
+    // 内核不支持 MADV_POPULATE_WRITE 时逐页写一个字节
+    size_t page_size = (size_t)get_system_page_size();
+    for (size_t off = 0; off < size; off += page_size) {
+        ((volatile char *)buf)[off] = 0;
+    }
+}
+
+// pin_buffer 函数：在 RLIMIT_MEMLOCK 允许的范围内用 mlock 锁定 buf，防止被回收或换出
+void pin_buffer(char *buf, size_t size) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && locked_bytes() + size > rl.rlim_cur) {
+        if (!__atomic_exchange_n(&g_memlock_warned, 1, __ATOMIC_RELAXED)) {
+            fprintf(stderr, "警告: 超出 RLIMIT_MEMLOCK (%llu 字节)，其余缓冲区只预缺页不锁定\n",
+                    (unsigned long long)rl.rlim_cur);
+        }
+        return;
+    }
+    if (mlock(buf, size) == -1) {
+        if (!__atomic_exchange_n(&g_memlock_warned, 1, __ATOMIC_RELAXED)) {
+            perror("警告: mlock 失败，缓冲区只预缺页不锁定");
+        }
+        return;
+    }
+    uint64_t now = locked_bytes();
+    uint64_t peak = __atomic_load_n(&g_locked_peak, __ATOMIC_RELAXED);
+    while (now > peak && !__atomic_compare_exchange_n(&g_locked_peak, &peak, now, 1,
+                                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// io_buffer_alloc 函数：分配一个页对齐的 I/O 缓冲区；--pin-buffers 时预缺页并锁定
+char *io_buffer_alloc(size_t size) {
+    char *buf = align_alloc(size);
+    if (buf != NULL && g_opts.pin_buffers) {
+        prefault_buffer(buf, size);
+        pin_buffer(buf, size);
+    }
+    return buf;
+}
+
+// io_buffer_free 函数：释放 io_buffer_alloc 分配的缓冲区
+// 参数: size - 分配时的大小，用于解除锁定
+void io_buffer_free(char *buf, size_t size) {
+    if (buf == NULL) {
+        return;
+    }
+    if (g_opts.pin_buffers) {
+        munlock(buf, size);
+    }
+    align_free(buf);
+}
+
+// page_faults 函数：返回本进程到目前为止的次要和主要缺页次数
+void page_faults(uint64_t *minor, uint64_t *major) {
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) == 0) {
+        *minor = (uint64_t)ru.ru_minflt;
+        *major = (uint64_t)ru.ru_majflt;
+    } else {
+        *minor = *major = 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 资源限制 (cgroup v2) 与统计信息 (--stats)
+// ---------------------------------------------------------------------------
+
+// cgroup v2 统一层级的挂载点
+#define CGROUP2_ROOT "/sys/fs/cgroup"
+// 最多把可用内存的这一比例用于 I/O 缓冲区，其余留给页缓存和进程的其他部分
+#define MEMORY_BUDGET_DIVISOR 4
+// 受限时缓冲区的下限
+#define MIN_BUFFER_SIZE (64 * 1024)
+
+// read_small_file 函数：把一个小文件 (cgroup 接口文件) 的内容读入 buf 并以 '\0' 结尾
+// 返回值: 成功返回读取的字节数，失败返回 -1
+ssize_t read_small_file(const char *path, char *buf, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n < 0) {
+        return -1;
+    }
+    buf[n] = '\0';
+    if (n > 0 && buf[n - 1] == '\n') {
+        buf[--n] = '\0';
+    }
+    return n;
+}
+
+// cgroup_path 函数：从 /proc/self/cgroup 中找出本进程所在的 cgroup v2 目录
+// 返回值: 成功返回 0，不在 cgroup v2 中返回 -1
+int cgroup_path(char *path, size_t size) {
+    char buf[4096];
+    if (read_small_file("/proc/self/cgroup", buf, sizeof(buf)) == -1) {
+        return -1;
+    }
+    // cgroup v2 的条目形如 "0::/system.slice/foo.service"
+    char *line = buf;
+    while (line != NULL && *line != '\0') {
+        char *next = strchr(line, '\n');
+        if (next != NULL) {
+            *next++ = '\0';
+        }
+        if (strncmp(line, "0::", 3) == 0) {
+            snprintf(path, size, "%s%s", CGROUP2_ROOT, line + 3);
+            size_t len = strlen(path);
+            if (len > 1 && path[len - 1] == '/') {
+                path[len - 1] = '\0';
+            }
+            return 0;
+        }
+        line = next;
+    }
+    return -1;
+}
+
+// detect_resource_limits 函数：读取 cgroup 的 memory.max、cpu.max 和 io.max，
+// 据此确定缓冲区大小上限和默认线程数，结果保存在 g_limits 中
+void detect_resource_limits() {
+    char dir[4096];
+    char buf[4096];
+    char file[4200];
+
+    if (cgroup_path(dir, sizeof(dir)) == -1) {
+        return;
+    }
+    g_limits.in_cgroup = 1;
+
+    if (snprintf(file, sizeof(file), "%s/memory.current", dir) > 0
+        && read_small_file(file, buf, sizeof(buf)) > 0) {
+        g_limits.memory_current = strtoull(buf, NULL, 10);
+    }
+    // memory.current 包含页缓存，而页缓存在压力下可以回收，不应占用缓冲区预算。
+    // memory.stat 的每行形如 "file 123456"
+    char stat[8192];
+    if (snprintf(file, sizeof(file), "%s/memory.stat", dir) > 0
+        && read_small_file(file, stat, sizeof(stat)) > 0) {
+        for (char *line = stat; line != NULL && *line != '\0'; ) {
+            char *next = strchr(line, '\n');
+            if (next != NULL) {
+                *next++ = '\0';
+            }
+            if (strncmp(line, "file ", 5) == 0) {
+                g_limits.memory_file = strtoull(line + 5, NULL, 10);
+                break;
+            }
+            line = next;
+        }
+    }
+    if (snprintf(file, sizeof(file), "%s/io.max", dir) > 0
+        && read_small_file(file, buf, sizeof(buf)) > 0) {
+        snprintf(g_limits.io_max, sizeof(g_limits.io_max), "%.*s", (int)sizeof(g_limits.io_max) - 1, buf);
+        for (char *p = g_limits.io_max; *p != '\0'; p++) {
+            if (*p == '\n') {
+                *p = ';';
+            }
+        }
+    }
+
+    // 生效的限制是本 cgroup 和所有祖先中最严格的那个，因此逐级向上查找
+    for (;;) {
+        if (snprintf(file, sizeof(file), "%s/memory.max", dir) > 0
+            && read_small_file(file, buf, sizeof(buf)) > 0 && strcmp(buf, "max") != 0) {
+            uint64_t v = strtoull(buf, NULL, 10);
+            if (g_limits.memory_max == 0 || v < g_limits.memory_max) {
+                g_limits.memory_max = v;
+            }
+        }
+        if (snprintf(file, sizeof(file), "%s/cpu.max", dir) > 0
+            && read_small_file(file, buf, sizeof(buf)) > 0 && strncmp(buf, "max", 3) != 0) {
+            // 格式为 "$QUOTA $PERIOD"
+            char *end;
+            double quota = strtod(buf, &end);
+            double period = strtod(end, NULL);
+            if (quota > 0 && period > 0) {
+                double cpus = quota / period;
+                if (g_limits.cpu_limit == 0 || cpus < g_limits.cpu_limit) {
+                    g_limits.cpu_limit = cpus;
+                }
+            }
+        }
+        if (strcmp(dir, CGROUP2_ROOT) == 0) {
+            break;
+        }
+        char *slash = strrchr(dir, '/');
+        if (slash == NULL || slash == dir) {
+            break;
+        }
+        *slash = '\0';
+    }
+
+    // 缓冲区上限: 可用内存预算除以同时存在的缓冲区的大致个数，向下取整到 2 的幂。
+    // 已用内存只算不可回收的部分 (memory.current 减去页缓存)
+    if (g_limits.memory_max > 0) {
+        uint64_t used = g_limits.memory_current > g_limits.memory_file
+                            ? g_limits.memory_current - g_limits.memory_file : 0;
+        uint64_t avail = g_limits.memory_max > used ? g_limits.memory_max - used : 0;
+        g_limits.memory_budget = avail / MEMORY_BUDGET_DIVISOR;
+        size_t cap = OPTIMAL_BUFFER_SIZE;
+        while (cap > MIN_BUFFER_SIZE && (uint64_t)cap * 8 > g_limits.memory_budget) {
+            cap /= 2;
+        }
+        g_limits.buffer_cap = cap;
+    }
+}
+
+// 并行编号时每个槽位的输出容量为块大小的倍数；换行密集的块格式化后
+// 可能远大于这个容量，此时分成多段依次交给写出线程，而不是按最坏情况分配
+#define NUMBER_SLOT_OUT_FACTOR 2
+
+// default_thread_count 函数：返回并行模式默认使用的线程数
+// 取在线 CPU 数与 cpu.max 配额 (向上取整) 中较小者，避免超出配额后被节流；
+// 内存受限时再保证每个线程的读缓冲区和两个输出槽位不超出内存预算。
+int default_thread_count() {
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1) {
+        n = 1;
+    }
+    if (g_limits.cpu_limit > 0) {
+        long quota = (long)g_limits.cpu_limit;
+        if ((double)quota < g_limits.cpu_limit) {
+            quota++;
+        }
+        if (quota < n) {
+            n = quota;
+        }
+    }
+    if (g_limits.memory_budget > 0) {
+        uint64_t per_thread = (uint64_t)io_blocksize() * (1 + 2 * NUMBER_SLOT_OUT_FACTOR);
+        long fit = (long)(g_limits.memory_budget / per_thread);
+        if (fit < n) {
+            n = fit > 1 ? fit : 1;
+        }
+    }
+    return (int)n;
+}
+
+// time_to_first_byte 函数：返回从启动到写出第一个输出字节经过的秒数，还没有输出时返回 0
+double time_to_first_byte() {
+    uint64_t first = __atomic_load_n(&g_stats.first_byte_ns, __ATOMIC_RELAXED);
+    if (first == 0) {
+        return 0;
+    }
+    uint64_t start = (uint64_t)g_stats.start.tv_sec * 1000000000 + (uint64_t)g_stats.start.tv_nsec;
+    return (double)(first - start) / 1e9;
+}
+
+// print_stats 函数：在标准错误输出上打印本次运行的统计信息和所选的资源参数
+void print_stats() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = (double)(now.tv_sec - g_stats.start.tv_sec)
+                     + (double)(now.tv_nsec - g_stats.start.tv_nsec) / 1e9;
+
+    fprintf(stderr, "统计: 读取 %llu 字节 (%llu 次读调用)，写出 %llu 字节 (%llu 次写调用)，"
+                    "耗时 %.3f 秒，%.1f MB/s\n",
+            (unsigned long long)g_stats.bytes_read, (unsigned long long)g_stats.read_calls,
+            (unsigned long long)g_stats.bytes_written, (unsigned long long)g_stats.write_calls,
+            elapsed, elapsed > 0 ? (double)g_stats.bytes_read / elapsed / (1024 * 1024) : 0.0);
+    if (g_stats.first_byte_ns != 0) {
+        fprintf(stderr, "首字节: 启动后 %.3f 毫秒写出第一个输出字节\n", time_to_first_byte() * 1000);
+    }
+
+    if (!g_limits.in_cgroup) {
+        fprintf(stderr, "资源: 未检测到 cgroup v2\n");
+    } else {
+        char mem[32] = "max";
+        char cpu[32] = "max";
+        if (g_limits.memory_max > 0) {
+            snprintf(mem, sizeof(mem), "%llu", (unsigned long long)g_limits.memory_max);
+        }
+        if (g_limits.cpu_limit > 0) {
+            snprintf(cpu, sizeof(cpu), "%.2f CPU", g_limits.cpu_limit);
+        }
+        fprintf(stderr, "资源: memory.max=%s, cpu.max=%s, io.max=%s\n",
+                mem, cpu, g_limits.io_max[0] ? g_limits.io_max : "max");
+    }
+    fprintf(stderr, "参数: 缓冲区 %zu 字节，", g_stats.buffer_size);
+    if (g_stats.tile_size > 0) {
+        fprintf(stderr, "变换分片 %zu 字节，", g_stats.tile_size);
+    }
+    fprintf(stderr, "线程 %d，引擎 %s\n", g_stats.threads, g_stats.engine);
+    if (g_opts.source != SOURCE_FILE || g_opts.sink != SINK_STDOUT) {
+        fprintf(stderr, "合成端: 数据源 %s，接收端 %s\n",
+                g_source_names[g_opts.source], g_sink_names[g_opts.sink]);
+    }
+
+    uint64_t minflt, majflt;
+    page_faults(&minflt, &majflt);
+    fprintf(stderr, "缺页: 准备阶段 %llu 次要 / %llu 主要，复制阶段 %llu 次要 / %llu 主要",
+            (unsigned long long)(g_stats.minflt_prepared - g_stats.minflt_start),
+            (unsigned long long)(g_stats.majflt_prepared - g_stats.majflt_start),
+            (unsigned long long)(minflt - g_stats.minflt_prepared),
+            (unsigned long long)(majflt - g_stats.majflt_prepared));
+    if (g_opts.pin_buffers) {
+        fprintf(stderr, "，mlock 锁定峰值 %llu 字节", (unsigned long long)g_locked_peak);
+    }
+    fprintf(stderr, "\n");
+
+    if (g_stats.residency_method != NULL) {
+        fprintf(stderr, "页缓存: 输入驻留 %.1f%% (%s)，读取策略 %s\n",
+                g_stats.residency * 100, g_stats.residency_method, g_stats.cache_policy);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 变换阶段
+// ---------------------------------------------------------------------------
+
+// 变换阶段：复制循环在 read 与 write 之间按顺序调用各阶段处理缓冲区。
+// 为了让每个字节只进入一次缓存，读入的大块被切成 L2 大小的分片，
+// 每个分片依次流经所有阶段后再处理下一个分片；read/write 仍然按大块进行。
+struct transform {
+    const char *name;
+    // 输入 len 字节时输出长度的上界，用于预先分配本阶段的输出缓冲区
+    size_t (*out_bound)(size_t len);
+    // 处理 in 中的 len 字节，返回输出数据的指针 (可以是 in 本身，也可以是 out)，
+    // 输出长度写入 *out_len。final 为 1 表示输入已结束，需要冲刷阶段内残留的状态。
+    char *(*apply)(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final);
+    void *state;
+    size_t in_align; // 作为第一个阶段时，希望每次读取的长度是它的整数倍 (0 表示不要求)
+    char *out;  // 本阶段一个分片的输出缓冲区，由 setup_transforms 分配 (最后一个阶段直接写入块输出缓冲区)
+    size_t out_size;
+    int stop;   // 阶段要求在写出本次输出后终止复制 (例如校验失败)
+};
+
+#define MAX_TRANSFORMS 8
+
+// 分片大小取 L2 容量的一半，并限制在这个范围内
+#define MIN_TILE_SIZE (64 * 1024)
+#define MAX_TILE_SIZE (256 * 1024)
+// 各阶段输出缓冲区 (中间分片 + 块输出) 合计不超过读缓冲区的这个倍数。读缓冲区已经受
+// cgroup 内存上限约束，输出会膨胀很多倍的阶段 (例如 -n 最坏每字节一个行号) 因此改为缩小
+// 每次读取的长度，必要时再缩小分片，而不是按最坏情况分配几十倍的内存
+#define TRANSFORM_OUT_FACTOR 4
+// 为满足上面的限制缩小分片时的下限
+#define MIN_SHRUNK_TILE_SIZE (4 * 1024)
+
+static struct transform g_transforms[MAX_TRANSFORMS];
+static int g_ntransforms;
+static size_t g_tile_size;       // 分片大小
+static size_t g_transform_read_max; // 受输出缓冲区限制的每次最多读取字节数，0 表示不限制
+static char *g_block_out;        // 整个读块经过所有阶段后的输出，一次 write 写出
+static size_t g_block_out_size;
+
+// add_transform 函数：把一个阶段追加到变换链末尾
+void add_transform(const struct transform *t) {
+    if (g_ntransforms == MAX_TRANSFORMS) {
+        fprintf(stderr, "启用的变换阶段过多\n");
+        exit(EXIT_FAILURE);
+    }
+    g_transforms[g_ntransforms++] = *t;
+}
+
+// transform_tile_size 函数：根据 L2 缓存大小选择分片大小，并满足第一个阶段的对齐要求
+size_t transform_tile_size() {
+    long l2 = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    size_t tile = l2 > 0 ? (size_t)l2 / 2 : MAX_TILE_SIZE;
+    if (tile < MIN_TILE_SIZE) {
+        tile = MIN_TILE_SIZE;
+    } else if (tile > MAX_TILE_SIZE) {
+        tile = MAX_TILE_SIZE;
+    }
+    if (g_ntransforms > 0 && g_transforms[0].in_align > 1) {
+        tile -= tile % g_transforms[0].in_align;
+    }
+    return tile;
+}
+
+// transform_chain_bound 函数：一个 tile 字节的分片流经所有阶段后的输出上界
+// 参数: inter - 写入中间阶段输出缓冲区的总大小 (不含最后一个阶段)
+// 返回值: 最后一个阶段 (块输出缓冲区中) 每个分片最多占用的字节数
+size_t transform_chain_bound(size_t tile, size_t *inter) {
+    size_t len = tile;
+    int any_bound = 0;
+    *inter = 0;
+    for (int i = 0; i < g_ntransforms; i++) {
+        struct transform *t = &g_transforms[i];
+        if (t->out_bound == NULL) {
+            continue; // 原地处理的阶段不需要输出缓冲区
+        }
+        any_bound = 1;
+        len = t->out_bound(len);
+        if (i < g_ntransforms - 1) {
+            *inter += len;
+        }
+    }
+    return any_bound && len > tile ? len : tile;
+}
+
+// setup_transforms 函数：按每次最多读取 buffer_size 字节为各阶段分配输出缓冲区。
+// 输出缓冲区合计超过 TRANSFORM_OUT_FACTOR * buffer_size 时减少每次读取的分片数，
+// 一个分片都放不下时再缩小分片，结果通过 transform_read_size 生效
+// 返回值: 成功返回 0，失败返回 -1
+int setup_transforms(size_t buffer_size) {
+    if (g_ntransforms == 0) {
+        return 0;
+    }
+    size_t limit = buffer_size * TRANSFORM_OUT_FACTOR;
+    size_t align = g_transforms[0].in_align > 1 ? g_transforms[0].in_align : 1;
+    size_t tile = transform_tile_size();
+    size_t inter;
+    size_t per_tile = transform_chain_bound(tile, &inter);
+    while (inter + per_tile > limit && tile / 2 >= MIN_SHRUNK_TILE_SIZE && tile / 2 >= align) {
+        tile /= 2;
+        tile -= tile % align;
+        per_tile = transform_chain_bound(tile, &inter);
+    }
+    g_tile_size = tile;
+    g_stats.tile_size = g_tile_size;
+
+    size_t ntiles = (buffer_size + g_tile_size - 1) / g_tile_size;
+    if (inter + ntiles * per_tile > limit) {
+        ntiles = limit > inter + per_tile ? (limit - inter) / per_tile : 1;
+        g_transform_read_max = ntiles * g_tile_size;
+        fprintf(stderr, "变换阶段的输出最多膨胀到 %.1f 倍，每次读取缩小为 %zu 字节\n",
+                (double)per_tile / (double)g_tile_size, g_transform_read_max);
+    }
+
+    // 中间阶段的输出缓冲区只需容纳一个分片的结果
+    size_t len = g_tile_size;
+    for (int i = 0; i < g_ntransforms - 1; i++) {
+        struct transform *t = &g_transforms[i];
+        if (t->out_bound == NULL) {
+            continue;
+        }
+        len = t->out_bound(len);
+        t->out = io_buffer_alloc(len);
+        t->out_size = len;
+        if (t->out == NULL) {
+            return -1;
+        }
+    }
+
+    // 块输出缓冲区: 每个分片最多产生 per_tile 字节
+    g_block_out_size = ntiles * per_tile;
+    g_block_out = io_buffer_alloc(g_block_out_size);
+    if (g_block_out == NULL) {
+        return -1;
+    }
+    // 最后一个阶段直接写入块输出缓冲区
+    g_transforms[g_ntransforms - 1].out = NULL;
+    return 0;
+}
+
+// transform_read_size 函数：按输出缓冲区的限制和第一个阶段的对齐要求调整每次读取的长度
+size_t transform_read_size(size_t buffer_size) {
+    if (g_transform_read_max > 0 && g_transform_read_max < buffer_size) {
+        buffer_size = g_transform_read_max;
+    }
+    if (g_ntransforms == 0 || g_transforms[0].in_align <= 1) {
+        return buffer_size;
+    }
+    return buffer_size - buffer_size % g_transforms[0].in_align;
+}
+
+// 慢启动: 第一次只读这么多就立即处理并写出，之后每次加倍，直到 transform_read_size。
+// 交互式或流式的下游不必等第一个 2MB 读满 (冷的 NFS 上可能很慢) 才拿到第一个字节，
+// 加倍几次之后就回到稳定的大块读取，吞吐量不受影响。
+#define SLOW_START_INITIAL (16 * 1024)
+
+// slow_start_next 函数：返回下一次读取的大小，从 SLOW_START_INITIAL 开始加倍到 max，
+// 并保持第一个阶段要求的对齐 (O_DIRECT 读取时 16KB 的倍数也满足扇区对齐)
+// 参数: cur - 本次读取的大小，0 表示第一次读取; max - 稳定状态的读取大小
+size_t slow_start_next(size_t cur, size_t max) {
+    size_t next = cur == 0 ? SLOW_START_INITIAL : cur * 2;
+    size_t align = g_ntransforms > 0 && g_transforms[0].in_align > 1 ? g_transforms[0].in_align : 1;
+    next -= next % align;
+    return next == 0 || next > max ? max : next;
+}
+
+// free_transforms 函数：释放各阶段的输出缓冲区
+void free_transforms() {
+    for (int i = 0; i < g_ntransforms; i++) {
+        io_buffer_free(g_transforms[i].out, g_transforms[i].out_size);
+        g_transforms[i].out = NULL;
+    }
+    io_buffer_free(g_block_out, g_block_out_size);
+    g_block_out = NULL;
+}
+
+// run_transforms 函数：让 len 字节数据按分片依次流经所有阶段
+// 所有阶段都原样输出时直接返回 buf，不做任何拷贝；否则结果汇集到块输出缓冲区。
+// 参数: stop - 若有阶段要求终止复制则置 1 (返回的数据截止到终止处)
+// 返回值: 最终输出数据的指针，长度写入 *out_len
+char *run_transforms(char *buf, size_t len, int final, size_t *out_len, int *stop) {
+    if (g_ntransforms == 0) {
+        *out_len = len;
+        return buf;
+    }
+
+    int passthrough = 1; // 到目前为止所有分片都没有被改变
+    size_t op = 0;       // 块输出缓冲区中已有的字节数
+    size_t off = 0;
+    do {
+        size_t tile_len = len - off < g_tile_size ? len - off : g_tile_size;
+        int tile_final = final && off + tile_len == len;
+        char *p = buf + off;
+        size_t plen = tile_len;
+
+        for (int i = 0; i < g_ntransforms; i++) {
+            struct transform *t = &g_transforms[i];
+            // 在所有分片都原样输出期间 op 与 off 相等，块输出缓冲区中的位置与输入一一对应
+            char *dst = i == g_ntransforms - 1 ? g_block_out + (passthrough ? off : op) : t->out;
+            p = t->apply(t, p, plen, dst, &plen, tile_final);
+            if (t->stop) {
+                *stop = 1;
+            }
+        }
+
+        if (passthrough && p == buf + off && plen == tile_len && !*stop) {
+            off += tile_len;
+            continue;
+        }
+        if (passthrough && p == buf + off) {
+            // 仍然是原样输出，只是被终止截短
+            *out_len = off + plen;
+            return buf;
+        }
+        if (passthrough) {
+            // 第一次出现被改变的分片: 把之前原样输出的分片补进块输出缓冲区
+            memcpy(g_block_out, buf, off);
+            op = off;
+            passthrough = 0;
+        }
+        if (p != g_block_out + op) {
+            memcpy(g_block_out + op, p, plen);
+        }
+        op += plen;
+        off += tile_len;
+    } while (off < len && !*stop);
+
+    if (passthrough) {
+        *out_len = len;
+        return buf;
+    }
+    *out_len = op;
+    return g_block_out;
+}
+
+// ---------------------------------------------------------------------------
+// 进度报告 (--progress 与 SIGUSR1)
+// ---------------------------------------------------------------------------
+
+// 复制循环只通过 stat_add 以 relaxed 原子操作累加 g_stats.bytes_read，
+// 进度的读取和格式化都在信号处理函数或报告线程中进行，不影响热路径。
+
+static uint64_t g_progress_total;        // 预计要读取的总字节数 (来自 st_size)，0 表示未知
+static pthread_t g_progress_thread;
+static int g_progress_running;
+static pthread_mutex_t g_progress_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_progress_cond = PTHREAD_COND_INITIALIZER;
+
+// append_uint 函数：把无符号整数格式化为十进制追加到 buf，不使用 printf (信号处理函数中调用)
+// 返回值: 写入的字节数
+size_t append_uint(char *buf, uint64_t v) {
+    char digits[20];
+    size_t nd = 0;
+    do {
+        digits[nd++] = (char)('0' + v % 10);
+        v /= 10;
+    } while (v != 0);
+    for (size_t i = 0; i < nd; i++) {
+        buf[i] = digits[nd - 1 - i];
+    }
+    return nd;
+}
+
+// append_str 函数：把字符串追加到 buf
+size_t append_str(char *buf, const char *s) {
+    size_t n = strlen(s);
+    memcpy(buf, s, n);
+    return n;
+}
+
+// format_progress 函数：格式化一行进度 "已读取 N 字节 (P%)，X.Y MB/s，剩余约 T 秒"
+// 只使用异步信号安全的操作，因此 SIGUSR1 处理函数可以直接调用。
+// 返回值: 写入 buf 的字节数 (不含结尾换行)
+size_t format_progress(char *buf) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed_ms = (uint64_t)(now.tv_sec - g_stats.start.tv_sec) * 1000
+                          + (uint64_t)((now.tv_nsec - g_stats.start.tv_nsec) / 1000000);
+    uint64_t done = __atomic_load_n(&g_stats.bytes_read, __ATOMIC_RELAXED);
+    // 速率以 0.1 MB/s 为单位
+    uint64_t rate10 = elapsed_ms > 0 ? done * 10 * 1000 / elapsed_ms / (1024 * 1024) : 0;
+
+    size_t n = 0;
+    n += append_str(buf + n, "已读取 ");
+    n += append_uint(buf + n, done);
+    n += append_str(buf + n, " 字节");
+    if (g_progress_total > 0) {
+        n += append_str(buf + n, " (");
+        n += append_uint(buf + n, done * 100 / g_progress_total);
+        n += append_str(buf + n, "%)");
+    }
+    n += append_str(buf + n, "，");
+    n += append_uint(buf + n, rate10 / 10);
+    buf[n++] = '.';
+    n += append_uint(buf + n, rate10 % 10);
+    n += append_str(buf + n, " MB/s");
+    if (g_progress_total > 0 && done > 0 && done < g_progress_total) {
+        uint64_t eta = (g_progress_total - done) * elapsed_ms / done / 1000;
+        n += append_str(buf + n, "，剩余约 ");
+        n += append_uint(buf + n, eta);
+        n += append_str(buf + n, " 秒");
+    }
+    return n;
+}
+
+// progress_signal_handler 函数：收到 SIGUSR1 时像 dd 一样立即打印一行进度
+void progress_signal_handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    char line[256];
+    size_t n = format_progress(line);
+    line[n++] = '\n';
+    ssize_t rc = write(STDERR_FILENO, line, n);
+    (void)rc;
+    errno = saved_errno;
+}
+
+// install_progress_signal 函数：安装 SIGUSR1 处理函数 (SA_RESTART 使被打断的 read/write 自动重启)
+void install_progress_signal() {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = progress_signal_handler;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        perror("警告: 安装 SIGUSR1 处理函数失败");
+    }
+}
+
+// progress_ticker 函数：报告线程，每隔 g_opts.progress_interval 秒打印一次进度
+// 标准错误输出是终端时原地刷新同一行，否则每次输出一行。
+void *progress_ticker(void *arg) {
+    (void)arg;
+    int tty = isatty(STDERR_FILENO);
+    pthread_mutex_lock(&g_progress_lock);
+    while (g_progress_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += g_opts.progress_interval;
+        pthread_cond_timedwait(&g_progress_cond, &g_progress_lock, &deadline);
+
+        char line[256];
+        size_t n = 0;
+        if (tty) {
+            line[n++] = '\r';
+        }
+        n += format_progress(line + n);
+        if (tty) {
+            n += append_str(line + n, "\033[K"); // 清除上一次输出留下的尾部
+        }
+        if (!tty || !g_progress_running) {
+            line[n++] = '\n';
+        }
+        ssize_t rc = write(STDERR_FILENO, line, n);
+        (void)rc;
+    }
+    pthread_mutex_unlock(&g_progress_lock);
+    return NULL;
+}
+
+// start_progress 函数：根据输入大小设置 ETA 的基准，并按需启动报告线程
+// 参数: total - 预计读取的总字节数，未知时为 0
+void start_progress(uint64_t total) {
+    g_progress_total = total;
+    if (g_opts.progress_interval <= 0) {
+        return;
+    }
+    g_progress_running = 1;
+    int err = pthread_create(&g_progress_thread, NULL, progress_ticker, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("警告: 创建进度报告线程失败");
+        g_progress_running = 0;
+    }
+}
+
+// stop_progress 函数：停止报告线程，它会在退出前打印最后一次进度
+void stop_progress() {
+    pthread_mutex_lock(&g_progress_lock);
+    if (!g_progress_running) {
+        pthread_mutex_unlock(&g_progress_lock);
+        return;
+    }
+    g_progress_running = 0;
+    pthread_cond_signal(&g_progress_cond);
+    pthread_mutex_unlock(&g_progress_lock);
+    pthread_join(g_progress_thread, NULL);
+}
+
+// ---------------------------------------------------------------------------
+// Prometheus 指标导出 (--metrics-file)
+// ---------------------------------------------------------------------------
+
+// 指标以 Prometheus 文本格式写入 node_exporter textfile collector 读取的路径：
+// 先写同目录下的临时文件再 rename，采集端永远不会读到写了一半的文件。
+// 计数器就是 g_stats 中由 stat_add 累加的原子变量，导出时只做 relaxed 原子读取，不加锁。
+
+#define METRICS_DEFAULT_INTERVAL 15
+
+static pthread_t g_metrics_thread;
+static int g_metrics_running;
+static pthread_mutex_t g_metrics_lock = PTHREAD_MUTEX_INITIALIZER; // 保护线程状态，并串行化文件写入
+static pthread_cond_t g_metrics_cond = PTHREAD_COND_INITIALIZER;
+
+// stat_load 函数：读取一个可能正被其他线程累加的计数器
+static inline uint64_t stat_load(const uint64_t *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+// write_metrics 函数：把当前计数器写成 Prometheus 文本格式，并原子地替换 g_opts.metrics_path。
+// 指标目录通常是多个程序共用的，临时文件用 mkostemp 独占地新建，不会跟随别人预先放好的符号链接
+// 或截断已有的文件；文件名不以 .prom 结尾，textfile collector 不会读到写了一半的内容
+// 返回值: 成功返回 0，失败返回 -1
+int write_metrics() {
+    static const char *op_names[LAT_OPS] = { "read", "write" };
+    char tmp[4096];
+    int len = snprintf(tmp, sizeof(tmp), "%s.XXXXXX", g_opts.metrics_path);
+    if (len < 0 || (size_t)len >= sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    FILE *f = NULL;
+    if (fchmod(fd, 0644) == -1 || (f = fdopen(fd, "w")) == NULL) {
+        int saved = errno;
+        close(fd);
+        unlink(tmp);
+        errno = saved;
+        return -1;
+    }
+
+    fprintf(f, "# HELP mycat_read_bytes_total Bytes read from the input.\n");
+    fprintf(f, "# TYPE mycat_read_bytes_total counter\n");
+    fprintf(f, "mycat_read_bytes_total %llu\n", (unsigned long long)stat_load(&g_stats.bytes_read));
+    fprintf(f, "# HELP mycat_written_bytes_total Bytes written to the output.\n");
+    fprintf(f, "# TYPE mycat_written_bytes_total counter\n");
+    fprintf(f, "mycat_written_bytes_total %llu\n", (unsigned long long)stat_load(&g_stats.bytes_written));
+    fprintf(f, "# HELP mycat_syscalls_total Read and write system calls issued.\n");
+    fprintf(f, "# TYPE mycat_syscalls_total counter\n");
+    fprintf(f, "mycat_syscalls_total{op=\"read\"} %llu\n", (unsigned long long)stat_load(&g_stats.read_calls));
+    fprintf(f, "mycat_syscalls_total{op=\"write\"} %llu\n", (unsigned long long)stat_load(&g_stats.write_calls));
+    fprintf(f, "# HELP mycat_errors_total Failed read and write system calls.\n");
+    fprintf(f, "# TYPE mycat_errors_total counter\n");
+    fprintf(f, "mycat_errors_total %llu\n", (unsigned long long)stat_load(&g_stats.errors));
+
+    fprintf(f, "# HELP mycat_syscall_duration_seconds Latency of read and write system calls.\n");
+    fprintf(f, "# TYPE mycat_syscall_duration_seconds histogram\n");
+    for (int op = 0; op < LAT_OPS; op++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            cumulative += stat_load(&g_stats.latency[op][b]);
+            if (b < LATENCY_BUCKETS - 1) {
+                fprintf(f, "mycat_syscall_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                        op_names[op], (double)g_latency_bounds[b] / 1e9, (unsigned long long)cumulative);
+            } else {
+                fprintf(f, "mycat_syscall_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                        op_names[op], (unsigned long long)cumulative);
+            }
+        }
+        fprintf(f, "mycat_syscall_duration_seconds_sum{op=\"%s\"} %.9f\n",
+                op_names[op], (double)stat_load(&g_stats.latency_sum_ns[op]) / 1e9);
+        fprintf(f, "mycat_syscall_duration_seconds_count{op=\"%s\"} %llu\n",
+                op_names[op], (unsigned long long)cumulative);
+    }
+
+    if (g_stats.residency_method != NULL) {
+        fprintf(f, "# HELP mycat_input_cache_residency_ratio Fraction of the input in the page cache before copying.\n");
+        fprintf(f, "# TYPE mycat_input_cache_residency_ratio gauge\n");
+        fprintf(f, "mycat_input_cache_residency_ratio %.4f\n", g_stats.residency);
+    }
+    if (g_stats.first_byte_ns != 0) {
+        fprintf(f, "# HELP mycat_time_to_first_byte_seconds Time from start until the first output byte was written.\n");
+        fprintf(f, "# TYPE mycat_time_to_first_byte_seconds gauge\n");
+        fprintf(f, "mycat_time_to_first_byte_seconds %.6f\n", time_to_first_byte());
+    }
+    fprintf(f, "# HELP mycat_engine_info Copy engine in use.\n");
+    fprintf(f, "# TYPE mycat_engine_info gauge\n");
+    const char *engine = current_engine();
+    fprintf(f, "mycat_engine_info{engine=\"%s\"} 1\n", engine != NULL ? engine : "none");
+
+    if (fclose(f) == EOF) {
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, g_opts.metrics_path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// flush_metrics 函数：写一次指标文件，失败只打印警告，不影响复制
+void flush_metrics() {
+    pthread_mutex_lock(&g_metrics_lock);
+    if (write_metrics() == -1) {
+        perror("警告: 写入指标文件失败");
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+}
+
+// metrics_writer 函数：导出线程，每隔 g_opts.metrics_interval 秒刷新一次指标文件
+void *metrics_writer(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_metrics_lock);
+    while (g_metrics_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += g_opts.metrics_interval;
+        if (pthread_cond_timedwait(&g_metrics_cond, &g_metrics_lock, &deadline) == ETIMEDOUT
+            && write_metrics() == -1) {
+            perror("警告: 写入指标文件失败");
+        }
+    }
+    pthread_mutex_unlock(&g_metrics_lock);
+    return NULL;
+}
+
+// stop_metrics 函数：停止导出线程并写出最终的指标；通过 atexit 注册，出错退出时也会执行
+void stop_metrics() {
+    pthread_mutex_lock(&g_metrics_lock);
+    int running = g_metrics_running;
+    g_metrics_running = 0;
+    pthread_cond_signal(&g_metrics_cond);
+    pthread_mutex_unlock(&g_metrics_lock);
+    if (running) {
+        pthread_join(g_metrics_thread, NULL);
+    }
+    flush_metrics();
+}
+
+// start_metrics 函数：启用系统调用计时，写出第一份指标并启动导出线程
+void start_metrics() {
+    if (g_opts.metrics_path == NULL) {
+        return;
+    }
+    g_latency_enabled = 1;
+    flush_metrics();
+    atexit(stop_metrics);
+    g_metrics_running = 1;
+    int err = pthread_create(&g_metrics_thread, NULL, metrics_writer, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("警告: 创建指标导出线程失败");
+        g_metrics_running = 0;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 主机级共享计数器 (--shm-stats 与 --top)
+// ---------------------------------------------------------------------------
+
+// 同一台主机上的所有 mycat 进程共用一个 POSIX 共享内存段，其中只有原子计数器。
+// 每个进程由一个发布线程每隔 SHM_PUBLISH_INTERVAL_MS 把 g_stats 自上次发布以来的增量累加进去
+// (每次只有几十次原子加法，复制路径上没有额外开销)，退出时再发布最后一次；
+// 运行中的进程数用 active 计数，被信号终止时由信号处理函数减掉。
+// mycat --top 周期性地读取并显示速率。
+// 段只对创建者及其所属组可写 (0660)，其他用户不能篡改主机计数；代价是与创建者不同组的
+// 用户运行的 mycat 打不开这个段，不计入统计，所以"主机级"实际上是"同一个组内"。
+
+#define SHM_STATS_NAME "/mycat-stats"
+#define SHM_STATS_MAGIC 0x6d79636174737432ULL // "mycatst2"，布局改变时需要修改
+#define SHM_PUBLISH_INTERVAL_MS 200
+
+// 按引擎分别累计读取字节数；每个 set_engine 用到的名字各占一格，最后一格收集未列出的名字
+static const char *g_shm_engine_names[] = {
+    "read/write", "copy_file_range", "mmap", "pread", "O_DIRECT pread",
+    "batch", "manifest pread/pwrite", "delta", "other",
+};
+#define SHM_ENGINES (int)(sizeof(g_shm_engine_names) / sizeof(g_shm_engine_names[0]))
+
+struct shm_stats {
+    uint64_t magic;
+    uint64_t invocations; // 已结束的运行次数
+    uint64_t active;      // 正在运行的进程数
+    uint64_t failures;    // 以非零状态退出的运行次数
+    uint64_t bytes_by_engine[SHM_ENGINES];
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t errors;
+    uint64_t latency[LAT_OPS][LATENCY_BUCKETS];
+    uint64_t latency_sum_ns[LAT_OPS];
+};
+
+static struct shm_stats *g_shm;
+static struct shm_stats g_shm_published; // 已经累加进共享段的本进程计数，bytes_by_engine[0] 记录已发布的读取字节数
+static int g_shm_registered;             // active 中是否还算着本进程；退出路径与信号处理只有一个会把它减掉
+static pthread_t g_shm_thread;
+static int g_shm_running;
+static pthread_mutex_t g_shm_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_shm_cond = PTHREAD_COND_INITIALIZER;
+
+// shm_stats_open 函数：打开 (不存在时创建) 主机级共享内存段并映射
+// 返回值: 映射后的指针，失败返回 NULL (errno 已设置)
+struct shm_stats *shm_stats_open(int create) {
+    int fd = shm_open(SHM_STATS_NAME, create ? O_RDWR | O_CREAT : O_RDONLY, 0660);
+    if (fd == -1) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        close(fd);
+        return NULL;
+    }
+    if (create && (st.st_mode & S_IWOTH)) {
+        // 其他任何用户都能写的段 (旧版本以 0666 创建) 里的计数不可信，也不往里写
+        close(fd);
+        errno = EACCES;
+        return NULL;
+    }
+    if (st.st_size == 0 && create) {
+        // 新建的段：让同组用户的 mycat 也能累加 (不受 umask 影响)，ftruncate 保证内容全为 0
+        if (fchmod(fd, 0660) == -1 || ftruncate(fd, sizeof(struct shm_stats)) == -1) {
+            close(fd);
+            return NULL;
+        }
+    } else if (st.st_size != (off_t)sizeof(struct shm_stats)) {
+        close(fd);
+        errno = EPROTO;
+        return NULL;
+    }
+    struct shm_stats *shm = mmap(NULL, sizeof(struct shm_stats), create ? PROT_READ | PROT_WRITE : PROT_READ,
+                                 MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        return NULL;
+    }
+    uint64_t zero = 0;
+    if (create) {
+        __atomic_compare_exchange_n(&shm->magic, &zero, SHM_STATS_MAGIC, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    if (__atomic_load_n(&shm->magic, __ATOMIC_RELAXED) != SHM_STATS_MAGIC) {
+        munmap(shm, sizeof(struct shm_stats));
+        errno = EPROTO;
+        return NULL;
+    }
+    return shm;
+}
+
+// shm_publish_counter 函数：把一个计数自上次发布以来的增量累加到共享段
+static inline void shm_publish_counter(uint64_t *shared, uint64_t *published, const uint64_t *local) {
+    uint64_t cur = stat_load(local);
+    if (cur != *published) {
+        stat_add(shared, cur - *published);
+        *published = cur;
+    }
+}
+
+// shm_stats_publish 函数：把本进程计数的增量累加到共享内存段
+// 调用者必须持有 g_shm_lock
+void shm_stats_publish() {
+    const char *name = current_engine();
+    int engine = SHM_ENGINES - 1;
+    for (int i = 0; name != NULL && i < SHM_ENGINES - 1; i++) {
+        if (strcmp(name, g_shm_engine_names[i]) == 0) {
+            engine = i;
+            break;
+        }
+    }
+    // 读取字节数的增量记到当前的复制引擎名下
+    uint64_t bytes = stat_load(&g_stats.bytes_read);
+    stat_add(&g_shm->bytes_by_engine[engine], bytes - g_shm_published.bytes_by_engine[0]);
+    g_shm_published.bytes_by_engine[0] = bytes;
+    shm_publish_counter(&g_shm->read_calls, &g_shm_published.read_calls, &g_stats.read_calls);
+    shm_publish_counter(&g_shm->write_calls, &g_shm_published.write_calls, &g_stats.write_calls);
+    shm_publish_counter(&g_shm->errors, &g_shm_published.errors, &g_stats.errors);
+    for (int op = 0; op < LAT_OPS; op++) {
+        for (int b = 0; b < LATENCY_BUCKETS; b++) {
+            shm_publish_counter(&g_shm->latency[op][b], &g_shm_published.latency[op][b], &g_stats.latency[op][b]);
+        }
+        shm_publish_counter(&g_shm->latency_sum_ns[op], &g_shm_published.latency_sum_ns[op],
+                            &g_stats.latency_sum_ns[op]);
+    }
+}
+
+// shm_stats_deregister 函数：把本进程记为已结束的一次运行，并从 active 中减掉
+// 只使用无锁原子操作，可以在信号处理函数中调用
+static void shm_stats_deregister(int failed) {
+    if (!__atomic_exchange_n(&g_shm_registered, 0, __ATOMIC_RELAXED)) {
+        return;
+    }
+    if (failed) {
+        stat_add(&g_shm->failures, 1);
+    }
+    stat_add(&g_shm->invocations, 1);
+    __atomic_fetch_sub(&g_shm->active, 1, __ATOMIC_RELAXED);
+}
+
+// shm_stats_publisher 函数：发布线程，每隔 SHM_PUBLISH_INTERVAL_MS 发布一次增量，--top 看到的是实时速率
+void *shm_stats_publisher(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&g_shm_lock);
+    while (g_shm_running) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += SHM_PUBLISH_INTERVAL_MS * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        if (pthread_cond_timedwait(&g_shm_cond, &g_shm_lock, &deadline) == ETIMEDOUT) {
+            shm_stats_publish();
+        }
+    }
+    pthread_mutex_unlock(&g_shm_lock);
+    return NULL;
+}
+
+// stop_shm_stats 函数：停止发布线程，发布最后一次增量并注销；通过 atexit 注册
+void stop_shm_stats() {
+    pthread_mutex_lock(&g_shm_lock);
+    int running = g_shm_running;
+    g_shm_running = 0;
+    pthread_cond_signal(&g_shm_cond);
+    pthread_mutex_unlock(&g_shm_lock);
+    if (running) {
+        pthread_join(g_shm_thread, NULL);
+    }
+    pthread_mutex_lock(&g_shm_lock);
+    shm_stats_publish();
+    pthread_mutex_unlock(&g_shm_lock);
+    shm_stats_deregister(!g_stats.succeeded);
+}
+
+// shm_stats_signal_handler 函数：被信号终止时仍然从 active 中减掉本进程，然后按默认动作终止
+// (最后一个发布间隔内的增量会丢失；SIGKILL 无法捕获，仍会让 active 多计一个)
+void shm_stats_signal_handler(int sig) {
+    shm_stats_deregister(1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// install_shm_stats_signals 函数：为常见的终止信号安装处理函数；已被忽略的信号保持忽略
+void install_shm_stats_signals() {
+    static const int signals[] = { SIGINT, SIGTERM, SIGHUP, SIGPIPE, SIGQUIT };
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        struct sigaction old;
+        if (sigaction(signals[i], NULL, &old) == -1 || old.sa_handler == SIG_IGN) {
+            continue;
+        }
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = shm_stats_signal_handler;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(signals[i], &sa, NULL) == -1) {
+            perror("警告: 安装终止信号处理函数失败");
+        }
+    }
+}
+
+// start_shm_stats 函数：映射共享内存段，登记为运行中的进程，启用系统调用计时并启动发布线程
+void start_shm_stats() {
+    if (!g_opts.shm_stats) {
+        return;
+    }
+    g_shm = shm_stats_open(1);
+    if (g_shm == NULL) {
+        perror("警告: 打开共享统计段 " SHM_STATS_NAME " 失败");
+        return;
+    }
+    g_latency_enabled = 1;
+    stat_add(&g_shm->active, 1);
+    g_shm_registered = 1;
+    install_shm_stats_signals();
+    atexit(stop_shm_stats);
+    g_shm_running = 1;
+    int err = pthread_create(&g_shm_thread, NULL, shm_stats_publisher, NULL);
+    if (err != 0) {
+        errno = err;
+        perror("警告: 创建共享统计发布线程失败，只在退出时发布");
+        g_shm_running = 0;
+    }
+}
+
+// run_top 函数：--top 模式，每秒读取一次共享内存段并显示主机级的累计值和速率
+// 返回值: 进程退出状态 (正常情况下一直运行，直到被信号终止)
+int run_top() {
+    struct shm_stats *shm = shm_stats_open(0);
+    if (shm == NULL) {
+        perror("打开共享统计段 " SHM_STATS_NAME " 失败 (还没有以 --shm-stats 运行过的 mycat?)");
+        return EXIT_FAILURE;
+    }
+    int tty = isatty(STDOUT_FILENO);
+    struct shm_stats prev;
+    memcpy(&prev, shm, sizeof(prev));
+    for (;;) {
+        sleep(1);
+        struct shm_stats cur;
+        // 逐个字段原子读取；各字段之间不要求一致，显示用足够了
+        const uint64_t *src = (const uint64_t *)shm;
+        uint64_t *dst = (uint64_t *)&cur;
+        for (size_t i = 0; i < sizeof(cur) / sizeof(uint64_t); i++) {
+            dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+        }
+
+        if (tty) {
+            printf("\033[H\033[2J");
+        }
+        printf("mycat 主机统计 (仅限共享段所属组): %llu 个进程运行中，累计 %llu 次运行 (%llu 次失败)，+%llu 次/秒\n",
+               (unsigned long long)cur.active, (unsigned long long)cur.invocations,
+               (unsigned long long)cur.failures, (unsigned long long)(cur.invocations - prev.invocations));
+        for (int i = 0; i < SHM_ENGINES; i++) {
+            printf("  %-22s 累计 %14llu 字节  %10.1f MB/s\n", g_shm_engine_names[i],
+                   (unsigned long long)cur.bytes_by_engine[i],
+                   (double)(cur.bytes_by_engine[i] - prev.bytes_by_engine[i]) / (1024 * 1024));
+        }
+        printf("  系统调用: 读 %llu 次/秒，写 %llu 次/秒，错误 %llu 次/秒\n",
+               (unsigned long long)(cur.read_calls - prev.read_calls),
+               (unsigned long long)(cur.write_calls - prev.write_calls),
+               (unsigned long long)(cur.errors - prev.errors));
+        static const char *op_names[LAT_OPS] = { "读", "写" };
+        static const char *bucket_names[LATENCY_BUCKETS] = { "10us", "100us", "1ms", "10ms", "100ms", "1s", "更长" };
+        for (int op = 0; op < LAT_OPS; op++) {
+            printf("  %s延迟分布 (累计):", op_names[op]);
+            for (int b = 0; b < LATENCY_BUCKETS; b++) {
+                printf(" %s%s:%llu", b < LATENCY_BUCKETS - 1 ? "≤" : "", bucket_names[b],
+                       (unsigned long long)cur.latency[op][b]);
+            }
+            printf("\n");
+        }
+        if (!tty) {
+            printf("\n");
+        }
+        fflush(stdout);
+        prev = cur;
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 行号 (-n)
+// ---------------------------------------------------------------------------
+
+// 与 cat -n 一致，行号右对齐到 6 列，后跟一个制表符
+#define LINE_NUMBER_WIDTH 6
+// 一个行号前缀的最大长度：20 位十进制数字 + 制表符
+#define LINE_NUMBER_MAX_PREFIX 21
+
+// 行号格式化的流式状态，可以在缓冲区之间延续
+struct number_state {
+    uint64_t line_no;  // 下一个行首要使用的行号
+    int at_line_start; // 下一个字节是否位于行首
+};
+
+// count_newlines 函数：统计 buf 中换行符的个数 (memchr 在 glibc 中已经向量化)
+uint64_t count_newlines(const char *buf, size_t len) {
+    uint64_t count = 0;
+    const char *p = buf;
+    const char *end = buf + len;
+    while (p < end && (p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+// format_line_number 函数：按 "%6lu\t" 的格式把行号写入 out，不经过 printf
+// 返回值: 写入的字节数
+size_t format_line_number(char *out, uint64_t n) {
+    char digits[20];
+    size_t nd = 0;
+    do {
+        digits[nd++] = (char)('0' + n % 10);
+        n /= 10;
+    } while (n != 0);
+
+    size_t len = 0;
+    while (nd + len < LINE_NUMBER_WIDTH) {
+        out[len++] = ' ';
+    }
+    while (nd > 0) {
+        out[len++] = digits[--nd];
+    }
+    out[len++] = '\t';
+    return len;
+}
+
+// format_numbered 函数：把 in 中的数据加上行号写入 out
+// 当 out 剩余空间不足以容纳下一个行号前缀时提前返回，由调用者换一个输出缓冲区继续。
+// 参数: in, len - 输入数据; consumed - 返回已处理的输入字节数
+//       out, out_cap - 输出缓冲区; st - 跨缓冲区延续的行号状态
+// 返回值: 写入 out 的字节数
+size_t format_numbered(const char *in, size_t len, size_t *consumed,
+                       char *out, size_t out_cap, struct number_state *st) {
+    size_t ip = 0;
+    size_t op = 0;
+    while (ip < len) {
+        if (st->at_line_start) {
+            if (out_cap - op < LINE_NUMBER_MAX_PREFIX) {
+                break;
+            }
+            op += format_line_number(out + op, st->line_no++);
+            st->at_line_start = 0;
+        }
+        const char *nl = memchr(in + ip, '\n', len - ip);
+        size_t seg = nl ? (size_t)(nl - (in + ip)) + 1 : len - ip;
+        if (seg > out_cap - op) {
+            seg = out_cap - op;
+            if (seg == 0) {
+                break;
+            }
+        } else if (nl) {
+            st->at_line_start = 1;
+        }
+        memcpy(out + op, in + ip, seg);
+        ip += seg;
+        op += seg;
+    }
+    *consumed = ip;
+    return op;
+}
+
+// number_out_bound 函数：每个行首最多增加一个行号前缀，行首个数不超过换行符个数加一
+size_t number_out_bound(size_t len) {
+    return len + (len + 1) * LINE_NUMBER_MAX_PREFIX;
+}
+
+// number_apply 函数：行号阶段的处理函数，用于不可定位的输入或与其他变换组合时
+char *number_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    (void)final;
+    size_t used;
+    *out_len = format_numbered(in, len, &used, out, number_out_bound(len), t->state);
+    return out;
+}
+
+// add_number_stage 函数：启用行号阶段
+void add_number_stage() {
+    static struct number_state state = { 1, 1 };
+    struct transform t = {
+        .name = "number",
+        .out_bound = number_out_bound,
+        .apply = number_apply,
+        .state = &state,
+    };
+    add_transform(&t);
+}
+
+// 并行编号时每个块的状态
+struct number_chunk {
+    uint64_t newlines;  // 第一遍: 块内换行符个数
+    int ends_with_nl;   // 第一遍: 块的最后一个字节是否为换行符
+    uint64_t line_base; // 前缀和: 块起点处的下一个行号
+    int at_line_start;  // 前缀和: 块起点是否为行首
+};
+
+// 有序写出环中的一个槽位，块 i 使用槽位 i % nslots
+struct number_slot {
+    char *out;      // 带行号的输出数据
+    size_t out_cap; // out 的容量
+    size_t out_len; // out 中有效数据的长度
+    size_t chunk;   // 槽位中数据所属的块号
+    int ready;      // 数据已格式化完毕，等待写出
+    int last;       // 这是块的最后一段，写出后块才算写完
+};
+
+
+// 两遍并行编号共享的任务描述
+struct number_job {
+    int fd;
+    off_t file_size;
+    size_t chunk_size;
+    size_t nchunks;
+    struct number_chunk *chunks;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next_chunk;  // 下一个待领取的块号
+    size_t written;     // 已经写出的块数
+    size_t nslots;
+    struct number_slot *slots;
+};
+
+// read_chunk 函数：把第 idx 块读入 buf，读取失败时直接退出进程
+size_t read_chunk(struct number_job *job, size_t idx, char *buf) {
+    off_t offset = (off_t)idx * (off_t)job->chunk_size;
+    size_t want = job->chunk_size;
+    if (job->file_size - offset < (off_t)want) {
+        want = (size_t)(job->file_size - offset);
+    }
+    ssize_t n = pread_full(job->fd, buf, want, offset);
+    if (n == -1) {
+        perror("并行读取文件失败");
+        exit(EXIT_FAILURE);
+    }
+    return (size_t)n;
+}
+
+// claim_chunk 函数：领取下一个块号，全部领完时返回 job->nchunks
+size_t claim_chunk(struct number_job *job) {
+    return __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED);
+}
+
+// count_worker 函数：第一遍，统计各块的换行符个数
+void *count_worker(void *arg) {
+    struct number_job *job = arg;
+    char *buf = io_buffer_alloc(job->chunk_size);
+    if (buf == NULL) {
+        perror("分配并行读缓冲区失败");
+        exit(EXIT_FAILURE);
+    }
+    size_t idx;
+    while ((idx = claim_chunk(job)) < job->nchunks) {
+        size_t len = read_chunk(job, idx, buf);
+        job->chunks[idx].newlines = count_newlines(buf, len);
+        job->chunks[idx].ends_with_nl = len > 0 && buf[len - 1] == '\n';
+    }
+    io_buffer_free(buf, job->chunk_size);
+    return NULL;
+}
+
+// format_worker 函数：第二遍，独立地为各块加上行号，放入有序写出环
+void *format_worker(void *arg) {
+    struct number_job *job = arg;
+    char *buf = io_buffer_alloc(job->chunk_size);
+    if (buf == NULL) {
+        perror("分配并行读缓冲区失败");
+        exit(EXIT_FAILURE);
+    }
+    size_t idx;
+    while ((idx = claim_chunk(job)) < job->nchunks) {
+        struct number_slot *slot = &job->slots[idx % job->nslots];
+
+        // 等待写出线程释放这个槽位 (即块 idx - nslots 已经写出)
+        pthread_mutex_lock(&job->lock);
+        while (idx >= job->written + job->nslots) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        size_t len = read_chunk(job, idx, buf);
+        struct number_chunk *c = &job->chunks[idx];
+        struct number_state st = { c->line_base, c->at_line_start };
+
+        // 槽位容量有限，输出放不下时分段格式化，每段写出后再格式化下一段
+        size_t pos = 0;
+        do {
+            if (pos > 0) {
+                pthread_mutex_lock(&job->lock);
+                while (slot->ready) {
+                    pthread_cond_wait(&job->cond, &job->lock);
+                }
+                pthread_mutex_unlock(&job->lock);
+            }
+            size_t used;
+            size_t out_len = format_numbered(buf + pos, len - pos, &used, slot->out, slot->out_cap, &st);
+            pos += used;
+
+            pthread_mutex_lock(&job->lock);
+            slot->out_len = out_len;
+            slot->chunk = idx;
+            slot->last = pos == len;
+            slot->ready = 1;
+            pthread_cond_broadcast(&job->cond);
+            pthread_mutex_unlock(&job->lock);
+        } while (pos < len);
+
+        if (g_opts.background) {
+            // 第二遍读完后这一块不会再被用到
+            posix_fadvise(job->fd, (off_t)idx * (off_t)job->chunk_size, (off_t)len, POSIX_FADV_DONTNEED);
+        }
+    }
+    io_buffer_free(buf, job->chunk_size);
+    return NULL;
+}
+
+// start_workers 函数：启动 nthreads 个线程执行 fn(arg)
+// 返回值: 线程 ID 数组，交给 join_workers 等待并释放
+pthread_t *start_workers(int nthreads, void *(*fn)(void *), void *arg) {
+    pthread_t *tids = malloc(sizeof(pthread_t) * (size_t)nthreads);
+    if (tids == NULL) {
+        perror("分配线程数组失败");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < nthreads; i++) {
+        int err = pthread_create(&tids[i], NULL, fn, arg);
+        if (err != 0) {
+            errno = err;
+            perror("创建线程失败");
+            exit(EXIT_FAILURE);
+        }
+    }
+    return tids;
+}
+
+// join_workers 函数：等待 start_workers 启动的线程全部结束
+void join_workers(pthread_t *tids, int nthreads) {
+    for (int i = 0; i < nthreads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    free(tids);
+}
+
+// ordered_writer 函数：由主线程按块号顺序写出格式化好的块，
+// 一个块可能分成多段交付，写完标记为 last 的一段才进入下一块
+void *ordered_writer(void *arg) {
+    struct number_job *job = arg;
+    // 输入由工作线程丢弃 (块设备用 O_DIRECT 读取，本来就不经过页缓存)，这里只管输出
+    struct drop_behind drop;
+    if (g_opts.background) {
+        drop_behind_init(&drop, -1);
+    }
+    for (size_t idx = 0; idx < job->nchunks; ) {
+        struct number_slot *slot = &job->slots[idx % job->nslots];
+
+        pthread_mutex_lock(&job->lock);
+        while (!(slot->ready && slot->chunk == idx)) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        if (emit_output(slot->out, slot->out_len) == -1) {
+            perror("写入标准输出失败");
+            exit(EXIT_FAILURE);
+        }
+        if (g_opts.background) {
+            drop_behind_block(&drop, 0, slot->out_len);
+        }
+
+        pthread_mutex_lock(&job->lock);
+        slot->ready = 0;
+        if (slot->last) {
+            job->written = ++idx;
+        }
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    if (g_opts.background) {
+        drop_behind_finish(&drop);
+    }
+    return NULL;
+}
+
+// number_lines_parallel 函数：为可定位的普通文件并行编号
+// 第一遍并行统计每块的换行符个数，再做一次排他前缀和得到每块的起始行号；
+// 第二遍各线程独立地格式化自己的块，由主线程按顺序写出。
+// 参数: fd_in - 输入文件描述符; file_size - 文件大小; nthreads - 工作线程数
+// 返回值: 成功返回 0
+int number_lines_parallel(int fd_in, off_t file_size, int nthreads) {
+    struct number_job job;
+    memset(&job, 0, sizeof(job));
+    job.fd = fd_in;
+    job.file_size = file_size;
+    job.chunk_size = io_blocksize();
+    job.nchunks = (size_t)((file_size + (off_t)job.chunk_size - 1) / (off_t)job.chunk_size);
+    job.chunks = calloc(job.nchunks, sizeof(struct number_chunk));
+    job.nslots = (size_t)nthreads * 2;
+    job.slots = calloc(job.nslots, sizeof(struct number_slot));
+    if (job.chunks == NULL || job.slots == NULL) {
+        perror("分配并行编号状态失败");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < job.nslots; i++) {
+        job.slots[i].out_cap = job.chunk_size * NUMBER_SLOT_OUT_FACTOR;
+        job.slots[i].out = io_buffer_alloc(job.slots[i].out_cap);
+        if (job.slots[i].out == NULL) {
+            perror("分配行号输出缓冲区失败");
+            exit(EXIT_FAILURE);
+        }
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    // 第一遍: 统计换行符
+    join_workers(start_workers(nthreads, count_worker, &job), nthreads);
+
+    // 排他前缀和: L 为块起点之前的换行符总数。
+    // 若块起点是行首，其第一行的行号为 L + 1；否则块内第一个行首的行号为 L + 2。
+    uint64_t newlines_before = 0;
+    for (size_t i = 0; i < job.nchunks; i++) {
+        struct number_chunk *c = &job.chunks[i];
+        c->at_line_start = (i == 0) || job.chunks[i - 1].ends_with_nl;
+        c->line_base = newlines_before + (c->at_line_start ? 1 : 2);
+        newlines_before += c->newlines;
+    }
+
+    // 第二遍: 并行格式化，主线程按顺序写出
+    job.next_chunk = 0;
+    pthread_t *tids = start_workers(nthreads, format_worker, &job);
+    ordered_writer(&job);
+    join_workers(tids, nthreads);
+
+    for (size_t i = 0; i < job.nslots; i++) {
+        io_buffer_free(job.slots[i].out, job.slots[i].out_cap);
+    }
+    free(job.slots);
+    free(job.chunks);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// UTF-8 校验 (--validate-utf8)
+// ---------------------------------------------------------------------------
+
+#if defined(__x86_64__)
+#include <immintrin.h>  // 包含 AVX2 intrinsics
+#endif
+
+// UTF-8 的替换字符 U+FFFD，修复模式用它替换无效字节
+static const char UTF8_REPLACEMENT[3] = { (char)0xEF, (char)0xBF, (char)0xBD };
+
+// UTF-8 流式校验的状态
+struct utf8_state {
+    int repair;                 // 1: 修复模式，用 U+FFFD 替换无效字节；0: 发现错误即报告并终止
+    unsigned char carry[4];     // 上一个缓冲区末尾未完成的多字节序列
+    size_t carry_len;
+    uint64_t offset;            // 当前缓冲区第一个字节在整个流中的偏移
+    int (*validate)(const unsigned char *p, size_t len); // 快速路径校验函数
+};
+
+// utf8_sequence 函数：按 Unicode 标准表 3-7 解析 p 处的一个字符
+// 返回值: >0 为合法序列的长度；0 表示序列合法但在 avail 字节内被截断；
+//         <0 时其绝对值为"最大无效子部分"的长度 (修复模式将其替换为一个 U+FFFD)
+int utf8_sequence(const unsigned char *p, size_t avail) {
+    unsigned char b = p[0];
+    int need;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+
+    if (b < 0x80) {
+        return 1;
+    } else if (b >= 0xC2 && b <= 0xDF) {
+        need = 2;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+        need = 3;
+        if (b == 0xE0) {
+            lo = 0xA0; // 排除过长编码
+        } else if (b == 0xED) {
+            hi = 0x9F; // 排除代理区 U+D800..U+DFFF
+        }
+    } else if (b >= 0xF0 && b <= 0xF4) {
+        need = 4;
+        if (b == 0xF0) {
+            lo = 0x90; // 排除过长编码
+        } else if (b == 0xF4) {
+            hi = 0x8F; // 排除大于 U+10FFFF 的码点
+        }
+    } else {
+        return -1;
+    }
+
+    for (int i = 1; i < need; i++) {
+        if ((size_t)i >= avail) {
+            return 0;
+        }
+        unsigned char c = p[i];
+        if (c < lo || c > hi) {
+            return -i;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    return need;
+}
+
+// utf8_validate_scalar 函数：标量校验一段以字符边界开始和结束的数据
+// 返回值: 合法返回 1，否则返回 0
+int utf8_validate_scalar(const unsigned char *p, size_t len) {
+    size_t i = 0;
+    while (i < len) {
+        int r = utf8_sequence(p + i, len - i);
+        if (r <= 0) {
+            return 0;
+        }
+        i += (size_t)r;
+    }
+    return 1;
+}
+
+#if defined(__x86_64__)
+// 查表校验法 (Keiser & Lemire, "Validating UTF-8 In Less Than One Instruction Per Byte")
+// 用前一字节的高/低半字节和当前字节的高半字节查三张 16 项表，三者按位与后非零即为错误。
+#define U8_TOO_SHORT  (1 << 0) // 11______ 0_______ 或 11______ 11______
+#define U8_TOO_LONG   (1 << 1) // 0_______ 10______
+#define U8_OVERLONG_3 (1 << 2) // 11100000 100_____
+#define U8_TOO_LARGE  (1 << 3) // 11110100 1001____ 等大于 U+10FFFF 的情况
+#define U8_SURROGATE  (1 << 4) // 11101101 101_____
+#define U8_OVERLONG_2 (1 << 5) // 1100000_ 10______
+#define U8_TOO_LARGE_1000 (1 << 6) // 11110101 1000____ 等
+#define U8_OVERLONG_4 (1 << 6) // 11110000 1000____
+#define U8_TWO_CONTS  (1 << 7) // 10______ 10______
+#define U8_CARRY (U8_TOO_SHORT | U8_TOO_LONG | U8_TWO_CONTS)
+
+// utf8_prev 函数：把上一个 32 字节块的末尾 n 个字节拼到当前块前面，得到"前 n 个字节"向量
+#define utf8_prev(input, prev_input, n) \
+    _mm256_alignr_epi8((input), _mm256_permute2x128_si256((prev_input), (input), 0x21), 16 - (n))
+
+__attribute__((target("avx2")))
+static inline __m256i utf8_check_block(__m256i input, __m256i prev_input) {
+    const __m256i byte_1_high_table = _mm256_setr_epi8(
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG, U8_TOO_LONG,
+        U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS, U8_TWO_CONTS,
+        U8_TOO_SHORT | U8_OVERLONG_2,
+        U8_TOO_SHORT,
+        U8_TOO_SHORT | U8_OVERLONG_3 | U8_SURROGATE,
+        U8_TOO_SHORT | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_OVERLONG_4);
+    const __m256i byte_1_low_table = _mm256_setr_epi8(
+        U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+        U8_CARRY | U8_OVERLONG_2,
+        U8_CARRY,
+        U8_CARRY,
+        U8_CARRY | U8_TOO_LARGE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_OVERLONG_3 | U8_OVERLONG_2 | U8_OVERLONG_4,
+        U8_CARRY | U8_OVERLONG_2,
+        U8_CARRY,
+        U8_CARRY,
+        U8_CARRY | U8_TOO_LARGE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000 | U8_SURROGATE,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000,
+        U8_CARRY | U8_TOO_LARGE | U8_TOO_LARGE_1000);
+    const __m256i byte_2_high_table = _mm256_setr_epi8(
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE_1000 | U8_OVERLONG_4,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_OVERLONG_3 | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_LONG | U8_OVERLONG_2 | U8_TWO_CONTS | U8_SURROGATE | U8_TOO_LARGE,
+        U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT, U8_TOO_SHORT);
+    const __m256i low_nibble = _mm256_set1_epi8(0x0F);
+
+    __m256i prev1 = utf8_prev(input, prev_input, 1);
+    __m256i byte_1_high = _mm256_shuffle_epi8(byte_1_high_table,
+        _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low_nibble));
+    __m256i byte_1_low = _mm256_shuffle_epi8(byte_1_low_table,
+        _mm256_and_si256(prev1, low_nibble));
+    __m256i byte_2_high = _mm256_shuffle_epi8(byte_2_high_table,
+        _mm256_and_si256(_mm256_srli_epi16(input, 4), low_nibble));
+    __m256i special_cases = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // 三、四字节序列的第 3/4 个字节必须是续字节，这一点无法由相邻两字节判断
+    __m256i prev2 = utf8_prev(input, prev_input, 2);
+    __m256i prev3 = utf8_prev(input, prev_input, 3);
+    __m256i is_third_byte = _mm256_subs_epu8(prev2, _mm256_set1_epi8((char)(0xE0 - 0x80)));
+    __m256i is_fourth_byte = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+    __m256i must23_80 = _mm256_and_si256(_mm256_or_si256(is_third_byte, is_fourth_byte),
+                                         _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must23_80, special_cases);
+}
+
+// utf8_validate_avx2 函数：AVX2 查表校验一段以字符边界开始和结束的数据
+// 返回值: 合法返回 1，否则返回 0
+__attribute__((target("avx2")))
+int utf8_validate_avx2(const unsigned char *p, size_t len) {
+    // 块末尾的字节若大于这些值，说明一个多字节序列会延续到下一块
+    const __m256i max_value = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev_input = _mm256_setzero_si256();
+    __m256i prev_incomplete = _mm256_setzero_si256();
+    size_t i = 0;
+
+    while (i < len) {
+        __m256i input;
+        if (len - i >= 32) {
+            input = _mm256_loadu_si256((const __m256i *)(p + i));
+        } else {
+            unsigned char tail[32] = { 0 }; // 零填充是 ASCII，不会引入新的错误
+            memcpy(tail, p + i, len - i);
+            input = _mm256_loadu_si256((const __m256i *)tail);
+        }
+        if (_mm256_movemask_epi8(input) == 0) {
+            // 纯 ASCII 块: 只需确认上一块没有留下未完成的序列
+            error = _mm256_or_si256(error, prev_incomplete);
+        } else {
+            error = _mm256_or_si256(error, utf8_check_block(input, prev_input));
+            prev_incomplete = _mm256_subs_epu8(input, max_value);
+        }
+        prev_input = input;
+        i += 32;
+    }
+    error = _mm256_or_si256(error, prev_incomplete);
+    return _mm256_testz_si256(error, error);
+}
+#endif
+
+// utf8_incomplete_tail 函数：返回 p[0..len) 末尾未完成的多字节序列的长度 (0 到 3)
+size_t utf8_incomplete_tail(const unsigned char *p, size_t len) {
+    for (size_t j = 1; j <= 3 && j <= len; j++) {
+        unsigned char b = p[len - j];
+        if (b < 0x80) {
+            return 0;
+        }
+        if (b >= 0xC0) {
+            size_t need = b >= 0xF0 ? 4 : (b >= 0xE0 ? 3 : 2);
+            return need > j ? j : 0;
+        }
+    }
+    return 0;
+}
+
+// utf8_report 函数：报告第一个无效字节在流中的偏移
+void utf8_report(uint64_t offset) {
+    fprintf(stderr, "UTF-8 校验失败: 偏移 %llu 处存在无效字节\n", (unsigned long long)offset);
+}
+
+// utf8_out_bound 函数：修复模式下最坏情况每个输入字节变成一个 3 字节的 U+FFFD
+size_t utf8_out_bound(size_t len) {
+    return len * 3 + sizeof(((struct utf8_state *)0)->carry) * 3;
+}
+
+// utf8_apply 函数：校验阶段的处理函数
+// 数据在刚读入、仍在缓存中时完成校验；没有错误时直接原样输出，不产生任何拷贝。
+char *utf8_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    struct utf8_state *s = t->state;
+    const unsigned char *p = (const unsigned char *)in;
+    size_t op = 0;  // 修复模式下 out 中已写入的字节数
+    size_t ip = 0;  // 已处理的输入字节数
+
+    // 1. 先用本缓冲区开头的字节补全上一个缓冲区遗留的序列
+    while (s->carry_len > 0) {
+        unsigned char tmp[8];
+        size_t take = len < 3 ? len : 3;
+        memcpy(tmp, s->carry, s->carry_len);
+        memcpy(tmp + s->carry_len, p, take);
+        int r = utf8_sequence(tmp, s->carry_len + take);
+        if (r == 0 && !final) {
+            // 输入太短，仍然无法补全。校验模式下数据照常原样输出，carry 只是留作校验的副本
+            memcpy(s->carry + s->carry_len, p, take);
+            s->carry_len += take;
+            s->offset += len;
+            *out_len = s->repair ? op : len;
+            return s->repair ? out : in;
+        }
+        if (r > 0) {
+            if (s->repair) {
+                memcpy(out + op, tmp, (size_t)r);
+                op += (size_t)r;
+            }
+            ip = (size_t)r - s->carry_len;
+            s->carry_len = 0;
+            break;
+        }
+        if (!s->repair) {
+            utf8_report(s->offset - s->carry_len);
+            t->stop = 1;
+            *out_len = 0;
+            return in;
+        }
+        memcpy(out + op, UTF8_REPLACEMENT, sizeof(UTF8_REPLACEMENT));
+        op += sizeof(UTF8_REPLACEMENT);
+        size_t bad = r == 0 ? s->carry_len + take : (size_t)-r;
+        if (bad >= s->carry_len) {
+            ip = bad - s->carry_len;
+            s->carry_len = 0;
+        } else {
+            // 遗留字节本身就无效，去掉无效部分后继续尝试
+            memmove(s->carry, s->carry + bad, s->carry_len - bad);
+            s->carry_len -= bad;
+        }
+    }
+
+    // 2. 末尾未完成的序列留到下一个缓冲区，中间部分走向量化快速路径
+    size_t tail = final ? 0 : utf8_incomplete_tail(p + ip, len - ip);
+    size_t end = len - tail;
+    int valid = s->validate(p + ip, end - ip);
+
+    if (valid && !s->repair) {
+        memcpy(s->carry, p + end, tail);
+        s->carry_len = tail;
+        s->offset += len;
+        *out_len = len;
+        return in;
+    }
+
+    // 3. 快速路径发现错误 (或修复模式): 标量逐字符定位/替换
+    while (ip < end) {
+        if (valid) {
+            memcpy(out + op, p + ip, end - ip);
+            op += end - ip;
+            break;
+        }
+        int r = utf8_sequence(p + ip, end - ip);
+        if (r > 0) {
+            if (s->repair) {
+                memcpy(out + op, p + ip, (size_t)r);
+                op += (size_t)r;
+            }
+            ip += (size_t)r;
+            continue;
+        }
+        if (!s->repair) {
+            utf8_report(s->offset + ip);
+            t->stop = 1;
+            *out_len = ip;
+            return in;
+        }
+        memcpy(out + op, UTF8_REPLACEMENT, sizeof(UTF8_REPLACEMENT));
+        op += sizeof(UTF8_REPLACEMENT);
+        ip += r == 0 ? end - ip : (size_t)-r;
+    }
+
+    memcpy(s->carry, p + end, tail);
+    s->carry_len = tail;
+    s->offset += len;
+    *out_len = op;
+    return out;
+}
+
+// add_utf8_stage 函数：启用 UTF-8 校验阶段
+// 参数: repair - 1 为修复模式，0 为校验模式
+void add_utf8_stage(int repair) {
+    struct utf8_state *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        perror("分配 UTF-8 校验状态失败");
+        exit(EXIT_FAILURE);
+    }
+    state->repair = repair;
+    state->validate = utf8_validate_scalar;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        state->validate = utf8_validate_avx2;
+    }
+#endif
+    struct transform t = {
+        .name = "utf8",
+        .out_bound = repair ? utf8_out_bound : NULL,
+        .apply = utf8_apply,
+        .state = state,
+    };
+    add_transform(&t);
+}
+
+// ---------------------------------------------------------------------------
+// 换行符转换 (--crlf-to-lf / --lf-to-crlf)
+// ---------------------------------------------------------------------------
+
+enum eol_mode {
+    EOL_CRLF_TO_LF,
+    EOL_LF_TO_CRLF,
+};
+
+// 换行符转换的流式状态
+struct eol_state {
+    enum eol_mode mode;
+    int pending_cr;   // CRLF→LF: 上一个缓冲区以 CR 结尾，要看到下一个字节才能决定是否丢弃
+    char last;        // LF→CRLF: 上一个缓冲区的最后一个字节，用于判断 LF 前面是否已有 CR
+};
+
+// 以 8 字节为一组的压缩/扩展置换表，下标为组内需要删除 (或在前面插入 CR) 的字节掩码
+static unsigned char eol_compress_shuffle[256][16];
+static unsigned char eol_expand_shuffle[256][16];
+static unsigned char eol_expand_cr[256][16];
+
+// init_eol_tables 函数：生成压缩与扩展用的 pshufb 置换表
+void init_eol_tables() {
+    for (int m = 0; m < 256; m++) {
+        int k = 0;
+        for (int i = 0; i < 8; i++) {
+            if (!(m & (1 << i))) {
+                eol_compress_shuffle[m][k++] = (unsigned char)i;
+            }
+        }
+        while (k < 16) {
+            eol_compress_shuffle[m][k++] = 0x80; // pshufb 下标最高位为 1 时输出 0
+        }
+
+        k = 0;
+        for (int i = 0; i < 8; i++) {
+            if (m & (1 << i)) {
+                eol_expand_shuffle[m][k] = 0x80;
+                eol_expand_cr[m][k++] = '\r';
+            }
+            eol_expand_shuffle[m][k] = (unsigned char)i;
+            eol_expand_cr[m][k++] = 0;
+        }
+        while (k < 16) {
+            eol_expand_shuffle[m][k] = 0x80;
+            eol_expand_cr[m][k++] = 0;
+        }
+    }
+}
+
+// crlf_to_lf_scalar 函数：把 in[0..len) 中后面紧跟 LF 的 CR 删除，结果写入 out
+// 调用者保证 in[len] 可读 (它是下一个字节，本身不处理)
+// 返回值: 写入 out 的字节数
+size_t crlf_to_lf_scalar(const char *in, size_t len, char *out) {
+    size_t op = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (!(in[i] == '\r' && in[i + 1] == '\n')) {
+            out[op++] = in[i];
+        }
+    }
+    return op;
+}
+
+// lf_to_crlf_scalar 函数：在 in[0..len) 中前面不是 CR 的 LF 之前插入 CR，结果写入 out
+// 调用者保证 in[-1] 可读 (它是上一个字节，本身不处理)
+// 返回值: 写入 out 的字节数
+size_t lf_to_crlf_scalar(const char *in, size_t len, char *out) {
+    size_t op = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (in[i] == '\n' && in[i - 1] != '\r') {
+            out[op++] = '\r';
+        }
+        out[op++] = in[i];
+    }
+    return op;
+}
+
+#if defined(__x86_64__)
+// crlf_to_lf_avx2 函数：与 crlf_to_lf_scalar 相同，不含 CR 的 32 字节块整块存储，
+// 其余块按 8 字节一组用 pshufb 压缩掉需要删除的 CR
+__attribute__((target("avx2")))
+size_t crlf_to_lf_avx2(const char *in, size_t len, char *out) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    size_t op = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i next = _mm256_loadu_si256((const __m256i *)(in + i + 1));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(
+            _mm256_and_si256(_mm256_cmpeq_epi8(v, cr), _mm256_cmpeq_epi8(next, lf)));
+        if (m == 0) {
+            _mm256_storeu_si256((__m256i *)(out + op), v);
+            op += 32;
+            continue;
+        }
+        for (int g = 0; g < 4; g++) {
+            unsigned bits = (m >> (8 * g)) & 0xFF;
+            __m128i group = _mm_loadl_epi64((const __m128i *)(in + i + 8 * g));
+            __m128i shuf = _mm_loadu_si128((const __m128i *)eol_compress_shuffle[bits]);
+            _mm_storeu_si128((__m128i *)(out + op), _mm_shuffle_epi8(group, shuf));
+            op += 8 - (size_t)__builtin_popcount(bits);
+        }
+    }
+    return op + crlf_to_lf_scalar(in + i, len - i, out + op);
+}
+
+// lf_to_crlf_avx2 函数：与 lf_to_crlf_scalar 相同，不含 LF 的 32 字节块整块存储，
+// 其余块按 8 字节一组用 pshufb 展开并插入 CR
+__attribute__((target("avx2")))
+size_t lf_to_crlf_avx2(const char *in, size_t len, char *out) {
+    const __m256i cr = _mm256_set1_epi8('\r');
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    size_t op = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i));
+        __m256i prev = _mm256_loadu_si256((const __m256i *)(in + i - 1));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(
+            _mm256_andnot_si256(_mm256_cmpeq_epi8(prev, cr), _mm256_cmpeq_epi8(v, lf)));
+        if (m == 0) {
+            _mm256_storeu_si256((__m256i *)(out + op), v);
+            op += 32;
+            continue;
+        }
+        for (int g = 0; g < 4; g++) {
+            unsigned bits = (m >> (8 * g)) & 0xFF;
+            __m128i group = _mm_loadl_epi64((const __m128i *)(in + i + 8 * g));
+            __m128i shuf = _mm_loadu_si128((const __m128i *)eol_expand_shuffle[bits]);
+            __m128i crs = _mm_loadu_si128((const __m128i *)eol_expand_cr[bits]);
+            _mm_storeu_si128((__m128i *)(out + op), _mm_or_si128(_mm_shuffle_epi8(group, shuf), crs));
+            op += 8 + (size_t)__builtin_popcount(bits);
+        }
+    }
+    return op + lf_to_crlf_scalar(in + i, len - i, out + op);
+}
+#endif
+
+static size_t (*crlf_to_lf_impl)(const char *in, size_t len, char *out) = crlf_to_lf_scalar;
+static size_t (*lf_to_crlf_impl)(const char *in, size_t len, char *out) = lf_to_crlf_scalar;
+
+// eol_out_bound 函数：LF→CRLF 最坏情况下输出翻倍，另留出向量存储越界写的余量
+size_t eol_out_bound(size_t len) {
+    return len * 2 + 32;
+}
+
+// eol_apply 函数：换行符转换阶段的处理函数
+char *eol_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    struct eol_state *s = t->state;
+    size_t op = 0;
+
+    if (s->mode == EOL_CRLF_TO_LF) {
+        // 上一个缓冲区末尾的 CR: 如果本缓冲区以 LF 开头则丢弃，否则照常输出
+        if (s->pending_cr) {
+            if (len == 0 || in[0] != '\n') {
+                out[op++] = '\r';
+            }
+            s->pending_cr = 0;
+        }
+        if (len == 0) {
+            *out_len = op;
+            return out;
+        }
+        // 最后一个字节的去留取决于下一个缓冲区，先处理前 len - 1 个字节
+        op += crlf_to_lf_impl(in, len - 1, out + op);
+        if (in[len - 1] == '\r' && !final) {
+            s->pending_cr = 1;
+        } else {
+            out[op++] = in[len - 1];
+        }
+    } else {
+        if (len == 0) {
+            *out_len = 0;
+            return out;
+        }
+        // 第一个字节需要看上一个缓冲区的最后一个字节
+        if (in[0] == '\n' && s->last != '\r') {
+            out[op++] = '\r';
+        }
+        out[op++] = in[0];
+        op += lf_to_crlf_impl(in + 1, len - 1, out + op);
+        s->last = in[len - 1];
+    }
+    *out_len = op;
+    return out;
+}
+
+// add_eol_stage 函数：启用换行符转换阶段
+// 每个阶段有自己的状态，两个方向可以在同一条变换链中先后出现
+void add_eol_stage(enum eol_mode mode) {
+    struct eol_state *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        perror("分配换行符转换状态失败");
+        exit(EXIT_FAILURE);
+    }
+    state->mode = mode;
+    init_eol_tables();
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2")) {
+        crlf_to_lf_impl = crlf_to_lf_avx2;
+        lf_to_crlf_impl = lf_to_crlf_avx2;
+    }
+#endif
+    struct transform t = {
+        .name = mode == EOL_CRLF_TO_LF ? "crlf-to-lf" : "lf-to-crlf",
+        .out_bound = eol_out_bound,
+        .apply = eol_apply,
+        .state = state,
+    };
+    add_transform(&t);
+}
+
+// ---------------------------------------------------------------------------
+// 十六进制转储 (-x)
+// ---------------------------------------------------------------------------
+
+// 与 xxd 默认格式一致: "00000000: 4865 6c6c 6f0a ...  Hello."
+#define HEX_BYTES_PER_LINE 16
+#define HEX_OFFSET_WIDTH 10   // "%08x: "
+#define HEX_AREA_WIDTH 39     // 8 组 4 个十六进制字符，组间一个空格
+#define HEX_ASCII_COLUMN (HEX_OFFSET_WIDTH + HEX_AREA_WIDTH + 2)
+// 一行输出的最大长度: 偏移量最多 16 位十六进制数字时再多 8 个字符
+#define HEX_MAX_LINE (HEX_ASCII_COLUMN + HEX_BYTES_PER_LINE + 1 + 8)
+
+static const char HEX_DIGITS[16] = "0123456789abcdef";
+
+// 十六进制转储的流式状态
+struct hex_state {
+    uint64_t offset;                           // 下一行第一个字节在流中的偏移
+    unsigned char partial[HEX_BYTES_PER_LINE]; // 上一个缓冲区末尾不足一行的字节
+    size_t partial_len;
+    // 把 16 字节转换为 32 个十六进制字符和 16 个 ASCII 列字符
+    void (*convert)(const unsigned char *in, char *hex, char *ascii);
+};
+
+// hex_convert_scalar 函数：逐字节查表转换一行
+void hex_convert_scalar(const unsigned char *in, char *hex, char *ascii) {
+    for (int i = 0; i < HEX_BYTES_PER_LINE; i++) {
+        hex[2 * i] = HEX_DIGITS[in[i] >> 4];
+        hex[2 * i + 1] = HEX_DIGITS[in[i] & 0x0F];
+        ascii[i] = (in[i] >= 0x20 && in[i] <= 0x7E) ? (char)in[i] : '.';
+    }
+}
+
+#if defined(__x86_64__)
+// hex_convert_ssse3 函数：用 pshufb 做半字节查表，一次转换一行 16 字节
+__attribute__((target("ssse3,sse4.1")))
+void hex_convert_ssse3(const unsigned char *in, char *hex, char *ascii) {
+    const __m128i digits = _mm_loadu_si128((const __m128i *)HEX_DIGITS);
+    const __m128i low_nibble = _mm_set1_epi8(0x0F);
+    __m128i v = _mm_loadu_si128((const __m128i *)in);
+
+    __m128i hi = _mm_shuffle_epi8(digits, _mm_and_si128(_mm_srli_epi16(v, 4), low_nibble));
+    __m128i lo = _mm_shuffle_epi8(digits, _mm_and_si128(v, low_nibble));
+    _mm_storeu_si128((__m128i *)hex, _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(hex + 16), _mm_unpackhi_epi8(hi, lo));
+
+    // 可打印字符为 0x20..0x7E: 有符号比较时 0x80..0xFF 为负数，同样落在范围外
+    __m128i printable = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(0x1F)),
+                                      _mm_cmplt_epi8(v, _mm_set1_epi8(0x7F)));
+    _mm_storeu_si128((__m128i *)ascii, _mm_blendv_epi8(_mm_set1_epi8('.'), v, printable));
+}
+#endif
+
+// hex_format_line 函数：格式化一行 (len 可以小于 16，仅流的最后一行如此)
+// 返回值: 写入 out 的字节数
+size_t hex_format_line(struct hex_state *s, const unsigned char *in, size_t len, char *out) {
+    char hex[2 * HEX_BYTES_PER_LINE];
+    char ascii[HEX_BYTES_PER_LINE];
+    size_t op = 0;
+
+    // 偏移量: 至少 8 位十六进制数字
+    int width = 8;
+    while (width < 16 && (s->offset >> (4 * width)) != 0) {
+        width++;
+    }
+    for (int i = width - 1; i >= 0; i--) {
+        out[op++] = HEX_DIGITS[(s->offset >> (4 * i)) & 0x0F];
+    }
+    out[op++] = ':';
+    out[op++] = ' ';
+
+    if (len == HEX_BYTES_PER_LINE) {
+        // 完整行: 布局固定，直接按组存储
+        s->convert(in, hex, ascii);
+        for (int g = 0; g < HEX_BYTES_PER_LINE / 2; g++) {
+            memcpy(out + op, hex + 4 * g, 4);
+            out[op + 4] = ' ';
+            op += 5;
+        }
+        out[op++] = ' ';
+        memcpy(out + op, ascii, HEX_BYTES_PER_LINE);
+        op += HEX_BYTES_PER_LINE;
+        out[op++] = '\n';
+        s->offset += len;
+        return op;
+    }
+
+    unsigned char line[HEX_BYTES_PER_LINE] = { 0 };
+    memcpy(line, in, len);
+    hex_convert_scalar(line, hex, ascii);
+
+    // 十六进制区: 每 2 个字节一组，不足一行时用空格补齐，保证 ASCII 列对齐
+    size_t hex_start = op;
+    for (size_t i = 0; i < len; i += 2) {
+        if (i > 0) {
+            out[op++] = ' ';
+        }
+        size_t n = len - i >= 2 ? 4 : 2;
+        memcpy(out + op, hex + 2 * i, n);
+        op += n;
+    }
+    while (op - hex_start < HEX_AREA_WIDTH + 2) {
+        out[op++] = ' ';
+    }
+    memcpy(out + op, ascii, len);
+    op += len;
+    out[op++] = '\n';
+
+    s->offset += len;
+    return op;
+}
+
+// hex_out_bound 函数：每 16 字节输入对应一行输出，另加上一行残留和最后一个不完整行
+size_t hex_out_bound(size_t len) {
+    return (len / HEX_BYTES_PER_LINE + 2) * HEX_MAX_LINE;
+}
+
+// hex_apply 函数：十六进制转储阶段的处理函数
+// 整个输入缓冲区的转储结果写入预先分配好的输出缓冲区，由复制循环一次 write 写出。
+char *hex_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    struct hex_state *s = t->state;
+    const unsigned char *p = (const unsigned char *)in;
+    size_t op = 0;
+
+    // 先用本缓冲区开头的字节补齐上一个缓冲区残留的不完整行
+    if (s->partial_len > 0) {
+        size_t take = HEX_BYTES_PER_LINE - s->partial_len;
+        if (take > len) {
+            take = len;
+        }
+        memcpy(s->partial + s->partial_len, p, take);
+        s->partial_len += take;
+        p += take;
+        len -= take;
+        if (s->partial_len == HEX_BYTES_PER_LINE) {
+            op += hex_format_line(s, s->partial, HEX_BYTES_PER_LINE, out + op);
+            s->partial_len = 0;
+        }
+    }
+
+    while (len >= HEX_BYTES_PER_LINE) {
+        op += hex_format_line(s, p, HEX_BYTES_PER_LINE, out + op);
+        p += HEX_BYTES_PER_LINE;
+        len -= HEX_BYTES_PER_LINE;
+    }
+    if (len > 0) {
+        memcpy(s->partial + s->partial_len, p, len);
+        s->partial_len += len;
+    }
+
+    if (final && s->partial_len > 0) {
+        op += hex_format_line(s, s->partial, s->partial_len, out + op);
+        s->partial_len = 0;
+    }
+    *out_len = op;
+    return out;
+}
+
+// add_hex_stage 函数：启用十六进制转储阶段
+void add_hex_stage() {
+    struct hex_state *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        perror("分配十六进制转储状态失败");
+        exit(EXIT_FAILURE);
+    }
+    state->convert = hex_convert_scalar;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1")) {
+        state->convert = hex_convert_ssse3;
+    }
+#endif
+    struct transform t = {
+        .name = "hex",
+        .out_bound = hex_out_bound,
+        .apply = hex_apply,
+        .state = state,
+    };
+    add_transform(&t);
+}
+
+// ---------------------------------------------------------------------------
+// Base64 编码/解码 (--base64 / --base64-decode)
+// ---------------------------------------------------------------------------
+
+static const char BASE64_ALPHABET[64] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#define BASE64_INVALID 0xFF
+#define BASE64_SKIP    0xFE  // 解码时忽略的换行符
+
+// Base64 的流式状态
+struct base64_state {
+    int decode;
+    unsigned char carry[4];  // 编码: 不足 3 字节的输入; 解码: 不足 4 个字符的一组 (已转换为 6 位值)
+    size_t carry_len;
+    int padded;              // 解码: 已经遇到 '='，之后只允许出现换行符和补齐本组的 '='
+    int pad_left;            // 解码: 补齐本组还需要的 '=' 个数
+    uint64_t offset;         // 解码: 当前缓冲区第一个字节在流中的偏移，用于报告错误
+    int use_avx2;
+};
+
+static unsigned char base64_decode_table[256];
+
+// init_base64_table 函数：生成解码查找表
+void init_base64_table() {
+    memset(base64_decode_table, BASE64_INVALID, sizeof(base64_decode_table));
+    for (int i = 0; i < 64; i++) {
+        base64_decode_table[(unsigned char)BASE64_ALPHABET[i]] = (unsigned char)i;
+    }
+    base64_decode_table['\n'] = BASE64_SKIP;
+    base64_decode_table['\r'] = BASE64_SKIP;
+}
+
+// base64_encode_group 函数：把 3 字节编码为 4 个字符
+static inline void base64_encode_group(const unsigned char *in, char *out) {
+    uint32_t v = ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | in[2];
+    out[0] = BASE64_ALPHABET[(v >> 18) & 0x3F];
+    out[1] = BASE64_ALPHABET[(v >> 12) & 0x3F];
+    out[2] = BASE64_ALPHABET[(v >> 6) & 0x3F];
+    out[3] = BASE64_ALPHABET[v & 0x3F];
+}
+
+#if defined(__x86_64__)
+// 向量化 Base64 (Muła & Lemire, "Faster Base64 Encoding and Decoding Using AVX2 Instructions")
+
+// base64_encode_avx2 函数：每次把 24 字节编码为 32 个字符
+// 每次加载从 in - 4 开始的 32 字节，调用者保证 in[-4..-1] 可读 (i >= 4)
+// 返回值: 已编码的输入字节数 (3 的倍数)
+__attribute__((target("avx2")))
+size_t base64_encode_avx2(const unsigned char *in, size_t len, char *out) {
+    const __m256i shuf = _mm256_set_epi8(
+        10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1,
+        14, 15, 13, 14, 11, 12, 10, 11, 8, 9, 7, 8, 5, 6, 4, 5);
+    const __m256i lut = _mm256_setr_epi8(
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+        65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+    size_t i = 0;
+
+    while (i + 28 <= len) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + i - 4));
+        // 把每 3 字节拆成 4 个 6 位值，分别放在 4 个字节中
+        v = _mm256_shuffle_epi8(v, shuf);
+        __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+        __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+        __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+        __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+        v = _mm256_or_si256(t1, t3);
+        // 6 位值到 ASCII: 按所在区间查表得到需要加上的偏移
+        __m256i idx = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+        idx = _mm256_sub_epi8(idx, _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25)));
+        v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, idx));
+        _mm256_storeu_si256((__m256i *)out, v);
+        i += 24;
+        out += 32;
+    }
+    return i;
+}
+
+// base64_decode_avx2 函数：把 32 个字符解码为 24 字节
+// 输出写入 32 字节 (后 8 字节无意义)，调用者需留出余量
+// 返回值: 这 32 个字符全部合法时返回 1，否则返回 0 (由标量路径处理)
+__attribute__((target("avx2")))
+int base64_decode_avx2(const unsigned char *in, char *out) {
+    const __m256i lut_lo = _mm256_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A,
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m256i lut_hi = _mm256_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m256i lut_roll = _mm256_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0,
+        0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i mask_2f = _mm256_set1_epi8(0x2F);
+
+    __m256i str = _mm256_loadu_si256((const __m256i *)in);
+    __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    if (!_mm256_testz_si256(lo, hi)) {
+        return 0; // 含有非字母表字符 (换行、'=' 或非法字符)
+    }
+    __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+    __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+    str = _mm256_add_epi8(str, roll);
+
+    // 把每 4 个 6 位值合并为 3 字节并压紧到低 24 字节
+    __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+    merged = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+    merged = _mm256_shuffle_epi8(merged, _mm256_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    merged = _mm256_permutevar8x32_epi32(merged, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, -1, -1));
+    _mm256_storeu_si256((__m256i *)out, merged);
+    return 1;
+}
+#endif
+
+// base64_encode_apply 函数：编码阶段的处理函数 (输出不换行，便于直接嵌入 JSON)
+char *base64_encode_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    struct base64_state *s = t->state;
+    const unsigned char *p = (const unsigned char *)in;
+    size_t ip = 0;
+    size_t op = 0;
+
+    // 只有短读时才会有残留: 先补齐上一个缓冲区剩下的不足 3 字节
+    while (s->carry_len > 0 && s->carry_len < 3 && ip < len) {
+        s->carry[s->carry_len++] = p[ip++];
+    }
+    if (s->carry_len == 3) {
+        base64_encode_group(s->carry, out + op);
+        op += 4;
+        s->carry_len = 0;
+    }
+
+    // 向量化路径需要读取 in[i - 4]，先用标量编码至少一组
+    while (ip < 4 && len - ip >= 3) {
+        base64_encode_group(p + ip, out + op);
+        ip += 3;
+        op += 4;
+    }
+#if defined(__x86_64__)
+    if (s->use_avx2 && ip >= 4) {
+        size_t done = base64_encode_avx2(p + ip, len - ip, out + op);
+        ip += done;
+        op += done / 3 * 4;
+    }
+#endif
+    while (len - ip >= 3) {
+        base64_encode_group(p + ip, out + op);
+        ip += 3;
+        op += 4;
+    }
+    while (ip < len) {
+        s->carry[s->carry_len++] = p[ip++];
+    }
+
+    // 输入结束: 用 '=' 填充最后不足 3 字节的一组
+    if (final && s->carry_len > 0) {
+        unsigned char group[3] = { 0, 0, 0 };
+        memcpy(group, s->carry, s->carry_len);
+        base64_encode_group(group, out + op);
+        if (s->carry_len == 1) {
+            out[op + 2] = '=';
+        }
+        out[op + 3] = '=';
+        op += 4;
+        s->carry_len = 0;
+    }
+    *out_len = op;
+    return out;
+}
+
+// base64_encode_bound 函数：编码输出上界，另留出向量存储的余量
+size_t base64_encode_bound(size_t len) {
+    return (len + 2) / 3 * 4 + 4 + 32;
+}
+
+// base64_decode_error 函数：报告无效输入并要求终止复制
+char *base64_decode_error(struct transform *t, uint64_t offset, char *out, size_t op, size_t *out_len) {
+    fprintf(stderr, "base64 解码失败: 偏移 %llu 处存在无效字符\n", (unsigned long long)offset);
+    t->stop = 1;
+    *out_len = op;
+    return out;
+}
+
+// base64_decode_apply 函数：解码阶段的处理函数，忽略输入中的换行符
+char *base64_decode_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    struct base64_state *s = t->state;
+    const unsigned char *p = (const unsigned char *)in;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len) {
+#if defined(__x86_64__)
+        // 处在组边界且剩余足够时走向量化路径，遇到换行等字符时退回标量处理
+        if (s->use_avx2 && s->carry_len == 0 && !s->padded && len - ip >= 32
+            && base64_decode_avx2(p + ip, out + op)) {
+            ip += 32;
+            op += 24;
+            continue;
+        }
+#endif
+        unsigned char c = p[ip];
+        unsigned char v = base64_decode_table[c];
+        if (v == BASE64_SKIP) {
+            ip++;
+            continue;
+        }
+        if (c == '=') {
+            // 填充只能出现在一组的第 3、4 个字符处，并且正好补齐这一组
+            if (s->padded ? s->pad_left == 0 : s->carry_len < 2) {
+                return base64_decode_error(t, s->offset + ip, out, op, out_len);
+            }
+            if (s->padded) {
+                s->pad_left--;
+            } else {
+                out[op++] = (char)((s->carry[0] << 2) | (s->carry[1] >> 4));
+                if (s->carry_len == 3) {
+                    out[op++] = (char)((s->carry[1] << 4) | (s->carry[2] >> 2));
+                }
+                s->padded = 1;
+                s->pad_left = 3 - (int)s->carry_len;
+                s->carry_len = 0;
+            }
+            ip++;
+            continue;
+        }
+        if (v == BASE64_INVALID || s->padded) {
+            return base64_decode_error(t, s->offset + ip, out, op, out_len);
+        }
+        s->carry[s->carry_len++] = v;
+        ip++;
+        if (s->carry_len == 4) {
+            out[op++] = (char)((s->carry[0] << 2) | (s->carry[1] >> 4));
+            out[op++] = (char)((s->carry[1] << 4) | (s->carry[2] >> 2));
+            out[op++] = (char)((s->carry[2] << 6) | s->carry[3]);
+            s->carry_len = 0;
+        }
+    }
+    s->offset += len;
+
+    // 输入结束时填充没有补齐一组 (如 "YQ=") 是无效的
+    if (final && s->padded && s->pad_left > 0) {
+        return base64_decode_error(t, s->offset, out, op, out_len);
+    }
+    // 输入结束时残留的不完整一组: 缺少填充的 2、3 个字符仍可解码，1 个字符则无效
+    if (final && s->carry_len > 0) {
+        if (s->carry_len == 1) {
+            return base64_decode_error(t, s->offset, out, op, out_len);
+        }
+        out[op++] = (char)((s->carry[0] << 2) | (s->carry[1] >> 4));
+        if (s->carry_len == 3) {
+            out[op++] = (char)((s->carry[1] << 4) | (s->carry[2] >> 2));
+        }
+        s->carry_len = 0;
+    }
+    *out_len = op;
+    return out;
+}
+
+// base64_decode_bound 函数：解码输出上界，另留出向量存储的余量
+size_t base64_decode_bound(size_t len) {
+    return len / 4 * 3 + 3 + 32;
+}
+
+// add_base64_stage 函数：启用 Base64 编码或解码阶段
+void add_base64_stage(int decode) {
+    struct base64_state *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        perror("分配 Base64 状态失败");
+        exit(EXIT_FAILURE);
+    }
+    state->decode = decode;
+    init_base64_table();
+#if defined(__x86_64__)
+    state->use_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    struct transform t = {
+        .name = decode ? "base64-decode" : "base64",
+        .out_bound = decode ? base64_decode_bound : base64_encode_bound,
+        .apply = decode ? base64_decode_apply : base64_encode_apply,
+        .state = state,
+        // 每次读取的长度按组对齐，普通文件的整块读取不会留下需要拼接的残留
+        .in_align = decode ? 4 : 3,
+    };
+    add_transform(&t);
+}
+
+// ---------------------------------------------------------------------------
+// AES-GCM 加密/解密 (--encrypt / --decrypt)
+// ---------------------------------------------------------------------------
+
+// 用 AES-NI 计算 AES、用 PCLMULQDQ 计算 GHASH，不依赖外部密码库，直接作为变换阶段
+// 嵌入复制循环。明文被切成 GCM_CHUNK 大小的帧分别认证: 解密时每帧校验通过后才输出，
+// 不必等到流结束。帧序号是 IV 的一部分，最后一帧带结束标记并计入附加数据，
+// 因此帧被篡改、重排、删除或者流被截断都会被发现。
+//
+// 流格式: 文件头 = "MCATGCM" + 版本 (1 字节) + 随机盐 (12 字节)
+//         帧     = 长度字段 (4 字节小端，低 31 位为明文长度，最高位为结束标记) + 密文 + 标签 (16 字节)
+// 每个流用自己的子密钥加密: 子密钥的第 j 个 16 字节块 = AES(主密钥, 盐 + j (4 字节大端))，
+// AES-128 取 1 块，AES-256 取 2 块。第 i 帧的 IV = 8 个零字节 + i (4 字节大端)，
+// 附加数据 = 结束标记 (1 字节)。IV 只需在同一子密钥下唯一；随机的只是 96 位的盐，
+// 同一主密钥加密 2^32 个流时盐重复的概率约为 2^-33，而不是随机 IV 前缀时的生日界。
+// 密钥文件包含 16 或 32 字节的原始密钥，或者 32/64 个十六进制字符，对应 AES-128/AES-256。
+
+#define GCM_MAGIC "MCATGCM"
+#define GCM_VERSION 2
+#define GCM_SALT_SIZE 12
+#define GCM_HEADER_SIZE (8 + GCM_SALT_SIZE)
+#define GCM_CHUNK (64 * 1024)  // 每帧的明文长度，也是加密阶段的读取对齐单位
+#define GCM_TAG_SIZE 16
+#define GCM_FRAME_OVERHEAD (4 + GCM_TAG_SIZE)
+#define GCM_FINAL_FLAG 0x80000000u
+#define GCM_MAX_ROUNDS 14
+
+#if defined(__x86_64__)
+#include <wmmintrin.h>  // 包含 AES-NI 与 PCLMULQDQ intrinsics
+
+#define GCM_TARGET __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+
+// AES-GCM 的流式状态
+struct gcm_state {
+    int decrypt;
+    int rounds;                              // 10 (AES-128) 或 14 (AES-256)
+    __m128i round_keys[GCM_MAX_ROUNDS + 1];  // 派生出子密钥之前是主密钥的轮密钥
+    __m128i h_powers[8];                     // H^1 .. H^8 (字节已反转)，GHASH 每次聚合 8 块
+    unsigned char salt[GCM_SALT_SIZE];
+    uint64_t frame_index;                    // 下一帧的序号
+    int header_done;                         // 加密: 已输出文件头; 解密: 已读取并校验文件头
+    int final_seen;                          // 解密: 已处理过带结束标记的帧
+    unsigned char *pending;                  // 加密: 不足一帧的明文; 解密: 跨越缓冲区边界的文件头或帧
+    size_t pending_len;
+    uint64_t offset;                         // 解密: 当前缓冲区第一个字节在流中的偏移，用于报告错误
+};
+
+// AES-128 密钥扩展的一步
+#define GCM_EXPAND_128(rk, i, rcon)                                                   \
+    do {                                                                              \
+        __m128i t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[(i) - 1], rcon), 0xff); \
+        __m128i k = rk[(i) - 1];                                                      \
+        k = _mm_xor_si128(k, _mm_slli_si128(k, 4));                                   \
+        k = _mm_xor_si128(k, _mm_slli_si128(k, 8));                                   \
+        rk[i] = _mm_xor_si128(k, t);                                                  \
+    } while (0)
+
+// AES-256 密钥扩展的两步: 偶数轮密钥用 rcon 和 RotWord，奇数轮密钥只用 SubWord
+#define GCM_EXPAND_256(rk, i, rcon)                                                   \
+    do {                                                                              \
+        __m128i t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[(i) - 1], rcon), 0xff); \
+        __m128i k = rk[(i) - 2];                                                      \
+        k = _mm_xor_si128(k, _mm_slli_si128(k, 4));                                   \
+        k = _mm_xor_si128(k, _mm_slli_si128(k, 8));                                   \
+        rk[i] = _mm_xor_si128(k, t);                                                  \
+        if ((i) + 1 <= 14) {                                                          \
+            t = _mm_shuffle_epi32(_mm_aeskeygenassist_si128(rk[i], 0), 0xaa);         \
+            k = rk[(i) - 1];                                                          \
+            k = _mm_xor_si128(k, _mm_slli_si128(k, 4));                               \
+            k = _mm_xor_si128(k, _mm_slli_si128(k, 8));                               \
+            rk[(i) + 1] = _mm_xor_si128(k, t);                                        \
+        }                                                                             \
+    } while (0)
+
+// gcm_expand_key 函数：由 16 或 32 字节的密钥生成轮密钥
+GCM_TARGET
+void gcm_expand_key(struct gcm_state *s, const unsigned char *key, size_t key_len) {
+    __m128i *rk = s->round_keys;
+    rk[0] = _mm_loadu_si128((const __m128i *)key);
+    if (key_len == 16) {
+        s->rounds = 10;
+        GCM_EXPAND_128(rk, 1, 0x01);
+        GCM_EXPAND_128(rk, 2, 0x02);
+        GCM_EXPAND_128(rk, 3, 0x04);
+        GCM_EXPAND_128(rk, 4, 0x08);
+        GCM_EXPAND_128(rk, 5, 0x10);
+        GCM_EXPAND_128(rk, 6, 0x20);
+        GCM_EXPAND_128(rk, 7, 0x40);
+        GCM_EXPAND_128(rk, 8, 0x80);
+        GCM_EXPAND_128(rk, 9, 0x1b);
+        GCM_EXPAND_128(rk, 10, 0x36);
+        return;
+    }
+    s->rounds = 14;
+    rk[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+    GCM_EXPAND_256(rk, 2, 0x01);
+    GCM_EXPAND_256(rk, 4, 0x02);
+    GCM_EXPAND_256(rk, 6, 0x04);
+    GCM_EXPAND_256(rk, 8, 0x08);
+    GCM_EXPAND_256(rk, 10, 0x10);
+    GCM_EXPAND_256(rk, 12, 0x20);
+    GCM_EXPAND_256(rk, 14, 0x40);
+}
+
+// gcm_encrypt_block 函数：用 AES 加密一个块
+GCM_TARGET
+static inline __m128i gcm_encrypt_block(const struct gcm_state *s, __m128i x) {
+    x = _mm_xor_si128(x, s->round_keys[0]);
+    for (int r = 1; r < s->rounds; r++) {
+        x = _mm_aesenc_si128(x, s->round_keys[r]);
+    }
+    return _mm_aesenclast_si128(x, s->round_keys[s->rounds]);
+}
+
+// gcm_bswap 函数：反转 16 字节的顺序，GHASH 在反转后的表示上用 PCLMULQDQ 计算
+GCM_TARGET
+static inline __m128i gcm_bswap(__m128i x) {
+    return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+// gf_mul_wide 函数：GF(2^128) 上的无约简乘法，256 位结果累加 (异或) 到 *lo、*hi
+// 约简是线性的，几个乘积可以先累加再约简一次
+GCM_TARGET
+static inline void gf_mul_wide(__m128i a, __m128i b, __m128i *lo, __m128i *hi) {
+    __m128i l = _mm_clmulepi64_si128(a, b, 0x00);
+    __m128i h = _mm_clmulepi64_si128(a, b, 0x11);
+    __m128i m = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+    *lo = _mm_xor_si128(*lo, _mm_xor_si128(l, _mm_slli_si128(m, 8)));
+    *hi = _mm_xor_si128(*hi, _mm_xor_si128(h, _mm_srli_si128(m, 8)));
+}
+
+// gf_reduce 函数：把 256 位乘积模 x^128 + x^7 + x^2 + x + 1 约简 (位反转表示，先整体左移 1 位)
+GCM_TARGET
+static inline __m128i gf_reduce(__m128i lo, __m128i hi) {
+    __m128i c_lo = _mm_srli_epi32(lo, 31);
+    __m128i c_hi = _mm_srli_epi32(hi, 31);
+    lo = _mm_slli_epi32(lo, 1);
+    hi = _mm_slli_epi32(hi, 1);
+    hi = _mm_or_si128(hi, _mm_srli_si128(c_lo, 12));
+    hi = _mm_or_si128(hi, _mm_slli_si128(c_hi, 4));
+    lo = _mm_or_si128(lo, _mm_slli_si128(c_lo, 4));
+
+    __m128i t = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)),
+                              _mm_slli_epi32(lo, 25));
+    lo = _mm_xor_si128(lo, _mm_slli_si128(t, 12));
+    __m128i u = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)),
+                              _mm_srli_epi32(lo, 7));
+    u = _mm_xor_si128(u, _mm_srli_si128(t, 4));
+    return _mm_xor_si128(hi, _mm_xor_si128(lo, u));
+}
+
+// gcm_ghash 函数：把 nblocks 个完整的 16 字节块吸收进 GHASH 状态 y
+GCM_TARGET
+static __m128i gcm_ghash(const struct gcm_state *s, __m128i y, const unsigned char *data, size_t nblocks) {
+    size_t i = 0;
+    for (; i + 8 <= nblocks; i += 8) {
+        // y' = (y + X1)·H^8 + X2·H^7 + ... + X8·H
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+#pragma GCC unroll 8
+        for (int k = 0; k < 8; k++) {
+            __m128i x = gcm_bswap(_mm_loadu_si128((const __m128i *)(data + (i + (size_t)k) * 16)));
+            if (k == 0) {
+                x = _mm_xor_si128(x, y);
+            }
+            gf_mul_wide(x, s->h_powers[7 - k], &lo, &hi);
+        }
+        y = gf_reduce(lo, hi);
+    }
+    for (; i < nblocks; i++) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        __m128i x = gcm_bswap(_mm_loadu_si128((const __m128i *)(data + i * 16)));
+        gf_mul_wide(_mm_xor_si128(x, y), s->h_powers[0], &lo, &hi);
+        y = gf_reduce(lo, hi);
+    }
+    return y;
+}
+
+// gcm_ghash_tail 函数：吸收末尾不足 16 字节的部分 (补零)
+GCM_TARGET
+static __m128i gcm_ghash_tail(const struct gcm_state *s, __m128i y, const unsigned char *data, size_t len) {
+    unsigned char block[16] = { 0 };
+    memcpy(block, data, len);
+    return gcm_ghash(s, y, block, 1);
+}
+
+// gcm_crypt 函数：用计数器模式加密或解密一帧，同时对密文计算 GHASH，返回认证标签
+// 每 8 块的 AES 和 GHASH 在同一次循环中完成，aesenc 与 pclmulqdq 占用不同的执行端口，数据只经过一遍
+// 参数: j0 - 初始计数器块，数据从它的计数器加 1 开始; flag - 附加数据 (结束标记);
+//       decrypt - 为 1 时 in 是密文，否则 out 是密文
+GCM_TARGET
+static __m128i gcm_crypt(const struct gcm_state *s, __m128i j0, unsigned char flag, const unsigned char *in,
+                         size_t len, unsigned char *out, int decrypt) {
+    // 轮密钥复制到局部变量: 输出经 unsigned char 指针写入，否则编译器每次存储后都要重新加载
+    __m128i rk[GCM_MAX_ROUNDS + 1];
+    __m128i hp[8];
+    int rounds = s->rounds;
+    memcpy(rk, s->round_keys, sizeof(rk));
+    memcpy(hp, s->h_powers, sizeof(hp));
+    __m128i y = gcm_ghash_tail(s, _mm_setzero_si128(), &flag, 1);
+    uint32_t ctr = 2;
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128) {
+        // 8 个块交错执行各轮，隐藏 aesenc 的延迟
+        __m128i b[8];
+#pragma GCC unroll 8
+        for (int k = 0; k < 8; k++) {
+            b[k] = _mm_xor_si128(_mm_insert_epi32(j0, (int)__builtin_bswap32(ctr + (uint32_t)k), 3), rk[0]);
+        }
+        ctr += 8;
+        for (int r = 1; r < rounds; r++) {
+#pragma GCC unroll 8
+            for (int k = 0; k < 8; k++) {
+                b[k] = _mm_aesenc_si128(b[k], rk[r]);
+            }
+        }
+        // y' = (y + C1)·H^8 + C2·H^7 + ... + C8·H，最后只约简一次
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+#pragma GCC unroll 8
+        for (int k = 0; k < 8; k++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(in + i + (size_t)k * 16));
+            __m128i o = _mm_xor_si128(x, _mm_aesenclast_si128(b[k], rk[rounds]));
+            _mm_storeu_si128((__m128i *)(out + i + (size_t)k * 16), o);
+            __m128i c = gcm_bswap(decrypt ? x : o);
+            gf_mul_wide(k == 0 ? _mm_xor_si128(c, y) : c, hp[7 - k], &lo, &hi);
+        }
+        y = gf_reduce(lo, hi);
+    }
+    const unsigned char *cipher = decrypt ? in : out;
+    size_t tail = i;
+    for (; i < len; i += 16) {
+        __m128i ks = gcm_encrypt_block(s, _mm_insert_epi32(j0, (int)__builtin_bswap32(ctr++), 3));
+        if (len - i >= 16) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+            _mm_storeu_si128((__m128i *)(out + i), _mm_xor_si128(x, ks));
+        } else {
+            unsigned char block[16];
+            _mm_storeu_si128((__m128i *)block, ks);
+            for (size_t k = 0; k < len - i; k++) {
+                out[i + k] = in[i + k] ^ block[k];
+            }
+        }
+    }
+    y = gcm_ghash(s, y, cipher + tail, (len - tail) / 16);
+    if (len % 16 != 0) {
+        y = gcm_ghash_tail(s, y, cipher + len / 16 * 16, len % 16);
+    }
+    // 长度块: 附加数据和密文的位数，各 64 位大端；字节反转后恰好是两个 64 位整数
+    __m128i lo = _mm_setzero_si128();
+    __m128i hi = _mm_setzero_si128();
+    gf_mul_wide(_mm_xor_si128(y, _mm_set_epi64x(8, (long long)len * 8)), hp[0], &lo, &hi);
+    y = gf_reduce(lo, hi);
+    return _mm_xor_si128(gcm_bswap(y), gcm_encrypt_block(s, j0));
+}
+
+// gcm_init_hash_key 函数：计算 GHASH 的密钥 H = AES(0) 及其 2..8 次幂
+GCM_TARGET
+void gcm_init_hash_key(struct gcm_state *s) {
+    s->h_powers[0] = gcm_bswap(gcm_encrypt_block(s, _mm_setzero_si128()));
+    for (int i = 1; i < 8; i++) {
+        __m128i lo = _mm_setzero_si128();
+        __m128i hi = _mm_setzero_si128();
+        gf_mul_wide(s->h_powers[i - 1], s->h_powers[0], &lo, &hi);
+        s->h_powers[i] = gf_reduce(lo, hi);
+    }
+}
+
+// gcm_derive_key 函数：用主密钥和本流的盐派生子密钥，换掉轮密钥并计算 GHASH 密钥
+GCM_TARGET
+void gcm_derive_key(struct gcm_state *s) {
+    size_t key_len = s->rounds == 10 ? 16 : 32;
+    unsigned char block[16];
+    unsigned char subkey[32];
+    memcpy(block, s->salt, GCM_SALT_SIZE);
+    for (size_t j = 0; j * 16 < key_len; j++) {
+        uint32_t be_j = __builtin_bswap32((uint32_t)j);
+        memcpy(block + GCM_SALT_SIZE, &be_j, 4);
+        __m128i k = gcm_encrypt_block(s, _mm_loadu_si128((const __m128i *)block));
+        _mm_storeu_si128((__m128i *)(subkey + j * 16), k);
+    }
+    gcm_expand_key(s, subkey, key_len);
+    explicit_bzero(subkey, sizeof(subkey));
+    gcm_init_hash_key(s);
+}
+
+// gcm_frame_j0 函数：第 index 帧的初始计数器块 = 8 个零字节 + 帧序号 + 1
+GCM_TARGET
+static __m128i gcm_frame_j0(uint64_t index) {
+    unsigned char j0[16] = { 0 };
+    uint32_t be_index = __builtin_bswap32((uint32_t)index);
+    uint32_t be_one = __builtin_bswap32(1);
+    memcpy(j0 + 8, &be_index, 4);
+    memcpy(j0 + 12, &be_one, 4);
+    return _mm_loadu_si128((const __m128i *)j0);
+}
+
+// gcm_seal_frame 函数：加密 len 字节明文并输出一帧
+// 返回值: 输出的字节数
+GCM_TARGET
+size_t gcm_seal_frame(struct gcm_state *s, const unsigned char *in, size_t len, int final, unsigned char *out) {
+    __m128i j0 = gcm_frame_j0(s->frame_index++);
+    uint32_t field = (uint32_t)len | (final ? GCM_FINAL_FLAG : 0);
+    memcpy(out, &field, 4);
+    __m128i tag = gcm_crypt(s, j0, (unsigned char)(final != 0), in, len, out + 4, 0);
+    _mm_storeu_si128((__m128i *)(out + 4 + len), tag);
+    return 4 + len + GCM_TAG_SIZE;
+}
+
+// gcm_open_frame 函数：解密一帧到 out 并校验标签
+// 返回值: 明文长度；认证失败返回 -1，此时 out 中的内容不得输出
+GCM_TARGET
+ssize_t gcm_open_frame(struct gcm_state *s, const unsigned char *frame, unsigned char *out) {
+    uint32_t field;
+    memcpy(&field, frame, 4);
+    size_t len = field & ~GCM_FINAL_FLAG;
+    int final = (field & GCM_FINAL_FLAG) != 0;
+    __m128i j0 = gcm_frame_j0(s->frame_index);
+    __m128i expect = gcm_crypt(s, j0, (unsigned char)final, frame + 4, len, out, 1);
+    __m128i tag = _mm_loadu_si128((const __m128i *)(frame + 4 + len));
+    // 比较不提前退出，耗时与标签内容无关
+    __m128i diff = _mm_xor_si128(expect, tag);
+    if (!_mm_testz_si128(diff, diff)) {
+        return -1;
+    }
+    s->frame_index++;
+    s->final_seen = final;
+    return (ssize_t)len;
+}
+
+// gcm_error 函数：报告无法解密的输入并要求终止复制
+char *gcm_error(struct transform *t, const char *what, uint64_t offset, char *out, size_t op, size_t *out_len) {
+    fprintf(stderr, "解密失败: %s (密文偏移 %llu)\n", what, (unsigned long long)offset);
+    t->stop = 1;
+    *out_len = op;
+    return out;
+}
+
+// gcm_frame_overflow 函数：帧序号只有 32 位，用完之前必须停止 (对应 256TB 的明文)
+int gcm_frame_overflow(struct transform *t) {
+    struct gcm_state *s = t->state;
+    if (s->frame_index <= UINT32_MAX) {
+        return 0;
+    }
+    fprintf(stderr, "加密失败: 单个流的帧数超出上限\n");
+    t->stop = 1;
+    return 1;
+}
+
+// gcm_encrypt_apply 函数：加密阶段的处理函数
+char *gcm_encrypt_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    struct gcm_state *s = t->state;
+    unsigned char *o = (unsigned char *)out;
+    const unsigned char *p = (const unsigned char *)in;
+    size_t ip = 0;
+    size_t op = 0;
+
+    if (!s->header_done) {
+        memcpy(o, GCM_MAGIC, 7);
+        o[7] = GCM_VERSION;
+        memcpy(o + 8, s->salt, GCM_SALT_SIZE);
+        op = GCM_HEADER_SIZE;
+        s->header_done = 1;
+    }
+    while (ip < len && !gcm_frame_overflow(t)) {
+        // 没有残留时整帧直接从输入加密；读取长度按帧对齐，残留只出现在短读或输入结尾
+        if (s->pending_len == 0 && len - ip >= GCM_CHUNK) {
+            op += gcm_seal_frame(s, p + ip, GCM_CHUNK, 0, o + op);
+            ip += GCM_CHUNK;
+            continue;
+        }
+        size_t take = GCM_CHUNK - s->pending_len < len - ip ? GCM_CHUNK - s->pending_len : len - ip;
+        memcpy(s->pending + s->pending_len, p + ip, take);
+        s->pending_len += take;
+        ip += take;
+        if (s->pending_len == GCM_CHUNK) {
+            op += gcm_seal_frame(s, s->pending, GCM_CHUNK, 0, o + op);
+            s->pending_len = 0;
+        }
+    }
+    if (final && !t->stop && !gcm_frame_overflow(t)) {
+        // 最后一帧带结束标记，可以为空
+        op += gcm_seal_frame(s, s->pending, s->pending_len, 1, o + op);
+        s->pending_len = 0;
+    }
+    *out_len = op;
+    return out;
+}
+
+// gcm_encrypt_bound 函数：加密输出上界 (残留的明文、文件头和每帧的开销)
+size_t gcm_encrypt_bound(size_t len) {
+    return len + GCM_CHUNK + (len / GCM_CHUNK + 2) * GCM_FRAME_OVERHEAD + GCM_HEADER_SIZE;
+}
+
+// gcm_decrypt_apply 函数：解密阶段的处理函数，每帧校验通过后才输出明文
+char *gcm_decrypt_apply(struct transform *t, char *in, size_t len, char *out, size_t *out_len, int final) {
+    struct gcm_state *s = t->state;
+    unsigned char *o = (unsigned char *)out;
+    const unsigned char *p = (const unsigned char *)in;
+    size_t ip = 0;
+    size_t op = 0;
+
+    while (ip < len) {
+        if (!s->header_done) {
+            size_t take = GCM_HEADER_SIZE - s->pending_len < len - ip ? GCM_HEADER_SIZE - s->pending_len : len - ip;
+            memcpy(s->pending + s->pending_len, p + ip, take);
+            s->pending_len += take;
+            ip += take;
+            if (s->pending_len < GCM_HEADER_SIZE) {
+                continue;
+            }
+            if (memcmp(s->pending, GCM_MAGIC, 7) != 0 || s->pending[7] != GCM_VERSION) {
+                return gcm_error(t, "不是 mycat 加密格式或版本不支持", s->offset, out, op, out_len);
+            }
+            memcpy(s->salt, s->pending + 8, GCM_SALT_SIZE);
+            gcm_derive_key(s);
+            s->pending_len = 0;
+            s->header_done = 1;
+            continue;
+        }
+        if (s->final_seen) {
+            return gcm_error(t, "最后一帧之后还有多余的数据", s->offset + ip, out, op, out_len);
+        }
+        if (s->frame_index > UINT32_MAX) {
+            return gcm_error(t, "帧数超出上限", s->offset + ip, out, op, out_len);
+        }
+        // 整帧都在输入中时直接解密
+        if (s->pending_len == 0 && len - ip >= 4) {
+            uint32_t field;
+            memcpy(&field, p + ip, 4);
+            size_t plen = field & ~GCM_FINAL_FLAG;
+            if (plen > GCM_CHUNK) {
+                return gcm_error(t, "帧长度无效", s->offset + ip, out, op, out_len);
+            }
+            if (len - ip >= plen + GCM_FRAME_OVERHEAD) {
+                ssize_t n = gcm_open_frame(s, p + ip, o + op);
+                if (n == -1) {
+                    return gcm_error(t, "认证失败，密文被篡改或密钥错误", s->offset + ip, out, op, out_len);
+                }
+                ip += plen + GCM_FRAME_OVERHEAD;
+                op += (size_t)n;
+                continue;
+            }
+        }
+        // 帧跨越了缓冲区边界: 先凑齐长度字段，再凑齐整帧
+        size_t want = 4;
+        if (s->pending_len >= 4) {
+            uint32_t field;
+            memcpy(&field, s->pending, 4);
+            want = (field & ~GCM_FINAL_FLAG) + GCM_FRAME_OVERHEAD;
+        }
+        size_t take = want - s->pending_len < len - ip ? want - s->pending_len : len - ip;
+        memcpy(s->pending + s->pending_len, p + ip, take);
+        s->pending_len += take;
+        ip += take;
+        if (s->pending_len == 4) {
+            uint32_t field;
+            memcpy(&field, s->pending, 4);
+            if ((field & ~GCM_FINAL_FLAG) > GCM_CHUNK) {
+                return gcm_error(t, "帧长度无效", s->offset + ip - 4, out, op, out_len);
+            }
+        } else if (s->pending_len == want) {
+            ssize_t n = gcm_open_frame(s, s->pending, o + op);
+            if (n == -1) {
+                return gcm_error(t, "认证失败，密文被篡改或密钥错误", s->offset + ip - want, out, op, out_len);
+            }
+            op += (size_t)n;
+            s->pending_len = 0;
+        }
+    }
+    s->offset += len;
+
+    if (final && !s->final_seen) {
+        return gcm_error(t, "密文被截断", s->offset, out, op, out_len);
+    }
+    *out_len = op;
+    return out;
+}
+
+// gcm_decrypt_bound 函数：解密输出上界 (输入加上一帧跨越边界时残留的部分)
+size_t gcm_decrypt_bound(size_t len) {
+    return len + GCM_CHUNK;
+}
+
+// read_key_file 函数：读取密钥文件，接受原始的 16/32 字节或对应的十六进制文本
+// 返回值: 密钥长度 (16 或 32)，格式不对返回 0
+size_t read_key_file(const char *path, unsigned char *key) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        perror("打开密钥文件失败");
+        exit(EXIT_FAILURE);
+    }
+    unsigned char raw[130];
+    ssize_t n = pread_full(fd, (char *)raw, sizeof(raw), 0);
+    close(fd);
+    if (n == -1) {
+        perror("读取密钥文件失败");
+        exit(EXIT_FAILURE);
+    }
+    size_t len = 0;
+    if (n == 16 || n == 32) {
+        memcpy(key, raw, (size_t)n);
+        len = (size_t)n;
+    } else {
+        // 十六进制文本，允许结尾有换行
+        while (n > 0 && (raw[n - 1] == '\n' || raw[n - 1] == '\r' || raw[n - 1] == ' ')) {
+            n--;
+        }
+        if (n == 32 || n == 64) {
+            len = (size_t)n / 2;
+            for (size_t i = 0; i < (size_t)n && len != 0; i++) {
+                int c = raw[i];
+                int v = c >= '0' && c <= '9' ? c - '0'
+                        : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                        : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+                if (v < 0) {
+                    len = 0;
+                    break;
+                }
+                key[i / 2] = (unsigned char)(i % 2 == 0 ? v << 4 : key[i / 2] | v);
+            }
+        }
+    }
+    explicit_bzero(raw, sizeof(raw));
+    return len;
+}
+
+// add_gcm_stage 函数：启用 AES-GCM 加密或解密阶段
+// 参数: key_path - 密钥文件路径
+void add_gcm_stage(const char *key_path, int decrypt) {
+    if (!__builtin_cpu_supports("aes") || !__builtin_cpu_supports("pclmul")
+        || !__builtin_cpu_supports("sse4.1")) {
+        fprintf(stderr, "CPU 不支持 AES-NI/PCLMULQDQ，无法使用 --encrypt/--decrypt\n");
+        exit(EXIT_FAILURE);
+    }
+    unsigned char key[32];
+    size_t key_len = read_key_file(key_path, key);
+    if (key_len == 0) {
+        fprintf(stderr, "密钥文件 %s 无效: 需要 16/32 字节的原始密钥或 32/64 个十六进制字符\n", key_path);
+        exit(EXIT_FAILURE);
+    }
+    // 每个阶段有自己的密钥和帧状态，加密和解密可以出现在同一条变换链中
+    struct gcm_state *state = calloc(1, sizeof(*state));
+    if (state == NULL) {
+        perror("分配加密阶段状态失败");
+        exit(EXIT_FAILURE);
+    }
+    state->decrypt = decrypt;
+    gcm_expand_key(state, key, key_len);
+    explicit_bzero(key, sizeof(key));
+    // 解密时 pending 要能容纳一整帧
+    state->pending = malloc(GCM_CHUNK + GCM_FRAME_OVERHEAD);
+    if (state->pending == NULL) {
+        perror("分配加密阶段缓冲区失败");
+        exit(EXIT_FAILURE);
+    }
+    // 加密时现在就生成盐并派生子密钥；解密时要等读到文件头中的盐
+    if (!decrypt) {
+        if (getrandom(state->salt, sizeof(state->salt), 0) != (ssize_t)sizeof(state->salt)) {
+            perror("生成随机盐失败");
+            exit(EXIT_FAILURE);
+        }
+        gcm_derive_key(state);
+    }
+    struct transform t = {
+        .name = decrypt ? "decrypt" : "encrypt",
+        .out_bound = decrypt ? gcm_decrypt_bound : gcm_encrypt_bound,
+        .apply = decrypt ? gcm_decrypt_apply : gcm_encrypt_apply,
+        .state = state,
+        // 加密时每次读取的长度按帧对齐，整块读取不会留下需要拷贝的残留
+        .in_align = decrypt ? 0 : GCM_CHUNK,
+    };
+    add_transform(&t);
+}
+#else
+// add_gcm_stage 函数：没有 AES-NI 的平台上不提供加密阶段
+void add_gcm_stage(const char *key_path, int decrypt) {
+    (void)key_path;
+    (void)decrypt;
+    fprintf(stderr, "--encrypt/--decrypt 需要 x86-64 的 AES-NI/PCLMULQDQ 指令\n");
+    exit(EXIT_FAILURE);
+}
+#endif
+
+// ---------------------------------------------------------------------------
+// 文件到文件复制引擎 (--engine)
+// ---------------------------------------------------------------------------
+
+enum copy_engine {
+    ENGINE_RW,    // read/write 循环 (默认，即任务 6 的实现)
+    ENGINE_MMAP,  // 两端都 mmap，非临时存储多线程复制
+    ENGINE_AUTO,  // 输出是普通文件时先试 copy_file_range，不可用再用 mmap
+};
+
+// mmap 引擎每次领取的块大小；每复制完一块就对这块发起回写
+#define MMAP_COPY_CHUNK (16 * 1024 * 1024)
+// 每个线程每复制这么多块就 msync 一次，等待这批块写回并取得写回错误，
+// 同时把每个线程的脏页限制在 MMAP_SYNC_BATCH * MMAP_COPY_CHUNK 以内
+#define MMAP_SYNC_BATCH 4
+
+// copy_file_range_all 函数：用 copy_file_range 在内核中完成整个复制
+// 返回值: 成功返回 1；内核或文件系统不支持 (跨文件系统、旧内核等) 返回 0；出错返回 -1
+int copy_file_range_all(int fd_in, off_t size) {
+    off_t done = 0;
+    // 后台模式下分块复制，每块完成后丢弃两端的页缓存
+    off_t in_start = g_opts.background ? lseek(fd_in, 0, SEEK_CUR) : 0;
+    off_t out_start = g_opts.background ? lseek(STDOUT_FILENO, 0, SEEK_CUR) : 0;
+    while (done < size) {
+        size_t want = (size_t)(size - done);
+        if (g_opts.background && want > MMAP_COPY_CHUNK) {
+            want = MMAP_COPY_CHUNK;
+        }
+        uint64_t t0 = latency_start();
+        ssize_t n = copy_file_range(fd_in, NULL, STDOUT_FILENO, NULL, want, 0);
+        latency_record(LAT_WRITE, t0);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // EBADF: 输出以 O_APPEND 打开时 copy_file_range 不可用
+            if (done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP
+                              || errno == EINVAL || errno == EBADF)) {
+                return 0;
+            }
+            stat_add(&g_stats.errors, 1);
+            perror("copy_file_range 失败");
+            return -1;
+        }
+        if (n == 0) {
+            break; // 文件被截短
+        }
+        stat_add(&g_stats.read_calls, 1);
+        stat_add(&g_stats.bytes_read, (uint64_t)n);
+        stat_add(&g_stats.write_calls, 1);
+        stat_written((uint64_t)n);
+        drop_cache_range(fd_in, in_start + done, n, 0);
+        drop_cache_range(STDOUT_FILENO, out_start + done, n, 1);
+        done += n;
+    }
+    return 1;
+}
+
+// stream_copy_scalar 函数：没有向量指令时退回 memcpy
+void stream_copy_scalar(char *dst, const char *src, size_t len) {
+    memcpy(dst, src, len);
+}
+
+#if defined(__x86_64__)
+// stream_copy_sse2 函数：使用 16 字节非临时存储复制，目标数据不进入缓存
+__attribute__((target("sse2")))
+void stream_copy_sse2(char *dst, const char *src, size_t len) {
+    size_t head = (16 - ((uintptr_t)dst & 15)) & 15;
+    if (head > len) {
+        head = len;
+    }
+    memcpy(dst, src, head);
+    size_t i = head;
+    for (; i + 64 <= len; i += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + i + 48));
+        _mm_stream_si128((__m128i *)(dst + i), a);
+        _mm_stream_si128((__m128i *)(dst + i + 16), b);
+        _mm_stream_si128((__m128i *)(dst + i + 32), c);
+        _mm_stream_si128((__m128i *)(dst + i + 48), d);
+    }
+    memcpy(dst + i, src + i, len - i);
+    _mm_sfence();
+}
+
+// stream_copy_avx 函数：使用 32 字节非临时存储复制，目标数据不进入缓存
+__attribute__((target("avx")))
+void stream_copy_avx(char *dst, const char *src, size_t len) {
+    size_t head = (32 - ((uintptr_t)dst & 31)) & 31;
+    if (head > len) {
+        head = len;
+    }
+    memcpy(dst, src, head);
+    size_t i = head;
+    for (; i + 128 <= len; i += 128) {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + 32));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(src + i + 64));
+        __m256i d = _mm256_loadu_si256((const __m256i *)(src + i + 96));
+        _mm256_stream_si256((__m256i *)(dst + i), a);
+        _mm256_stream_si256((__m256i *)(dst + i + 32), b);
+        _mm256_stream_si256((__m256i *)(dst + i + 64), c);
+        _mm256_stream_si256((__m256i *)(dst + i + 96), d);
+    }
+    memcpy(dst + i, src + i, len - i);
+    _mm_sfence();
+}
+#endif
+
+// mmap 引擎的任务描述
+struct mmap_job {
+    const char *src;      // 源文件映射
+    int src_fd;
+    char *dst;            // 目标文件映射中对应源文件偏移 0 的位置
+    int dst_fd;
+    off_t dst_offset;     // 目标文件中对应源文件偏移 0 的位置
+    off_t size;
+    size_t page_size;
+    size_t next_chunk;
+    size_t nchunks;
+    int error;            // 第一个错误的 errno，0 表示没有错误
+    int fault;            // 访问映射时收到了 SIGBUS
+    void (*copy)(char *dst, const char *src, size_t len);
+};
+
+// 正在访问映射的 mmap 引擎线程的恢复点。源文件在复制期间被截短、或者目标的写回出错时，
+// 访问映射会收到 SIGBUS；处理函数跳回这个线程的恢复点，而不是让整个进程被杀死
+static __thread sigjmp_buf *t_mmap_fault;
+
+// mmap_fault_handler 函数：SIGBUS 处理函数，不是 mmap 引擎线程引起的则按默认行为终止进程
+void mmap_fault_handler(int sig) {
+    if (t_mmap_fault != NULL) {
+        siglongjmp(*t_mmap_fault, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+// mmap_job_fail 函数：记录 mmap 复制的第一个错误，其他线程看到后不再领取新块
+void mmap_job_fail(struct mmap_job *job, int err) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&job->error, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// mmap_sync_chunks 函数：msync(MS_SYNC) 等待一批已经发起回写的块写回完成；
+// 后台模式下随后丢弃这些块在两端的页缓存
+// 返回值: 成功返回 0，写回出错返回 -1 并设置 errno
+int mmap_sync_chunks(struct mmap_job *job, const size_t *chunks, int n) {
+    for (int i = 0; i < n; i++) {
+        off_t off = (off_t)chunks[i] * MMAP_COPY_CHUNK;
+        size_t len = job->size - off < MMAP_COPY_CHUNK ? (size_t)(job->size - off) : MMAP_COPY_CHUNK;
+        // msync 要求页对齐的地址；映射本身从页边界开始，向前取整不会越出映射
+        char *start = job->dst + off;
+        size_t head = (uintptr_t)start % job->page_size;
+        if (msync(start - head, len + head, MS_SYNC) == -1) {
+            return -1;
+        }
+        if (g_opts.background) {
+            // 仍被映射的页不会被 fadvise 丢弃，先解除这块在两个映射中的页表项；
+            // 目标这块刚刚写回，MADV_DONTNEED 不会丢失数据
+            madvise(start - head, len + head, MADV_DONTNEED);
+            madvise((void *)(job->src + off), len, MADV_DONTNEED);
+            drop_cache_range(job->src_fd, off, (off_t)len, 0);
+            drop_cache_range(job->dst_fd, job->dst_offset + off, (off_t)len, 0);
+        }
+    }
+    return 0;
+}
+
+// mmap_copy_chunks 函数：领取块并用非临时存储复制，复制完一块就发起这块的回写，
+// 每 MMAP_SYNC_BATCH 块 msync 一次
+void mmap_copy_chunks(struct mmap_job *job) {
+    size_t batch[MMAP_SYNC_BATCH];
+    int nbatch = 0;
+    size_t idx;
+    while (__atomic_load_n(&job->error, __ATOMIC_RELAXED) == 0
+           && (idx = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+        off_t off = (off_t)idx * MMAP_COPY_CHUNK;
+        size_t len = job->size - off < MMAP_COPY_CHUNK ? (size_t)(job->size - off) : MMAP_COPY_CHUNK;
+        job->copy(job->dst + off, job->src + off, len);
+        sync_file_range(job->dst_fd, job->dst_offset + off, (off_t)len, SYNC_FILE_RANGE_WRITE);
+        stat_add(&g_stats.bytes_read, len);
+        stat_written(len);
+        batch[nbatch++] = idx;
+        if (nbatch == MMAP_SYNC_BATCH) {
+            if (mmap_sync_chunks(job, batch, nbatch) == -1) {
+                mmap_job_fail(job, errno);
+            }
+            nbatch = 0;
+        }
+    }
+    if (nbatch > 0 && mmap_sync_chunks(job, batch, nbatch) == -1) {
+        mmap_job_fail(job, errno);
+    }
+}
+
+// mmap_copy_worker 函数：设置 SIGBUS 恢复点后执行复制；收到 SIGBUS 时记录错误并结束这个线程
+void *mmap_copy_worker(void *arg) {
+    struct mmap_job *job = arg;
+    sigjmp_buf fault;
+    if (sigsetjmp(fault, 1) != 0) {
+        t_mmap_fault = NULL;
+        __atomic_store_n(&job->fault, 1, __ATOMIC_RELAXED);
+        mmap_job_fail(job, EIO);
+        return NULL;
+    }
+    t_mmap_fault = &fault;
+    mmap_copy_chunks(job);
+    t_mmap_fault = NULL;
+    return NULL;
+}
+
+// mmap_copy 函数：用 posix_fallocate 为目标分配空间后把两端都映射进来，多线程复制
+// 源映射使用 MADV_SEQUENTIAL；目标使用非临时存储，避免复制的数据污染缓存。
+// 预先分配空间保证磁盘已满或超出配额时在这里失败 (退回 read/write 循环，由 write 报告错误)，
+// 而不是在缺页时收到 SIGBUS。复制期间的 SIGBUS (源文件被截短等) 与写回错误都作为错误返回。
+// 返回值: 成功返回 1；无法分配空间或映射 (例如没有目标文件的读权限) 返回 0；出错返回 -1
+int mmap_copy(int fd_in, off_t size, int nthreads) {
+    // 标准输出通常是只写打开的，而共享的可写映射需要读写权限，因此重新打开一次
+    int dst_fd = open("/proc/self/fd/1", O_RDWR);
+    if (dst_fd == -1) {
+        return 0;
+    }
+    // 以 O_APPEND 打开 (>>) 时，数据写在文件末尾而不是当前偏移处
+    off_t dst_offset;
+    int flags = fcntl(STDOUT_FILENO, F_GETFL);
+    if (flags != -1 && (flags & O_APPEND)) {
+        dst_offset = lseek(STDOUT_FILENO, 0, SEEK_END);
+    } else {
+        dst_offset = lseek(STDOUT_FILENO, 0, SEEK_CUR);
+    }
+    if (dst_offset == -1) {
+        close(dst_fd);
+        return 0;
+    }
+    // 与 write 相同，只在目标不够长时扩展，已有的更长内容保持不变；
+    // posix_fallocate 在需要时同时扩展文件长度
+    struct stat dst_st;
+    if (fstat(dst_fd, &dst_st) == -1) {
+        close(dst_fd);
+        return 0;
+    }
+    off_t orig_size = dst_st.st_size;
+    int err = posix_fallocate(dst_fd, dst_offset, size);
+    if (err != 0) {
+        fprintf(stderr, "无法为目标文件预先分配空间 (%s)，不使用 mmap 引擎。\n", strerror(err));
+        if (orig_size < dst_offset + size && ftruncate(dst_fd, orig_size) == -1) {
+            perror("恢复目标文件长度失败");
+        }
+        close(dst_fd);
+        return 0;
+    }
+
+    size_t page_size = (size_t)get_system_page_size();
+    off_t map_start = dst_offset - dst_offset % (off_t)page_size;
+    size_t dst_map_len = (size_t)(dst_offset + size - map_start);
+    char *src = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd_in, 0);
+    char *dst = mmap(NULL, dst_map_len, PROT_READ | PROT_WRITE, MAP_SHARED, dst_fd, map_start);
+    if (src == MAP_FAILED || dst == MAP_FAILED) {
+        if (src != MAP_FAILED) {
+            munmap(src, (size_t)size);
+        }
+        if (dst != MAP_FAILED) {
+            munmap(dst, dst_map_len);
+        }
+        // 放弃 mmap 引擎前恢复目标文件原来的长度
+        if (orig_size < dst_offset + size && ftruncate(dst_fd, orig_size) == -1) {
+            perror("恢复目标文件长度失败");
+        }
+        close(dst_fd);
+        return 0;
+    }
+    madvise(src, (size_t)size, MADV_SEQUENTIAL);
+
+    struct mmap_job job = {
+        .src = src,
+        .src_fd = fd_in,
+        .dst = dst + (dst_offset - map_start),
+        .dst_fd = dst_fd,
+        .dst_offset = dst_offset,
+        .size = size,
+        .page_size = page_size,
+        .nchunks = (size_t)((size + MMAP_COPY_CHUNK - 1) / MMAP_COPY_CHUNK),
+        .copy = stream_copy_scalar,
+    };
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx")) {
+        job.copy = stream_copy_avx;
+    } else {
+        job.copy = stream_copy_sse2;
+    }
+#endif
+    if ((size_t)nthreads > job.nchunks) {
+        nthreads = (int)job.nchunks;
+    }
+    g_stats.threads = nthreads;
+
+    struct sigaction sa;
+    struct sigaction old_sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = mmap_fault_handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, &old_sa);
+    join_workers(start_workers(nthreads, mmap_copy_worker, &job), nthreads);
+
+    // 各线程已经 msync 过自己复制的块；最后再同步一次文件，取得元数据 (长度、分配) 的写回错误
+    int status = 1;
+    if (job.fault) {
+        fprintf(stderr, "mmap 复制失败: 访问映射时收到 SIGBUS (源文件在复制期间被截短，或目标写回出错)\n");
+        status = -1;
+    } else if (job.error != 0) {
+        errno = job.error;
+        perror("mmap 复制写回失败");
+        status = -1;
+    } else if (fdatasync(dst_fd) == -1) {
+        perror("同步目标文件失败");
+        status = -1;
+    }
+    if (status == -1) {
+        stat_add(&g_stats.errors, 1);
+    }
+    sigaction(SIGBUS, &old_sa, NULL);
+
+    munmap(src, (size_t)size);
+    munmap(dst, dst_map_len);
+    close(dst_fd);
+    // 与 write 的语义保持一致: 复制结束后标准输出的文件偏移位于写入数据之后
+    lseek(STDOUT_FILENO, dst_offset + size, SEEK_SET);
+    return status;
+}
+
+// try_file_copy 函数：输入和标准输出都是普通文件时，尝试绕过用户态缓冲区直接复制
+// 返回值: 已完成复制返回 1；不适用、应退回 read/write 循环返回 0；出错返回 -1
+int try_file_copy(int fd_in) {
+    struct stat st_in;
+    struct stat st_out;
+    if (fstat(fd_in, &st_in) == -1 || fstat(STDOUT_FILENO, &st_out) == -1
+        || !S_ISREG(st_in.st_mode) || !S_ISREG(st_out.st_mode) || st_in.st_size == 0) {
+        return 0;
+    }
+    if (st_in.st_dev == st_out.st_dev && st_in.st_ino == st_out.st_ino) {
+        return 0; // 输入就是输出，交给 read/write 循环按原来的行为处理
+    }
+
+    if (g_opts.engine == ENGINE_AUTO) {
+        int rc = copy_file_range_all(fd_in, st_in.st_size);
+        if (rc != 0) {
+            set_engine("copy_file_range");
+            return rc;
+        }
+    }
+    int nthreads = g_opts.threads > 0 ? g_opts.threads : default_thread_count();
+    int rc = mmap_copy(fd_in, st_in.st_size, nthreads);
+    if (rc != 0) {
+        set_engine("mmap");
+    } else {
+        fprintf(stderr, "无法映射输入或输出文件，退回 read/write 循环。\n");
+    }
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// 页缓存驻留探测
+// ---------------------------------------------------------------------------
+
+// 复制前先看输入有多少已经在页缓存里，两个极端用不同的读取方式：
+//   全部驻留: 不需要任何预读提示，没有变换时直接走 copy_file_range/mmap 引擎；
+//   几乎全冷: 大文件用 O_DIRECT 绕过页缓存，否则在顺序提示之外再发 WILLNEED；
+//   其余情况: 保持原来的 POSIX_FADV_SEQUENTIAL。
+
+#ifndef __NR_cachestat
+#define __NR_cachestat 451 // Linux 6.5 起提供，所有架构使用同一个编号
+#endif
+
+// 来自 linux/mman.h
+struct cachestat_range {
+    uint64_t off;
+    uint64_t len;
+};
+
+struct cachestat {
+    uint64_t nr_cache;
+    uint64_t nr_dirty;
+    uint64_t nr_writeback;
+    uint64_t nr_evicted;
+    uint64_t nr_recently_evicted;
+};
+
+#define RESIDENT_THRESHOLD 0.9         // 不低于这个比例视为全部驻留
+#define COLD_THRESHOLD 0.1             // 低于这个比例视为冷文件
+#define DIRECT_IO_MIN_SIZE (64 * 1024 * 1024) // 冷文件至少这么大才值得用 O_DIRECT
+#define MINCORE_WINDOW (256 * 1024 * 1024)    // mincore 每次检查的映射窗口
+
+// mincore_resident_pages 函数：映射文件并用 mincore 统计驻留的页数
+// 返回值: 驻留页数，失败返回 -1
+int64_t mincore_resident_pages(int fd, off_t size) {
+    size_t page_size = (size_t)get_system_page_size();
+    unsigned char *vec = malloc(MINCORE_WINDOW / page_size);
+    if (vec == NULL) {
+        return -1;
+    }
+    int64_t resident = 0;
+    for (off_t off = 0; off < size; off += MINCORE_WINDOW) {
+        size_t len = (size_t)(size - off) < MINCORE_WINDOW ? (size_t)(size - off) : MINCORE_WINDOW;
+        void *map = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, off);
+        if (map == MAP_FAILED) {
+            free(vec);
+            return -1;
+        }
+        int rc = mincore(map, len, vec);
+        munmap(map, len);
+        if (rc == -1) {
+            free(vec);
+            return -1;
+        }
+        size_t pages = (len + page_size - 1) / page_size;
+        for (size_t i = 0; i < pages; i++) {
+            resident += vec[i] & 1;
+        }
+    }
+    free(vec);
+    return resident;
+}
+
+// probe_residency 函数：返回输入在页缓存中的比例，优先使用 cachestat，不支持时退回 mincore
+// 参数: method - 输出实际使用的方法名
+// 返回值: 0 到 1 之间的比例，无法探测时返回 -1
+double probe_residency(int fd, off_t size, const char **method) {
+    size_t page_size = (size_t)get_system_page_size();
+    uint64_t total_pages = ((uint64_t)size + page_size - 1) / page_size;
+    struct cachestat_range range = { 0, (uint64_t)size };
+    struct cachestat cs;
+    if (syscall(__NR_cachestat, fd, &range, &cs, 0) == 0) {
+        *method = "cachestat";
+        return cs.nr_cache >= total_pages ? 1.0 : (double)cs.nr_cache / (double)total_pages;
+    }
+    int64_t resident = mincore_resident_pages(fd, size);
+    if (resident >= 0) {
+        *method = "mincore";
+        return (double)resident / (double)total_pages;
+    }
+    return -1;
+}
+
+// apply_cache_policy 函数：探测输入的驻留比例，据此发出预读提示、设置 O_DIRECT 或选择复制引擎
+// 参数: size - 普通文件的大小，不是普通文件 (管道等) 时为 0，此时只发顺序读取提示
+void apply_cache_policy(int fd, off_t size) {
+    // 默认的整块读写循环: 没有变换、没有选择其他复制引擎、也不按 --flush-interval 攒批。
+    // 只有它保证每次读取的偏移、长度和缓冲区地址都按块对齐，可以安全地打开 O_DIRECT；
+    // --flush-interval 会读到 buffer + filled 这样不对齐的位置
+    int plain_loop = g_ntransforms == 0 && g_opts.engine == ENGINE_RW && g_opts.flush_interval == 0;
+    double residency = size > 0 ? probe_residency(fd, size, &g_stats.residency_method) : -1;
+    g_stats.residency = residency;
+    if (residency >= 0) {
+        fprintf(stderr, "输入在页缓存中的比例: %.1f%% (%s)\n", residency * 100, g_stats.residency_method);
+    }
+
+    if (residency >= RESIDENT_THRESHOLD) {
+        // 数据已经在内存里，预读提示没有意义；没有变换时交给 copy_file_range/mmap
+        g_stats.cache_policy = "全部驻留，不发预读提示";
+        if (!g_opts.engine_explicit && plain_loop) {
+            g_opts.engine = ENGINE_AUTO;
+            g_stats.cache_policy = "全部驻留，不发预读提示，自动选择复制引擎";
+        }
+        return;
+    }
+
+    // 使用 posix_fadvise 提示文件系统进行顺序读取优化
+    // fd: 文件描述符
+    // offset: 0，从文件开头开始
+    // len: 0，表示从 offset 到文件结尾
+    // advice: POSIX_FADV_SEQUENTIAL，表示文件将以顺序方式读取
+    if (residency >= 0 && residency < COLD_THRESHOLD) {
+        if (size >= DIRECT_IO_MIN_SIZE && plain_loop
+            && fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_DIRECT) == 0) {
+            g_stats.cache_policy = "冷文件，O_DIRECT";
+            fprintf(stderr, "输入几乎不在页缓存中，使用 O_DIRECT 读取。\n");
+            return;
+        }
+        g_stats.cache_policy = "冷文件，SEQUENTIAL + WILLNEED";
+        if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == -1) {
+            perror("警告: posix_fadvise (POSIX_FADV_WILLNEED) 失败");
+        }
+    } else {
+        g_stats.cache_policy = "SEQUENTIAL";
+    }
+    if (posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL) == -1) {
+        // posix_fadvise 失败通常不是致命错误，打印警告即可。
+        // 例如，某些文件系统或内核版本可能不支持此功能。
+        perror("警告: posix_fadvise (POSIX_FADV_SEQUENTIAL) 失败");
+    } else {
+        fprintf(stderr, "已使用 posix_fadvise(POSIX_FADV_SEQUENTIAL) 提示文件系统。\n");
+    }
+}
+
+// ---------------------------------------------------------------------------
+// 页缓存管理 (--warm / --evict / --lock)
+// ---------------------------------------------------------------------------
+
+// 类似 vmtouch 的子命令，用来为基准测试准备确定的缓存状态或预热热点数据。
+// 预热沿用复制时的块大小和线程数，多个线程并行对各块发 readahead。
+
+enum cache_command {
+    CACHE_CMD_NONE,
+    CACHE_CMD_WARM,  // 并行 readahead 把文件读入页缓存
+    CACHE_CMD_EVICT, // POSIX_FADV_DONTNEED 把文件逐出页缓存
+    CACHE_CMD_LOCK,  // 映射文件并 mlock，直到进程被终止
+};
+
+// 一个文件的并行预热任务
+struct warm_job {
+    int fd;
+    off_t size;
+    size_t chunk;         // 每次 readahead 的长度
+    off_t next;           // 下一个待领取的偏移，原子递增
+    int failed;
+};
+
+// warm_worker 函数：不断领取下一块并 readahead，直到文件结尾
+void *warm_worker(void *arg) {
+    struct warm_job *job = arg;
+    for (;;) {
+        off_t off = __atomic_fetch_add(&job->next, (off_t)job->chunk, __ATOMIC_RELAXED);
+        if (off >= job->size) {
+            break;
+        }
+        if (readahead(job->fd, off, job->chunk) == -1) {
+            __atomic_store_n(&job->failed, errno, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// warm_file 函数：用 nthreads 个线程把整个文件读入页缓存
+// 返回值: 成功返回 0，失败返回 -1 (errno 已设置)
+int warm_file(int fd, off_t size, int nthreads) {
+    struct warm_job job = { fd, size, io_blocksize(), 0, 0 };
+    size_t nchunks = (size_t)((size + (off_t)job.chunk - 1) / (off_t)job.chunk);
+    if ((size_t)nthreads > nchunks) {
+        nthreads = nchunks > 0 ? (int)nchunks : 1;
+    }
+    pthread_t *tids = start_workers(nthreads, warm_worker, &job);
+    join_workers(tids, nthreads);
+    if (job.failed != 0) {
+        errno = job.failed;
+        return -1;
+    }
+    return 0;
+}
+
+// lock_file 函数：映射整个文件并用 mlock 锁定在内存中 (映射在进程退出前不释放)
+// 返回值: 成功返回 0，失败返回 -1 (errno 已设置)
+int lock_file(int fd, off_t size) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_MEMLOCK, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+        && locked_bytes() + (uint64_t)size > rl.rlim_cur) {
+        errno = ENOMEM;
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t)size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+    if (mlock(map, (size_t)size) == -1) {
+        int saved = errno;
+        munmap(map, (size_t)size);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+// run_cache_command 函数：对每个文件执行 --warm/--evict/--lock，并报告操作前后的驻留比例
+// 返回值: 进程退出状态
+int run_cache_command(int nfiles, char **files) {
+    static const char *verbs[] = { "", "预热", "逐出", "锁定" };
+    const char *verb = verbs[g_opts.cache_command];
+    int nthreads = g_opts.threads > 0 ? g_opts.threads : default_thread_count();
+    int status = EXIT_SUCCESS;
+    uint64_t total = 0;
+    for (int i = 0; i < nfiles; i++) {
+        int fd = open(files[i], O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            fprintf(stderr, "%s: 打开失败: %s\n", files[i], strerror(errno));
+            if (fd != -1) {
+                close(fd);
+            }
+            status = EXIT_FAILURE;
+            continue;
+        }
+        if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+            fprintf(stderr, "%s: 不是非空的普通文件，跳过\n", files[i]);
+            close(fd);
+            continue;
+        }
+
+        const char *method = NULL;
+        double before = probe_residency(fd, st.st_size, &method);
+        int rc;
+        if (g_opts.cache_command == CACHE_CMD_WARM) {
+            rc = warm_file(fd, st.st_size, nthreads);
+        } else if (g_opts.cache_command == CACHE_CMD_EVICT) {
+            // 脏页不会被 DONTNEED 丢弃，先写回
+            rc = fdatasync(fd) == -1 && errno != EINVAL ? -1 : 0;
+            if (rc == 0) {
+                rc = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                if (rc != 0) {
+                    errno = rc;
+                    rc = -1;
+                }
+            }
+        } else {
+            rc = lock_file(fd, st.st_size);
+        }
+        if (rc == -1) {
+            fprintf(stderr, "%s: %s失败: %s\n", files[i], verb, strerror(errno));
+            close(fd);
+            status = EXIT_FAILURE;
+            continue;
+        }
+        double after = probe_residency(fd, st.st_size, &method);
+        fprintf(stderr, "%s: %s %llu 字节，页缓存驻留 %.1f%% -> %.1f%%\n", files[i], verb,
+                (unsigned long long)st.st_size, before * 100, after * 100);
+        total += (uint64_t)st.st_size;
+        close(fd);
+    }
+
+    if (g_opts.cache_command == CACHE_CMD_LOCK && total > 0) {
+        // 锁定只在映射存在期间有效，保持运行直到被信号终止
+        fprintf(stderr, "已锁定 %llu 字节，进程保持运行；终止进程即可解除锁定。\n",
+                (unsigned long long)total);
+        for (;;) {
+            pause();
+        }
+    }
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// 块设备输入
+// ---------------------------------------------------------------------------
+
+// 块设备的 st_size 为 0、st_blksize 也不反映设备特性，需要用 ioctl 查询。
+// 没有变换时按 dd iflag=direct 的方式复制: O_DIRECT 按扇区对齐读取，
+// 多个线程各自发出 pread，同时在途的请求数即队列深度；主线程按块号顺序写出。
+
+#define BLOCKDEV_QUEUE_DEPTH 8 // 默认同时在途的读请求数 (I/O 密集，与 CPU 数无关)
+
+// 通过 ioctl 查询到的块设备参数
+struct blockdev_info {
+    uint64_t size;      // BLKGETSIZE64: 设备字节数
+    int sector_size;    // BLKSSZGET: 逻辑扇区大小，O_DIRECT 的对齐单位
+    unsigned int io_opt; // BLKIOOPT: 最佳 I/O 大小 (例如 RAID 条带宽度)，0 表示设备没有报告
+};
+
+// blockdev_probe 函数：查询块设备的大小、逻辑扇区大小和最佳 I/O 大小
+// 返回值: 成功返回 0，失败返回 -1
+int blockdev_probe(int fd, struct blockdev_info *info) {
+    memset(info, 0, sizeof(*info));
+    if (ioctl(fd, BLKGETSIZE64, &info->size) == -1) {
+        return -1;
+    }
+    if (ioctl(fd, BLKSSZGET, &info->sector_size) == -1 || info->sector_size <= 0) {
+        info->sector_size = 512;
+    }
+    if (ioctl(fd, BLKIOOPT, &info->io_opt) == -1) {
+        info->io_opt = 0;
+    }
+    return 0;
+}
+
+// blockdev_chunk_size 函数：每次读取的大小，取最佳缓冲区大小并向上取整到最佳 I/O 大小和扇区的整数倍
+size_t blockdev_chunk_size(const struct blockdev_info *info) {
+    size_t unit = info->io_opt > (unsigned int)info->sector_size ? info->io_opt : (size_t)info->sector_size;
+    size_t chunk = io_blocksize();
+    return (chunk + unit - 1) / unit * unit;
+}
+
+// direct_read_worker 函数：领取块号，把块直接读入有序写出环的槽位，不做任何处理
+void *direct_read_worker(void *arg) {
+    struct number_job *job = arg;
+    size_t idx;
+    while ((idx = claim_chunk(job)) < job->nchunks) {
+        struct number_slot *slot = &job->slots[idx % job->nslots];
+
+        // 等待写出线程释放这个槽位 (即块 idx - nslots 已经写出)
+        pthread_mutex_lock(&job->lock);
+        while (idx >= job->written + job->nslots) {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+
+        size_t len = read_chunk(job, idx, slot->out);
+
+        pthread_mutex_lock(&job->lock);
+        slot->out_len = len;
+        slot->chunk = idx;
+        slot->last = 1;
+        slot->ready = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    return NULL;
+}
+
+// blockdev_copy 函数：以 depth 个在途请求读取整个块设备，按顺序写到标准输出
+// 参数: fd_in - 块设备 (尽量已设置 O_DIRECT); info - 设备参数; depth - 队列深度
+// 返回值: 成功返回 0
+int blockdev_copy(int fd_in, const struct blockdev_info *info, int depth) {
+    struct number_job job;
+    memset(&job, 0, sizeof(job));
+    job.fd = fd_in;
+    job.file_size = (off_t)info->size;
+    job.chunk_size = blockdev_chunk_size(info);
+    job.nchunks = (size_t)((job.file_size + (off_t)job.chunk_size - 1) / (off_t)job.chunk_size);
+    job.nslots = (size_t)depth * 2; // 写出一个槽位时其余槽位仍可保持 depth 个读请求在途
+    job.slots = calloc(job.nslots, sizeof(struct number_slot));
+    if (job.slots == NULL) {
+        perror("分配块设备读取状态失败");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < job.nslots; i++) {
+        // 页对齐的缓冲区同时满足 O_DIRECT 对内存地址的扇区对齐要求
+        job.slots[i].out = io_buffer_alloc(job.chunk_size);
+        if (job.slots[i].out == NULL) {
+            perror("分配块设备读缓冲区失败");
+            exit(EXIT_FAILURE);
+        }
+        job.slots[i].out_cap = job.chunk_size;
+    }
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    g_stats.buffer_size = job.chunk_size;
+    pthread_t *tids = start_workers(depth, direct_read_worker, &job);
+    ordered_writer(&job);
+    join_workers(tids, depth);
+
+    for (size_t i = 0; i < job.nslots; i++) {
+        io_buffer_free(job.slots[i].out, job.slots[i].out_cap);
+    }
+    free(job.slots);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// 伪文件系统 (/proc、/sys) 与多文件批量读取
+// ---------------------------------------------------------------------------
+
+// procfs、sysfs 等文件的内容由内核在读取时生成: st_size 为 0，没有页缓存，
+// fadvise 和 2MB 缓冲区都没有意义。这类文件直接读进栈上的小批量缓冲区，
+// 多个文件的内容攒满缓冲区才写出一次，每个文件只需要 open、fstatfs、read 和 close。
+// 遇到普通文件时批量缓冲区换成 io_blocksize() 大小的堆缓冲区，小文件同样
+// 首尾相接地读进去，因此输出到管道或套接字时许多小文件只需要一次 write。
+
+// 来自 linux/magic.h
+#define PROC_SUPER_MAGIC    0x9fa0
+#define SYSFS_MAGIC         0x62656572
+#define DEBUGFS_MAGIC       0x64626720
+#define TRACEFS_MAGIC       0x74726163
+#define CGROUP2_SUPER_MAGIC 0x63677270
+
+#define PSEUDO_BATCH_SIZE (64 * 1024) // 批量输出缓冲区 (位于栈上)
+
+// is_pseudo_fs 函数：判断 fd 是否位于内容由内核动态生成的伪文件系统上
+int is_pseudo_fs(int fd) {
+    struct statfs sfs;
+    if (fstatfs(fd, &sfs) == -1) {
+        return 0;
+    }
+    switch ((unsigned long)sfs.f_type) {
+    case PROC_SUPER_MAGIC:
+    case SYSFS_MAGIC:
+    case DEBUGFS_MAGIC:
+    case TRACEFS_MAGIC:
+    case CGROUP2_SUPER_MAGIC:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// 多个文件的输出攒在一起写出
+struct out_batch {
+    char *buf;
+    size_t size;
+    size_t used;
+    int pooled; // buf 是否已换成 batch_grow 分配的大缓冲区
+    struct drop_behind drop; // 后台模式下输出的页缓存丢弃状态
+};
+
+// batch_grow 函数：把批量缓冲区从栈上的小缓冲区换成 io_blocksize() 大小的缓冲区，保留已攒的数据
+// 返回值: 成功返回 0，分配失败返回 -1
+int batch_grow(struct out_batch *b) {
+    if (b->pooled) {
+        return 0;
+    }
+    size_t size = io_blocksize();
+    char *buf = io_buffer_alloc(size);
+    if (buf == NULL) {
+        return -1;
+    }
+    memcpy(buf, b->buf, b->used);
+    b->buf = buf;
+    b->size = size;
+    b->pooled = 1;
+    g_stats.buffer_size = size;
+    return 0;
+}
+
+// batch_flush 函数：写出批量缓冲区中的数据
+// 返回值: 成功返回 0，失败返回 -1
+int batch_flush(struct out_batch *b) {
+    if (b->used > 0 && emit_output(b->buf, b->used) == -1) {
+        return -1;
+    }
+    if (g_opts.background) {
+        drop_behind_block(&b->drop, 0, b->used);
+    }
+    b->used = 0;
+    return 0;
+}
+
+// copy_to_batch 函数：把文件直接读进批量缓冲区的剩余空间，缓冲区满时写出
+// 返回值: 成功返回 0；读取失败返回 -1，写出失败返回 -2 (errno 已设置)
+int copy_to_batch(int fd, struct out_batch *b) {
+    for (;;) {
+        if (b->used == b->size && batch_flush(b) == -1) {
+            return -2;
+        }
+        ssize_t n = read_input(fd, b->buf + b->used, b->size - b->used);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        if (n == 0) {
+            return 0;
+        }
+        b->used += (size_t)n;
+    }
+}
+
+// cat_files 函数：依次输出多个文件 (或单个伪文件系统上的文件)，不支持变换阶段
+// 某个文件打不开或读取失败时报告后继续处理其余文件，与 cat 一致；写出失败立即终止。
+// 参数: first_fd - 第一个文件已经打开时为它的描述符 (由本函数关闭)，否则为 -1
+// 返回值: 进程退出状态
+int cat_files(int nfiles, char **files, int first_fd) {
+    char stack_buf[PSEUDO_BATCH_SIZE];
+    struct out_batch batch = { stack_buf, sizeof(stack_buf), 0, 0, { 0 } };
+    int status = EXIT_SUCCESS;
+    if (g_opts.background) {
+        drop_behind_init(&batch.drop, -1);
+    }
+    int write_failed = 0;
+    set_engine("batch");
+    g_stats.buffer_size = sizeof(stack_buf);
+    g_stats.threads = 1;
+    page_faults(&g_stats.minflt_prepared, &g_stats.majflt_prepared);
+    for (int i = 0; i < nfiles; i++) {
+        int fd = i == 0 && first_fd != -1 ? first_fd : open(files[i], O_RDONLY | O_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "%s: 打开失败: %s\n", files[i], strerror(errno));
+            status = EXIT_FAILURE;
+            continue;
+        }
+        int rc = is_pseudo_fs(fd) || batch_grow(&batch) == 0 ? copy_to_batch(fd, &batch) : -1;
+        if (rc == -1) {
+            fprintf(stderr, "%s: 读取失败: %s\n", files[i], strerror(errno));
+            status = EXIT_FAILURE;
+        }
+        drop_cache_range(fd, 0, 0, 0);
+        close(fd);
+        if (rc == -2) {
+            write_failed = 1;
+            break;
+        }
+    }
+    if (write_failed || batch_flush(&batch) == -1) {
+        perror("写入标准输出失败");
+        status = EXIT_FAILURE;
+    }
+    if (g_opts.background) {
+        drop_behind_finish(&batch.drop);
+    }
+    if (batch.pooled) {
+        io_buffer_free(batch.buf, batch.size);
+    }
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// 清单批量复制 (--manifest)
+// ---------------------------------------------------------------------------
+
+// 一个进程按清单复制大量文件，省去每个文件一次进程创建的开销。清单每行为
+//     源路径 目标路径 [偏移 长度]
+// 给出偏移和长度时只复制源文件的这一段到目标文件的相同偏移处，否则复制整个文件
+// (目标被截断为源的大小)。空行和以 # 开头的行被忽略；路径中不能含有空白字符。
+//
+// 调度: 大文件按条带切成多个任务，由各线程用 pread/pwrite 并行复制；
+// 小文件则每 MANIFEST_BATCH_FILES 个打包成一个任务，减少领取任务的开销。
+// 所有线程共用一个 LRU 文件描述符缓存，同时打开的描述符数不超过 --max-open。
+
+#define MANIFEST_STRIPE_SIZE (16 * 1024 * 1024) // 大文件的条带大小，也是"大文件"的门槛
+#define MANIFEST_BATCH_FILES 64                 // 一个任务最多包含的小文件数
+#define MANIFEST_DEFAULT_MAX_OPEN 1024
+
+enum fd_role { FD_SRC, FD_DST };
+
+// 文件描述符缓存中的一项，嵌在清单条目中 (源和目标各一项)
+struct fd_slot {
+    int fd;       // -1 表示未打开
+    int refs;     // 正在使用它的线程数，大于 0 时不能被淘汰
+    int opening;  // 某个线程正在打开它，其他线程需要等待
+    struct fd_slot *prev, *next; // LRU 链表，只包含已打开且未被使用的项
+};
+
+// 清单中的一个条目
+struct manifest_entry {
+    char *src;
+    char *dst;
+    off_t offset;       // 复制的起始偏移
+    off_t len;          // 复制的长度 (规划后确定)
+    int whole;          // 复制整个文件，目标需要截断
+    int truncate_on_open; // 整个文件由一个任务复制时，打开目标时直接 O_TRUNC
+    mode_t mode;        // 新建目标文件时使用的权限 (取自源文件)
+    struct fd_slot slot[2];
+    uint64_t copied;    // 已复制的字节数，原子累加
+    uint64_t start_ns;  // 第一个任务开始的时间
+    uint64_t end_ns;    // 最后一个任务结束的时间
+    int error;          // 第一个错误的 errno，0 表示成功
+};
+
+// 一个复制任务: 从 entry 开始的连续 count 个小文件，或者 (count 为 0 时) 一个大文件的一个条带
+struct copy_task {
+    size_t entry;
+    size_t count;
+    off_t offset; // 条带任务的范围
+    off_t len;
+};
+
+struct manifest_job {
+    struct manifest_entry *entries;
+    size_t nentries;
+    struct copy_task *tasks;
+    size_t ntasks;
+    size_t next_task; // 下一个待领取的任务，原子递增
+    size_t buffer_size;
+
+    // 描述符缓存
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int open_count;  // 已打开 (或正在打开) 的描述符数
+    int max_open;
+    struct fd_slot lru; // LRU 链表头: lru.next 最久未使用，lru.prev 最近使用
+};
+
+// lru_unlink 函数：把 slot 从 LRU 链表中摘下 (调用者持有锁)
+void lru_unlink(struct fd_slot *slot) {
+    if (slot->prev != NULL) {
+        slot->prev->next = slot->next;
+        slot->next->prev = slot->prev;
+        slot->prev = slot->next = NULL;
+    }
+}
+
+// fd_acquire 函数：取得条目 e 的源或目标描述符，必要时淘汰最久未使用的描述符再打开
+// 返回值: 文件描述符，打开失败返回 -1 (errno 已设置)；用完后必须调用 fd_release
+int fd_acquire(struct manifest_job *job, struct manifest_entry *e, enum fd_role role) {
+    struct fd_slot *slot = &e->slot[role];
+    pthread_mutex_lock(&job->lock);
+    while (slot->opening) {
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    if (slot->fd != -1) {
+        slot->refs++;
+        lru_unlink(slot);
+        pthread_mutex_unlock(&job->lock);
+        return slot->fd;
+    }
+    // 需要新打开一个描述符: 先腾出名额。每个线程最多同时持有两个描述符，
+    // 而 max_open 不小于线程数的两倍，所以总能等到其他线程释放。
+    while (job->open_count >= job->max_open) {
+        struct fd_slot *victim = job->lru.next;
+        if (victim != &job->lru) {
+            lru_unlink(victim);
+            close(victim->fd);
+            victim->fd = -1;
+            job->open_count--;
+        } else {
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+    }
+    job->open_count++;
+    slot->opening = 1;
+    pthread_mutex_unlock(&job->lock);
+
+    // 在锁外打开，避免其他线程在慢速的 open 上排队
+    int fd;
+    if (role == FD_SRC) {
+        fd = open(e->src, O_RDONLY | O_CLOEXEC);
+    } else {
+        fd = open(e->dst, O_WRONLY | O_CREAT | O_CLOEXEC | (e->truncate_on_open ? O_TRUNC : 0), e->mode);
+    }
+    int saved = errno;
+
+    pthread_mutex_lock(&job->lock);
+    slot->opening = 0;
+    slot->fd = fd;
+    if (fd == -1) {
+        job->open_count--;
+    } else {
+        slot->refs++;
+    }
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    errno = saved;
+    return fd;
+}
+
+// fd_release 函数：用完描述符后放回 LRU 链表尾部；close_now 为 1 时 (条目已全部复制完) 直接关闭
+void fd_release(struct manifest_job *job, struct manifest_entry *e, enum fd_role role, int close_now) {
+    struct fd_slot *slot = &e->slot[role];
+    pthread_mutex_lock(&job->lock);
+    if (--slot->refs == 0) {
+        if (close_now) {
+            close(slot->fd);
+            slot->fd = -1;
+            job->open_count--;
+        } else {
+            slot->prev = job->lru.prev;
+            slot->next = &job->lru;
+            job->lru.prev->next = slot;
+            job->lru.prev = slot;
+        }
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+}
+
+// entry_fail 函数：记录条目的第一个错误
+void entry_fail(struct manifest_entry *e, int err) {
+    int expected = 0;
+    __atomic_compare_exchange_n(&e->error, &expected, err, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+// copy_range 函数：把条目 e 的 [offset, offset + len) 从源复制到目标的相同偏移处
+void copy_range(struct manifest_job *job, struct manifest_entry *e, off_t offset, off_t len, char *buf) {
+    uint64_t start = now_ns();
+    uint64_t expected = 0;
+    __atomic_compare_exchange_n(&e->start_ns, &expected, start, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+
+    int src = fd_acquire(job, e, FD_SRC);
+    if (src == -1) {
+        entry_fail(e, errno);
+        return;
+    }
+    int dst = fd_acquire(job, e, FD_DST);
+    if (dst == -1) {
+        entry_fail(e, errno);
+        fd_release(job, e, FD_SRC, 0);
+        return;
+    }
+    off_t end = offset + len;
+    while (offset < end) {
+        size_t want = (size_t)(end - offset) < job->buffer_size ? (size_t)(end - offset) : job->buffer_size;
+        ssize_t n = pread_full(src, buf, want, offset);
+        if (n <= 0) {
+            entry_fail(e, n == 0 ? EIO : errno); // 读到 0 说明源文件在规划之后被截短
+            break;
+        }
+        if (pwrite_all(dst, buf, (size_t)n, offset) == -1) {
+            entry_fail(e, errno);
+            break;
+        }
+        drop_cache_range(src, offset, n, 0);
+        drop_cache_range(dst, offset, n, 1);
+        offset += n;
+        stat_add(&e->copied, (uint64_t)n);
+    }
+    int done = __atomic_load_n(&e->copied, __ATOMIC_RELAXED) >= (uint64_t)e->len
+               || __atomic_load_n(&e->error, __ATOMIC_RELAXED) != 0;
+    fd_release(job, e, FD_DST, done);
+    fd_release(job, e, FD_SRC, done);
+
+    uint64_t finish = now_ns();
+    uint64_t prev = __atomic_load_n(&e->end_ns, __ATOMIC_RELAXED);
+    while (finish > prev && !__atomic_compare_exchange_n(&e->end_ns, &prev, finish, 1,
+                                                         __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    }
+}
+
+// manifest_worker 函数：不断领取任务并复制，直到任务全部领完
+void *manifest_worker(void *arg) {
+    struct manifest_job *job = arg;
+    char *buf = io_buffer_alloc(job->buffer_size);
+    if (buf == NULL) {
+        perror("分配批量复制缓冲区失败");
+        exit(EXIT_FAILURE);
+    }
+    size_t t;
+    while ((t = __atomic_fetch_add(&job->next_task, 1, __ATOMIC_RELAXED)) < job->ntasks) {
+        struct copy_task *task = &job->tasks[t];
+        if (task->count == 0) {
+            // 大文件的分段: 规划阶段或其他分段已经失败时，剩下的分段不必再复制
+            struct manifest_entry *e = &job->entries[task->entry];
+            if (__atomic_load_n(&e->error, __ATOMIC_RELAXED) == 0) {
+                copy_range(job, e, task->offset, task->len, buf);
+            }
+            continue;
+        }
+        for (size_t i = task->entry; i < task->entry + task->count; i++) {
+            struct manifest_entry *e = &job->entries[i];
+            if (__atomic_load_n(&e->error, __ATOMIC_RELAXED) == 0) { // 规划阶段失败的条目跳过
+                copy_range(job, e, e->offset, e->len, buf);
+            }
+        }
+    }
+    io_buffer_free(buf, job->buffer_size);
+    return NULL;
+}
+
+// load_manifest 函数：读取清单文件，解析出各条目
+// 返回值: 条目数组，条目数写入 *count；清单无法读取或格式错误时退出进程
+struct manifest_entry *load_manifest(const char *path, size_t *count) {
+    FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (f == NULL) {
+        perror("打开清单文件失败");
+        exit(EXIT_FAILURE);
+    }
+    size_t cap = 1024;
+    size_t n = 0;
+    struct manifest_entry *entries = malloc(cap * sizeof(*entries));
+    char *line = NULL;
+    size_t line_cap = 0;
+    size_t lineno = 0;
+    while (entries != NULL && getline(&line, &line_cap, f) != -1) {
+        lineno++;
+        char *save;
+        char *src = strtok_r(line, " \t\r\n", &save);
+        if (src == NULL || src[0] == '#') {
+            continue;
+        }
+        char *dst = strtok_r(NULL, " \t\r\n", &save);
+        char *off = strtok_r(NULL, " \t\r\n", &save);
+        char *len = strtok_r(NULL, " \t\r\n", &save);
+        uint64_t off_v = 0;
+        uint64_t len_v = 0;
+        if (dst == NULL || (off == NULL) != (len == NULL) || strtok_r(NULL, " \t\r\n", &save) != NULL
+            || (off != NULL && (parse_size(off, &off_v) == -1 || parse_size(len, &len_v) == -1))) {
+            fprintf(stderr, "清单第 %zu 行格式错误，应为: 源路径 目标路径 [偏移 长度]\n", lineno);
+            exit(EXIT_FAILURE);
+        }
+        if (n == cap) {
+            cap *= 2;
+            struct manifest_entry *grown = realloc(entries, cap * sizeof(*entries));
+            if (grown == NULL) {
+                free(entries);
+                entries = NULL;
+                break;
+            }
+            entries = grown;
+        }
+        struct manifest_entry *e = &entries[n++];
+        memset(e, 0, sizeof(*e));
+        e->src = strdup(src);
+        e->dst = strdup(dst);
+        e->whole = off == NULL;
+        e->offset = (off_t)off_v;
+        e->len = (off_t)len_v;
+        e->slot[FD_SRC].fd = -1;
+        e->slot[FD_DST].fd = -1;
+        if (e->src == NULL || e->dst == NULL) {
+            free(entries);
+            entries = NULL;
+        }
+    }
+    if (entries == NULL) {
+        perror("分配清单条目失败");
+        exit(EXIT_FAILURE);
+    }
+    free(line);
+    if (f != stdin) {
+        fclose(f);
+    }
+    *count = n;
+    return entries;
+}
+
+// plan_manifest 函数：查询每个源文件的大小，确定复制范围，并把条目划分成任务
+// 返回值: 所有条目要复制的总字节数
+uint64_t plan_manifest(struct manifest_job *job) {
+    size_t cap = job->nentries + 16;
+    job->tasks = malloc(cap * sizeof(struct copy_task));
+    if (job->tasks == NULL) {
+        perror("分配复制任务失败");
+        exit(EXIT_FAILURE);
+    }
+    uint64_t total = 0;
+    size_t batch_start = 0;
+    size_t batch_count = 0;
+    for (size_t i = 0; i < job->nentries; i++) {
+        struct manifest_entry *e = &job->entries[i];
+        struct stat st;
+        if (stat(e->src, &st) == -1) {
+            e->error = errno;
+        } else {
+            if (e->whole) {
+                e->len = st.st_size;
+            } else if (e->offset > st.st_size) {
+                e->len = 0;
+            } else if (e->offset + e->len > st.st_size) {
+                e->len = st.st_size - e->offset;
+            }
+            e->mode = st.st_mode & 0777;
+        }
+
+        int big = e->error == 0 && e->len > MANIFEST_STRIPE_SIZE;
+        size_t need = big ? (size_t)((e->len + MANIFEST_STRIPE_SIZE - 1) / MANIFEST_STRIPE_SIZE) : 1;
+        if (job->ntasks + need + 1 > cap) {
+            cap = (cap + need) * 2;
+            struct copy_task *grown = realloc(job->tasks, cap * sizeof(struct copy_task));
+            if (grown == NULL) {
+                perror("分配复制任务失败");
+                exit(EXIT_FAILURE);
+            }
+            job->tasks = grown;
+        }
+
+        if (!big) {
+            // 小文件由一个任务完整复制，打开目标时就可以截断
+            e->truncate_on_open = e->whole;
+            if (batch_count == 0) {
+                batch_start = i;
+            }
+            batch_count++;
+            if (batch_count == MANIFEST_BATCH_FILES) {
+                job->tasks[job->ntasks++] = (struct copy_task){ batch_start, batch_count, 0, 0 };
+                batch_count = 0;
+            }
+        } else {
+            // 小文件的批次必须由连续的条目组成，遇到大文件时先结束当前批次
+            if (batch_count > 0) {
+                job->tasks[job->ntasks++] = (struct copy_task){ batch_start, batch_count, 0, 0 };
+                batch_count = 0;
+            }
+            // 大文件: 先把目标截断到源的大小，再切成条带，各条带可以乱序写入
+            if (e->whole) {
+                int fd = fd_acquire(job, e, FD_DST);
+                if (fd == -1 || ftruncate(fd, e->len) == -1) {
+                    e->error = errno;
+                }
+                if (fd != -1) {
+                    fd_release(job, e, FD_DST, 0);
+                }
+            }
+            for (off_t off = 0; off < e->len; off += MANIFEST_STRIPE_SIZE) {
+                off_t len = e->len - off < MANIFEST_STRIPE_SIZE ? e->len - off : MANIFEST_STRIPE_SIZE;
+                job->tasks[job->ntasks++] = (struct copy_task){ i, 0, e->offset + off, len };
+            }
+        }
+        if (e->error == 0) {
+            total += (uint64_t)e->len;
+        }
+    }
+    if (batch_count > 0) {
+        job->tasks[job->ntasks++] = (struct copy_task){ batch_start, batch_count, 0, 0 };
+    }
+    return total;
+}
+
+// run_manifest 函数：按 --manifest 清单批量复制，结束时报告每个条目的结果
+// 返回值: 进程退出状态，任何一个条目失败都返回 EXIT_FAILURE
+int run_manifest() {
+    struct manifest_job job;
+    memset(&job, 0, sizeof(job));
+    job.entries = load_manifest(g_opts.manifest, &job.nentries);
+    job.buffer_size = io_blocksize();
+    job.lru.next = job.lru.prev = &job.lru;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    job.max_open = g_opts.max_open;
+    if (job.max_open == 0) {
+        struct rlimit rl;
+        job.max_open = MANIFEST_DEFAULT_MAX_OPEN;
+        // 给标准输入输出和其他用途留出余量
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY
+            && (rlim_t)job.max_open + 16 > rl.rlim_cur) {
+            job.max_open = rl.rlim_cur > 18 ? (int)rl.rlim_cur - 16 : 2;
+        }
+    }
+    // 每个线程最多同时持有源和目标两个描述符
+    int nthreads = g_opts.threads > 0 ? g_opts.threads : default_thread_count();
+    if (nthreads > job.max_open / 2) {
+        nthreads = job.max_open / 2;
+    }
+
+    uint64_t total = plan_manifest(&job);
+    fprintf(stderr, "清单: %zu 个条目，共 %llu 字节，%zu 个任务，%d 个线程，最多同时打开 %d 个文件\n",
+            job.nentries, (unsigned long long)total, job.ntasks, nthreads, job.max_open);
+    set_engine("manifest pread/pwrite");
+    g_stats.buffer_size = job.buffer_size;
+    g_stats.threads = nthreads;
+    page_faults(&g_stats.minflt_prepared, &g_stats.majflt_prepared);
+    start_progress(total);
+
+    join_workers(start_workers(nthreads, manifest_worker, &job), nthreads);
+
+    size_t failed = 0;
+    for (size_t i = 0; i < job.nentries; i++) {
+        struct manifest_entry *e = &job.entries[i];
+        for (int role = FD_SRC; role <= FD_DST; role++) {
+            if (e->slot[role].fd != -1) {
+                close(e->slot[role].fd);
+            }
+        }
+        if (e->error != 0) {
+            failed++;
+            fprintf(stderr, "%s -> %s: 失败: %s\n", e->src, e->dst, strerror(e->error));
+        } else if (g_opts.stats) {
+            double ms = e->end_ns > e->start_ns ? (double)(e->end_ns - e->start_ns) / 1e6 : 0.0;
+            fprintf(stderr, "%s -> %s: %llu 字节，%.3f 毫秒，%.1f MB/s\n", e->src, e->dst,
+                    (unsigned long long)e->copied, ms,
+                    ms > 0 ? (double)e->copied / (ms / 1000) / (1024 * 1024) : 0.0);
+        }
+        free(e->src);
+        free(e->dst);
+    }
+    fprintf(stderr, "清单复制完成: %zu 个条目成功，%zu 个失败\n", job.nentries - failed, failed);
+    free(job.entries);
+    free(job.tasks);
+    pthread_cond_destroy(&job.cond);
+    pthread_mutex_destroy(&job.lock);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+// ---------------------------------------------------------------------------
+// 行索引 (--line / --lines)
+// ---------------------------------------------------------------------------
+
+// 为了不读完整个文件就跳到第 N 行，在文件旁边保存一个行索引: 每隔 LINE_INDEX_SAMPLE 行
+// 记录一次行首的字节偏移。查询第 N 行只需要查一次索引，再从最近的采样点向后扫描不到
+// LINE_INDEX_SAMPLE 行。索引第一次查询时并行建立，之后通过 mmap 直接读取采样点。
+// 文件头记录建立索引时文件的长度、mtime 和 ctime，三者都相同时索引直接可用。
+// 文件变长时 (日志追加) 再校验已索引前缀的抽样块: 校验和与文件头中的一致，就只扫描新增部分
+// 并在原索引上扩展；长度不变或变短而时间戳变化 (改写)、或者校验和不一致时整个重建。
+//
+// 索引文件 = 文件头 + entries[nentries]，entries[j] 是第 j * LINE_INDEX_SAMPLE + 1 行的行首偏移。
+
+#define LINE_INDEX_MAGIC 0x7864696c7461636dULL // "mcatlidx"
+#define LINE_INDEX_VERSION 3
+#define LINE_INDEX_SAMPLE 1024
+#define LINE_INDEX_SUFFIX ".lineidx"
+// 前缀校验和: 在已索引前缀中均匀抽取的块数 (含第一块和最后一块) 与每块长度
+#define LINE_INDEX_CHECK_BLOCKS 8
+#define LINE_INDEX_CHECK_SIZE 4096
+
+struct line_index_header {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t sample;
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t indexed_bytes; // 已经索引过的文件前缀长度
+    uint64_t newlines;      // 已索引部分的换行符个数
+    uint64_t nentries;
+    int64_t mtime_sec;      // 建立索引时文件的 st_mtim 与 st_ctim
+    int64_t mtime_nsec;
+    int64_t ctime_sec;
+    int64_t ctime_nsec;
+    uint64_t prefix_check;  // 已索引前缀的抽样校验和，见 line_index_prefix_check
+};
+
+// 打开的行索引: 采样点指向索引文件的只读映射，或者指向本次建立/扩展的数组
+struct line_index {
+    struct line_index_header hdr;
+    const uint64_t *entries;
+    void *map;              // 索引文件的映射，没有时为 NULL
+    size_t map_len;
+    uint64_t *owned;        // 本次建立或扩展的采样点 (malloc 分配)
+};
+
+// skip_newlines_scalar 函数：在 buf 中越过 *need 个换行符
+// 返回值: 第 *need 个换行符之后的偏移 (*need 变为 0)；buf 中不够时返回 SIZE_MAX，
+//         *need 减去 buf 中换行符的个数。*need 为 UINT64_MAX 时相当于计数。
+size_t skip_newlines_scalar(const char *buf, size_t len, uint64_t *need) {
+    const char *p = buf;
+    const char *end = buf + len;
+    while (*need > 0) {
+        p = memchr(p, '\n', (size_t)(end - p));
+        if (p == NULL) {
+            return SIZE_MAX;
+        }
+        p++;
+        (*need)--;
+    }
+    return (size_t)(p - buf);
+}
+
+#if defined(__x86_64__)
+// skip_newlines_avx2 函数：与 skip_newlines_scalar 相同，每次比较 32 字节并用 popcount 计数，
+// 只在包含目标换行符的 32 字节块内逐位定位
+__attribute__((target("avx2,popcnt,bmi")))
+size_t skip_newlines_avx2(const char *buf, size_t len, uint64_t *need) {
+    if (*need == 0) {
+        return 0;
+    }
+    const __m256i lf = _mm256_set1_epi8('\n');
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+        uint32_t m = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+        uint64_t c = (uint64_t)__builtin_popcount(m);
+        if (c < *need) {
+            *need -= c;
+            continue;
+        }
+        for (uint64_t k = 1; k < *need; k++) {
+            m &= m - 1; // 清除最低的换行符
+        }
+        *need = 0;
+        return i + (size_t)__builtin_ctz(m) + 1;
+    }
+    size_t pos = skip_newlines_scalar(buf + i, len - i, need);
+    return pos == SIZE_MAX ? SIZE_MAX : i + pos;
+}
+#endif
+
+static size_t (*skip_newlines)(const char *buf, size_t len, uint64_t *need) = skip_newlines_scalar;
+
+// 并行建立索引的任务: 第一遍统计各块的换行符个数，第二遍在各块中找出采样点
+struct line_index_job {
+    int fd;
+    off_t start;        // 本次需要扫描的范围 [start, end)
+    off_t end;
+    size_t chunk_size;
+    size_t nchunks;
+    size_t next_chunk;  // 下一个待领取的块号，原子递增
+    int pass;           // 1 或 2
+    uint64_t *counts;   // 第一遍: 各块的换行符个数；前缀和之后为块起点之前的换行符总数
+    uint64_t *entries;  // 第二遍写入的采样点，下标为全局换行符序号 / LINE_INDEX_SAMPLE
+};
+
+// line_index_worker 函数：领取块并执行当前这一遍的扫描
+void *line_index_worker(void *arg) {
+    struct line_index_job *job = arg;
+    char *buf = io_buffer_alloc(job->chunk_size);
+    if (buf == NULL) {
+        perror("分配行索引缓冲区失败");
+        exit(EXIT_FAILURE);
+    }
+    size_t idx;
+    while ((idx = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+        off_t off = job->start + (off_t)idx * (off_t)job->chunk_size;
+        size_t want = job->end - off < (off_t)job->chunk_size ? (size_t)(job->end - off) : job->chunk_size;
+        ssize_t n = pread_full(job->fd, buf, want, off);
+        if (n == -1) {
+            perror("读取文件失败");
+            exit(EXIT_FAILURE);
+        }
+        if (job->pass == 1) {
+            uint64_t need = UINT64_MAX;
+            skip_newlines(buf, (size_t)n, &need);
+            job->counts[idx] = UINT64_MAX - need;
+            continue;
+        }
+        // 第二遍: 块起点之前有 base 个换行符，找出块内序号为 LINE_INDEX_SAMPLE 倍数的换行符
+        uint64_t base = job->counts[idx];
+        uint64_t target = (base / LINE_INDEX_SAMPLE + 1) * LINE_INDEX_SAMPLE;
+        size_t pos = 0;
+        uint64_t need = target - base;
+        for (;;) {
+            size_t p = skip_newlines(buf + pos, (size_t)n - pos, &need);
+            if (p == SIZE_MAX) {
+                break;
+            }
+            pos += p;
+            job->entries[target / LINE_INDEX_SAMPLE] = (uint64_t)(off + (off_t)pos);
+            target += LINE_INDEX_SAMPLE;
+            need = LINE_INDEX_SAMPLE;
+        }
+    }
+    io_buffer_free(buf, job->chunk_size);
+    return NULL;
+}
+
+// extend_line_index 函数：扫描文件的 [from, to) 部分，把采样点追加到索引中
+// 参数: hdr - 已索引部分的信息，扫描后更新; entries - 采样点数组，必要时重新分配
+// 返回值: 新的采样点数组
+uint64_t *extend_line_index(int fd, struct line_index_header *hdr, uint64_t *entries, off_t to, int nthreads) {
+    struct line_index_job job;
+    memset(&job, 0, sizeof(job));
+    job.fd = fd;
+    job.start = (off_t)hdr->indexed_bytes;
+    job.end = to;
+    job.chunk_size = io_blocksize();
+    job.nchunks = (size_t)((job.end - job.start + (off_t)job.chunk_size - 1) / (off_t)job.chunk_size);
+    job.counts = calloc(job.nchunks + 1, sizeof(uint64_t));
+    if (job.counts == NULL) {
+        perror("分配行索引状态失败");
+        exit(EXIT_FAILURE);
+    }
+
+    job.pass = 1;
+    join_workers(start_workers(nthreads, line_index_worker, &job), nthreads);
+
+    // 排他前缀和: 每块起点之前的全局换行符个数
+    uint64_t total = hdr->newlines;
+    for (size_t i = 0; i < job.nchunks; i++) {
+        uint64_t c = job.counts[i];
+        job.counts[i] = total;
+        total += c;
+    }
+    uint64_t nentries = total / LINE_INDEX_SAMPLE + 1;
+    entries = realloc(entries, nentries * sizeof(uint64_t));
+    if (entries == NULL) {
+        perror("分配行索引失败");
+        exit(EXIT_FAILURE);
+    }
+    entries[0] = 0;
+    job.entries = entries;
+    job.pass = 2;
+    job.next_chunk = 0;
+    join_workers(start_workers(nthreads, line_index_worker, &job), nthreads);
+    free(job.counts);
+
+    hdr->newlines = total;
+    hdr->nentries = nentries;
+    hdr->indexed_bytes = (uint64_t)to;
+    return entries;
+}
+
+// line_index_cache_dir 函数：取得当前用户私有的索引目录 ($XDG_CACHE_HOME/mycat，未设置时为 /tmp/mycat-<uid>)，
+// 不存在时以 0700 创建。目录必须是当前用户所有的真实目录且其他人不可写，否则别人可以预先放入
+// 符号链接或伪造的索引
+// 返回值: 成功返回 0，失败返回 -1
+int line_index_cache_dir(char *out, size_t size) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    if (xdg != NULL && xdg[0] == '/') {
+        snprintf(out, size, "%s/mycat", xdg);
+    } else {
+        snprintf(out, size, "/tmp/mycat-%u", (unsigned)geteuid());
+    }
+    if (mkdir(out, 0700) == -1 && errno != EEXIST) {
+        return -1;
+    }
+    struct stat st;
+    if (lstat(out, &st) == -1) {
+        return -1;
+    }
+    if (!S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 022) != 0) {
+        fprintf(stderr, "警告: 索引目录 %s 不属于当前用户或其他人可写，不使用\n", out);
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+}
+
+// line_index_default_path 函数：默认把索引放在文件旁边；那里不可写时放到用户私有的索引目录下，
+// 以设备号和 inode 命名
+// 返回值: 成功返回 0，私有目录不可用时返回 -1
+int line_index_default_path(const char *file, const struct stat *st, int beside, char *out, size_t size) {
+    if (beside) {
+        snprintf(out, size, "%s" LINE_INDEX_SUFFIX, file);
+        return 0;
+    }
+    char dir[4096];
+    if (line_index_cache_dir(dir, sizeof(dir)) == -1) {
+        return -1;
+    }
+    if (snprintf(out, size, "%s/%llx-%llx" LINE_INDEX_SUFFIX, dir, (unsigned long long)st->st_dev,
+                 (unsigned long long)st->st_ino) >= (int)size) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    return 0;
+}
+
+// line_index_prefix_check 函数：计算文件前 len 字节的抽样校验和。
+// 均匀抽取 LINE_INDEX_CHECK_BLOCKS 个块 (第一块和紧挨着 len 的最后一块总在其中)，
+// 连同 len 一起按 8 字节混合；只读几十 KB，与文件大小无关
+// 返回值: 成功返回 0 并写入 *check，读取失败返回 -1
+int line_index_prefix_check(int fd, uint64_t len, uint64_t *check) {
+    uint64_t h = 0xcbf29ce484222325ULL ^ len;
+    uint64_t block = len < LINE_INDEX_CHECK_SIZE ? len : LINE_INDEX_CHECK_SIZE;
+    uint64_t buf[LINE_INDEX_CHECK_SIZE / sizeof(uint64_t)];
+    for (int k = 0; k < LINE_INDEX_CHECK_BLOCKS && block > 0; k++) {
+        off_t off = (off_t)((len - block) / (LINE_INDEX_CHECK_BLOCKS - 1) * (uint64_t)k);
+        if (k == LINE_INDEX_CHECK_BLOCKS - 1) {
+            off = (off_t)(len - block);
+        }
+        memset(buf, 0, sizeof(buf));
+        if (pread_full(fd, (char *)buf, (size_t)block, off) != (ssize_t)block) {
+            return -1;
+        }
+        for (size_t i = 0; i < (block + 7) / 8; i++) {
+            h = (h ^ buf[i]) * 0x100000001b3ULL;
+            h ^= h >> 29;
+        }
+    }
+    *check = h;
+    return 0;
+}
+
+// 索引文件与当前文件的关系
+enum line_index_state {
+    LINE_INDEX_STALE,    // 不存在、不属于这个文件或已被改写，需要重建
+    LINE_INDEX_CURRENT,  // 与文件完全对应，直接使用
+    LINE_INDEX_APPENDED, // 文件在已索引前缀之后追加了数据，可以在原索引上扩展
+};
+
+// load_line_index 函数：映射索引文件，检查它是否属于这个文件以及是否仍然有效
+// 返回值: 索引的状态；不是 LINE_INDEX_STALE 时 idx 的 hdr、entries 和 map 指向映射
+enum line_index_state load_line_index(const char *path, int fd, const struct stat *st, struct line_index *idx) {
+    int ifd = open(path, O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+    if (ifd == -1) {
+        return LINE_INDEX_STALE;
+    }
+    // 只信任自己或数据文件的所有者写下的索引
+    struct stat ist;
+    enum line_index_state state = LINE_INDEX_STALE;
+    struct line_index_header *hdr = &idx->hdr;
+    if (fstat(ifd, &ist) == 0 && S_ISREG(ist.st_mode) && (ist.st_uid == geteuid() || ist.st_uid == st->st_uid)
+        && (size_t)ist.st_size >= sizeof(*hdr)) {
+        void *map = mmap(NULL, (size_t)ist.st_size, PROT_READ, MAP_SHARED, ifd, 0);
+        if (map != MAP_FAILED) {
+            memcpy(hdr, map, sizeof(*hdr));
+            int ours = hdr->magic == LINE_INDEX_MAGIC && hdr->version == LINE_INDEX_VERSION
+                       && hdr->sample == LINE_INDEX_SAMPLE
+                       && hdr->dev == (uint64_t)st->st_dev && hdr->ino == (uint64_t)st->st_ino
+                       && hdr->nentries >= 1 && hdr->nentries <= (uint64_t)ist.st_size / sizeof(uint64_t)
+                       && (uint64_t)ist.st_size == sizeof(*hdr) + hdr->nentries * sizeof(uint64_t);
+            int unchanged = hdr->indexed_bytes == (uint64_t)st->st_size
+                            && hdr->mtime_sec == (int64_t)st->st_mtim.tv_sec
+                            && hdr->mtime_nsec == (int64_t)st->st_mtim.tv_nsec
+                            && hdr->ctime_sec == (int64_t)st->st_ctim.tv_sec
+                            && hdr->ctime_nsec == (int64_t)st->st_ctim.tv_nsec;
+            uint64_t check;
+            if (ours && unchanged) {
+                state = LINE_INDEX_CURRENT;
+            } else if (ours && hdr->indexed_bytes < (uint64_t)st->st_size
+                       && line_index_prefix_check(fd, hdr->indexed_bytes, &check) == 0
+                       && check == hdr->prefix_check) {
+                state = LINE_INDEX_APPENDED;
+            }
+            if (state != LINE_INDEX_STALE) {
+                idx->map = map;
+                idx->map_len = (size_t)ist.st_size;
+                idx->entries = (const uint64_t *)((char *)map + sizeof(*hdr));
+            } else {
+                munmap(map, (size_t)ist.st_size);
+            }
+        }
+    }
+    close(ifd);
+    return state;
+}
+
+// close_line_index 函数：解除索引文件的映射，释放本次建立的采样点
+void close_line_index(struct line_index *idx) {
+    if (idx->map != NULL) {
+        munmap(idx->map, idx->map_len);
+        idx->map = NULL;
+    }
+    free(idx->owned);
+    idx->owned = NULL;
+    idx->entries = NULL;
+}
+
+// save_line_index 函数：先用 mkstemp 独占地创建临时文件再 rename，原子地替换索引文件
+// 返回值: 成功返回 0，失败返回 -1
+int save_line_index(const char *path, const struct line_index_header *hdr, const uint64_t *entries) {
+    char tmp[4096];
+    if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >= (int)sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    int fd = mkostemp(tmp, O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fchmod(fd, 0644) == -1
+        || write_all(fd, (const char *)hdr, sizeof(*hdr)) == -1
+        || write_all(fd, (const char *)entries, hdr->nentries * sizeof(uint64_t)) == -1
+        || close(fd) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    if (rename(tmp, path) == -1) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// open_line_index 函数：取得文件的行索引。索引最新时直接使用映射；文件追加过时只扫描新增部分，
+// 不存在或已被改写时重新建立，两种情况都保存新的索引
+void open_line_index(int fd, const char *file, const struct stat *st, struct line_index *idx) {
+    char path[4096];
+    char alt[4096];
+    int beside = g_opts.index_path == NULL; // 使用默认位置，保存失败时可以改用私有目录
+    if (!beside) {
+        snprintf(path, sizeof(path), "%s", g_opts.index_path);
+    } else {
+        line_index_default_path(file, st, 1, path, sizeof(path));
+    }
+    memset(idx, 0, sizeof(*idx));
+    enum line_index_state state = load_line_index(path, fd, st, idx);
+    if (state == LINE_INDEX_STALE && beside && line_index_default_path(file, st, 0, alt, sizeof(alt)) == 0) {
+        state = load_line_index(alt, fd, st, idx);
+        if (state != LINE_INDEX_STALE) {
+            memcpy(path, alt, sizeof(path));
+            beside = 0;
+        }
+    }
+    if (state == LINE_INDEX_CURRENT) {
+        return; // 索引是最新的
+    }
+
+    struct line_index_header *hdr = &idx->hdr;
+    uint64_t *entries = NULL;
+    if (state == LINE_INDEX_APPENDED) {
+        // 已索引的前缀没有变化，复制原有采样点后只扫描追加的部分
+        entries = malloc(hdr->nentries * sizeof(uint64_t));
+        if (entries == NULL) {
+            perror("分配行索引失败");
+            exit(EXIT_FAILURE);
+        }
+        memcpy(entries, idx->entries, hdr->nentries * sizeof(uint64_t));
+        close_line_index(idx);
+        fprintf(stderr, "正在扩展行索引 %s (从偏移 %llu 开始) ...\n", path,
+                (unsigned long long)hdr->indexed_bytes);
+    } else {
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->magic = LINE_INDEX_MAGIC;
+        hdr->version = LINE_INDEX_VERSION;
+        hdr->sample = LINE_INDEX_SAMPLE;
+        hdr->dev = (uint64_t)st->st_dev;
+        hdr->ino = (uint64_t)st->st_ino;
+        fprintf(stderr, "正在建立行索引 %s ...\n", path);
+    }
+    // 记录扫描前的文件状态: 扫描期间文件若被修改，下次查询时会发现不一致
+    hdr->mtime_sec = (int64_t)st->st_mtim.tv_sec;
+    hdr->mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+    hdr->ctime_sec = (int64_t)st->st_ctim.tv_sec;
+    hdr->ctime_nsec = (int64_t)st->st_ctim.tv_nsec;
+    int nthreads = g_opts.threads > 0 ? g_opts.threads : default_thread_count();
+    entries = extend_line_index(fd, hdr, entries, st->st_size, nthreads);
+    idx->owned = entries;
+    idx->entries = entries;
+    if (line_index_prefix_check(fd, hdr->indexed_bytes, &hdr->prefix_check) == -1) {
+        perror("读取文件失败");
+        exit(EXIT_FAILURE);
+    }
+
+    if (save_line_index(path, hdr, entries) == -1) {
+        if (beside && (errno == EACCES || errno == EROFS || errno == EPERM)
+            && line_index_default_path(file, st, 0, path, sizeof(path)) == 0
+            && save_line_index(path, hdr, entries) == 0) {
+            return;
+        }
+        fprintf(stderr, "警告: 无法保存行索引 %s: %s\n", path, strerror(errno));
+    }
+}
+
+// print_lines 函数：输出文件的第 first 到 last 行 (含两端，从 1 开始)
+// 返回值: 进程退出状态
+int print_lines(int fd, const char *file, uint64_t first, uint64_t last) {
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "--line/--lines 只支持普通文件\n");
+        return EXIT_FAILURE;
+    }
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt") && __builtin_cpu_supports("bmi")) {
+        skip_newlines = skip_newlines_avx2;
+    }
+#endif
+    struct line_index idx;
+    open_line_index(fd, file, &st, &idx);
+
+    // 从不超过第 first 行的最近采样点开始，越过剩余的换行符找到第 first 行的行首。
+    // 采样点直接从映射中读取，查询的代价与索引大小无关
+    uint64_t j = (first - 1) / LINE_INDEX_SAMPLE;
+    if (j >= idx.hdr.nentries) {
+        j = idx.hdr.nentries - 1;
+    }
+    off_t off = (off_t)idx.entries[j];
+    uint64_t skip = first - 1 - j * LINE_INDEX_SAMPLE;
+    // 需要输出的换行符个数 (last 为 UINT64_MAX 时一直输出到文件结尾)
+    uint64_t emit = last == UINT64_MAX ? UINT64_MAX : last - first + 1;
+
+    size_t buffer_size = io_blocksize();
+    char *buf = io_buffer_alloc(buffer_size);
+    if (buf == NULL) {
+        perror("分配缓冲区失败");
+        close_line_index(&idx);
+        return EXIT_FAILURE;
+    }
+    int status = EXIT_SUCCESS;
+    while (emit > 0) {
+        ssize_t n = pread_full(fd, buf, buffer_size, off);
+        if (n <= 0) {
+            if (n == -1) {
+                perror("读取文件失败");
+                status = EXIT_FAILURE;
+            }
+            break;
+        }
+        off += n;
+        size_t pos = 0;
+        if (skip > 0) {
+            pos = skip_newlines(buf, (size_t)n, &skip);
+            if (pos == SIZE_MAX) {
+                continue; // 第 first 行还在后面
+            }
+        }
+        size_t stop_at = skip_newlines(buf + pos, (size_t)n - pos, &emit);
+        size_t len = stop_at == SIZE_MAX ? (size_t)n - pos : stop_at;
+        if (emit_output(buf + pos, len) == -1) {
+            perror("写入标准输出失败");
+            status = EXIT_FAILURE;
+            break;
+        }
+    }
+    io_buffer_free(buf, buffer_size);
+    close_line_index(&idx);
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// 增量更新 (--update)
+// ---------------------------------------------------------------------------
+
+// 目标文件已经存在且大部分内容相同时 (每晚刷新的快照)，逐块比较输入和目标，
+// 只把不同的块 pwrite 到目标的相同偏移处，最后把目标截短或扩展到输入的长度。
+// 各线程领取 io_blocksize() 大小的块，同时读取两边，再以 DELTA_BLOCK 为粒度比较；
+// 相邻的不同小块合并成一次 pwrite。比较使用 memcmp，glibc 会按 CPU 选择 SIMD 实现。
+
+#define DELTA_BLOCK (64 * 1024)
+
+struct delta_job {
+    int src;
+    int dst;
+    off_t src_size;
+    off_t dst_size;
+    size_t chunk_size;
+    size_t nchunks;
+    size_t next_chunk;       // 下一个待领取的块号，原子递增
+    uint64_t blocks;         // 比较过的 DELTA_BLOCK 个数，原子累加
+    uint64_t changed_blocks; // 其中内容不同 (或超出目标原长度) 的个数
+    int error;               // 第一个错误的 errno，0 表示没有错误
+};
+
+// delta_worker 函数：领取块，比较输入和目标，只写回不同的部分
+void *delta_worker(void *arg) {
+    struct delta_job *job = arg;
+    char *src_buf = io_buffer_alloc(job->chunk_size);
+    char *dst_buf = io_buffer_alloc(job->chunk_size);
+    if (src_buf == NULL || dst_buf == NULL) {
+        perror("分配增量更新缓冲区失败");
+        exit(EXIT_FAILURE);
+    }
+    size_t idx;
+    while (__atomic_load_n(&job->error, __ATOMIC_RELAXED) == 0
+           && (idx = __atomic_fetch_add(&job->next_chunk, 1, __ATOMIC_RELAXED)) < job->nchunks) {
+        off_t off = (off_t)idx * (off_t)job->chunk_size;
+        size_t want = job->src_size - off < (off_t)job->chunk_size ? (size_t)(job->src_size - off)
+                                                                   : job->chunk_size;
+        ssize_t n = pread_full(job->src, src_buf, want, off);
+        ssize_t m = off < job->dst_size ? pread_full(job->dst, dst_buf, want, off) : 0;
+        if (n == -1 || m == -1) {
+            int expected = 0;
+            __atomic_compare_exchange_n(&job->error, &expected, errno, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+            break;
+        }
+        // 找出连续的不同小块，合并写回
+        size_t run = SIZE_MAX; // 当前连续不同区间的起点
+        uint64_t blocks = 0;
+        uint64_t changed = 0;
+        for (size_t i = 0;; i += DELTA_BLOCK) {
+            if (i > (size_t)n) {
+                i = (size_t)n; // 最后一次迭代 len 为 0，写回末尾尚未写回的区间
+            }
+            size_t len = (size_t)n - i < DELTA_BLOCK ? (size_t)n - i : DELTA_BLOCK;
+            int differs = 0;
+            if (len > 0) {
+                blocks++;
+                differs = i + len > (size_t)m || memcmp(src_buf + i, dst_buf + i, len) != 0;
+                changed += (uint64_t)differs;
+            }
+            if (differs && run == SIZE_MAX) {
+                run = i;
+            } else if (!differs && run != SIZE_MAX) {
+                if (pwrite_all(job->dst, src_buf + run, i - run, off + (off_t)run) == -1) {
+                    int expected = 0;
+                    __atomic_compare_exchange_n(&job->error, &expected, errno, 0, __ATOMIC_RELAXED,
+                                                __ATOMIC_RELAXED);
+                    break;
+                }
+                run = SIZE_MAX;
+            }
+            if (len == 0) {
+                break;
+            }
+        }
+        stat_add(&job->blocks, blocks);
+        stat_add(&job->changed_blocks, changed);
+        drop_cache_range(job->src, off, (off_t)n, 0);
+        drop_cache_range(job->dst, off, (off_t)n, changed > 0);
+    }
+    io_buffer_free(src_buf, job->chunk_size);
+    io_buffer_free(dst_buf, job->chunk_size);
+    return NULL;
+}
+
+// run_update 函数：把输入文件增量地同步到 g_opts.update_path
+// 返回值: 进程退出状态
+int run_update(int fd_in) {
+    struct stat st_in;
+    if (fstat(fd_in, &st_in) == -1 || !S_ISREG(st_in.st_mode)) {
+        fprintf(stderr, "--update 的输入必须是普通文件\n");
+        return EXIT_FAILURE;
+    }
+    int fd_dst = open(g_opts.update_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd_dst == -1) {
+        perror("打开目标文件失败");
+        return EXIT_FAILURE;
+    }
+    struct stat st_dst;
+    if (fstat(fd_dst, &st_dst) == -1 || !S_ISREG(st_dst.st_mode)) {
+        fprintf(stderr, "--update 的目标必须是普通文件\n");
+        close(fd_dst);
+        return EXIT_FAILURE;
+    }
+    if (st_dst.st_dev == st_in.st_dev && st_dst.st_ino == st_in.st_ino) {
+        fprintf(stderr, "输入和目标是同一个文件，无需更新\n");
+        close(fd_dst);
+        return EXIT_SUCCESS;
+    }
+
+    struct delta_job job;
+    memset(&job, 0, sizeof(job));
+    job.src = fd_in;
+    job.dst = fd_dst;
+    job.src_size = st_in.st_size;
+    job.dst_size = st_dst.st_size;
+    job.chunk_size = io_blocksize();
+    job.nchunks = (size_t)((job.src_size + (off_t)job.chunk_size - 1) / (off_t)job.chunk_size);
+    posix_fadvise(fd_in, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd_dst, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    int nthreads = g_opts.threads > 0 ? g_opts.threads : default_thread_count();
+    g_stats.buffer_size = job.chunk_size;
+    g_stats.threads = nthreads;
+    set_engine("delta");
+    page_faults(&g_stats.minflt_prepared, &g_stats.majflt_prepared);
+    // 进度按读取的字节数计算，两边都要读
+    start_progress((uint64_t)job.src_size + (uint64_t)(job.dst_size < job.src_size ? job.dst_size : job.src_size));
+    join_workers(start_workers(nthreads, delta_worker, &job), nthreads);
+
+    if (job.error == 0 && job.dst_size != job.src_size && ftruncate(fd_dst, job.src_size) == -1) {
+        job.error = errno;
+    }
+    if (close(fd_dst) == -1 && job.error == 0) {
+        job.error = errno;
+    }
+    if (job.error != 0) {
+        fprintf(stderr, "增量更新 %s 失败: %s\n", g_opts.update_path, strerror(job.error));
+        return EXIT_FAILURE;
+    }
+    fprintf(stderr, "增量更新完成: %llu/%llu 个块不同，写入 %llu 字节 (%.1f%%)\n",
+            (unsigned long long)job.changed_blocks, (unsigned long long)job.blocks,
+            (unsigned long long)stat_load(&g_stats.bytes_written),
+            job.src_size > 0 ? 100.0 * (double)stat_load(&g_stats.bytes_written) / (double)job.src_size : 0.0);
+    return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// 后台模式 (--background)
+// ---------------------------------------------------------------------------
+
+// 来自 linux/ioprio.h
+#define IOPRIO_CLASS_SHIFT 13
+#define IOPRIO_CLASS_BE    2
+#define IOPRIO_CLASS_IDLE  3
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_PRIO_VALUE(cls, data) (((cls) << IOPRIO_CLASS_SHIFT) | (data))
+#define IOPRIO_BE_LOWEST 7
+
+// enter_background_mode 函数：把本进程降为空闲 I/O 类和 SCHED_IDLE 调度
+// 必须在创建工作线程之前调用，之后创建的线程会继承这些属性。
+void enter_background_mode() {
+    const char *io_class = "idle";
+    if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                IOPRIO_PRIO_VALUE(IOPRIO_CLASS_IDLE, 0)) == -1) {
+        // 某些内核配置不允许空闲类，退而使用尽力而为类的最低优先级
+        io_class = "best-effort 7";
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+                    IOPRIO_PRIO_VALUE(IOPRIO_CLASS_BE, IOPRIO_BE_LOWEST)) == -1) {
+            perror("警告: ioprio_set 失败");
+            io_class = "未改变";
+        }
+    }
+
+    const char *cpu_class = "SCHED_IDLE";
+    struct sched_param param = { .sched_priority = 0 };
+    if (sched_setscheduler(0, SCHED_IDLE, &param) == -1) {
+        cpu_class = "nice 19";
+        if (setpriority(PRIO_PROCESS, 0, 19) == -1) {
+            perror("警告: setpriority 失败");
+            cpu_class = "未改变";
+        }
+    }
+    fprintf(stderr, "已进入后台模式: I/O 优先级 %s，CPU 调度 %s，启用页缓存丢弃。\n",
+            io_class, cpu_class);
+}
+
+// ---------------------------------------------------------------------------
+// 限时攒批输出 (--flush-interval)
+// ---------------------------------------------------------------------------
+
+// 管道输入断断续续时，默认的复制循环每次 read 返回多少就写多少，下游会被频繁唤醒。
+// 限时攒批把输入攒在缓冲区里: 缓冲区满了立即写出 (突发时仍是大块写)，
+// 否则从攒下第一个字节起最多等待 flush_interval 毫秒，期间用 poll 等待更多输入。
+
+// flush_coalesced 函数：让攒下的 len 字节输入经过各变换阶段后写出
+// 返回值: 成功返回 0，写出失败返回 -1
+int flush_coalesced(char *buffer, size_t len, int *stop, struct drop_behind *drop) {
+    size_t out_len;
+    char *out = run_transforms(buffer, len, 0, &out_len, stop);
+    if (emit_output(out, out_len) == -1) {
+        return -1;
+    }
+    if (drop != NULL) {
+        drop_behind_block(drop, len, out_len);
+    }
+    return 0;
+}
+
+// coalesced_copy 函数：限时攒批的复制循环，替代主循环中逐次读写的部分
+// 参数: drop - 后台模式的页缓存丢弃状态，不在后台模式时为 NULL
+// 返回值: 与 read 相同，0 表示输入正常结束，-1 表示读取失败；写出失败时直接退出进程
+ssize_t coalesced_copy(int fd_in, char *buffer, size_t read_size, int *stop, struct drop_behind *drop) {
+    size_t filled = 0;
+    uint64_t deadline = 0;
+    ssize_t n = 0;
+    while (!*stop) {
+        if (filled > 0) {
+            uint64_t now = now_ns();
+            int timeout = now >= deadline ? 0 : (int)((deadline - now + 999999) / 1000000);
+            struct pollfd pfd = { fd_in, POLLIN, 0 };
+            int rc = poll(&pfd, 1, timeout);
+            if (rc == -1 && errno != EINTR) {
+                return -1;
+            }
+            if (rc == 0) {
+                // 超时: 把攒下的数据写出，保证延迟上界
+                if (flush_coalesced(buffer, filled, stop, drop) == -1) {
+                    perror("写入标准输出失败或未完全写入");
+                    exit(EXIT_FAILURE);
+                }
+                filled = 0;
+                continue;
+            }
+        }
+        n = read_input(fd_in, buffer + filled, read_size - filled);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (filled == 0) {
+            deadline = now_ns() + (uint64_t)g_opts.flush_interval * 1000000;
+        }
+        filled += (size_t)n;
+        if (filled == read_size) {
+            if (flush_coalesced(buffer, filled, stop, drop) == -1) {
+                perror("写入标准输出失败或未完全写入");
+                exit(EXIT_FAILURE);
+            }
+            filled = 0;
+        }
+    }
+    // 输入结束或出错，写出剩余的数据
+    if (filled > 0 && !*stop && flush_coalesced(buffer, filled, stop, drop) == -1) {
+        perror("写入标准输出失败或未完全写入");
+        exit(EXIT_FAILURE);
+    }
+    return n;
+}
+
+// finish_reporting 函数：复制结束后停止进度报告，并按需打印统计信息
+void finish_reporting() {
+    stop_progress();
+    if (g_opts.stats) {
+        print_stats();
+    }
+}
+
+// print_usage 函数：打印用法说明
+void print_usage(const char *prog) {
+    fprintf(stderr, "用法: %s [选项] <文件名>...\n", prog);
+    fprintf(stderr, "      %s --top     每秒显示一次所有 --shm-stats 运行累计的主机级统计\n", prog);
+    fprintf(stderr, "                       (共享段权限为 0660，只统计与段创建者同组的用户运行的 mycat)\n");
+    fprintf(stderr, "      %s --source=zero|random|pattern [--size=N] [选项]\n", prog);
+    fprintf(stderr, "                       不读文件，在进程内生成 N 字节 (可带 K/M/G 后缀，默认 1G) 数据\n");
+    fprintf(stderr, "      %s --manifest=FILE [--max-open=N] [-j N] [--stats]\n", prog);
+    fprintf(stderr, "                       按清单 (每行: 源路径 目标路径 [偏移 长度]，FILE 为 - 时读标准输入)\n");
+    fprintf(stderr, "                       批量复制文件，最多同时打开 N 个文件 (默认 %d)；--stats 时报告每个条目\n",
+            MANIFEST_DEFAULT_MAX_OPEN);
+    fprintf(stderr, "      %s --warm|--evict|--lock [-j N] <文件名>...\n", prog);
+    fprintf(stderr, "                       把文件并行读入页缓存 / 逐出页缓存 / mlock 锁定在内存中\n");
+    fprintf(stderr, "                       (锁定时进程保持运行)，并报告前后的驻留比例\n");
+    fprintf(stderr, "  -n, --number         为所有输出行编号\n");
+    fprintf(stderr, "  -j, --threads=N      并行模式使用 N 个线程 (默认: 在线 CPU 数，受 cgroup cpu.max 限制)\n");
+    fprintf(stderr, "      --validate-utf8[=repair]\n");
+    fprintf(stderr, "                       校验输入是否为合法 UTF-8，报告第一个无效字节的偏移并以非零状态退出；\n");
+    fprintf(stderr, "                       repair 模式下改为用 U+FFFD 替换无效字节\n");
+    fprintf(stderr, "      --background     后台模式: 空闲 I/O 优先级、SCHED_IDLE 调度，并丢弃处理过的页缓存\n");
+    fprintf(stderr, "      --pin-buffers    预先缺页并用 mlock 锁定 I/O 缓冲区 (受 RLIMIT_MEMLOCK 限制)\n");
+    fprintf(stderr, "      --engine=E       输出是普通文件且没有变换时的复制引擎: rw (默认)、mmap、\n");
+    fprintf(stderr, "                       auto (先试 copy_file_range，不支持时用 mmap)\n");
+    fprintf(stderr, "      --progress[=S]   每隔 S 秒 (默认 1) 在标准错误输出上报告进度；\n");
+    fprintf(stderr, "                       任何时候都可以发送 SIGUSR1 立即打印一次进度\n");
+    fprintf(stderr, "      --line=N         只输出第 N 行\n");
+    fprintf(stderr, "      --lines=A:B      只输出第 A 到 B 行 (省略 B 表示到文件结尾)；第一次查询时在文件旁\n");
+    fprintf(stderr, "                       建立行索引 FILE" LINE_INDEX_SUFFIX " (不可写时放在 /tmp 下)，之后直接定位\n");
+    fprintf(stderr, "      --index=PATH     行索引文件的路径\n");
+    fprintf(stderr, "      --update=DST     增量更新已有的目标文件: 逐块比较，只写入与输入不同的块，\n");
+    fprintf(stderr, "                       再把 DST 截短或扩展到输入的长度\n");
+    fprintf(stderr, "      --flush-interval=MS\n");
+    fprintf(stderr, "                       输入断续到达时把数据攒成大块再写出，但最多延迟 MS 毫秒\n");
+    fprintf(stderr, "      --sink=null|touch\n");
+    fprintf(stderr, "                       不写标准输出，直接丢弃输出数据；touch 模式读取每条缓存行一次\n");
+    fprintf(stderr, "      --stats          结束时在标准错误输出上打印统计信息和所选的资源参数\n");
+    fprintf(stderr, "      --metrics-file=PATH\n");
+    fprintf(stderr, "                       定期把 Prometheus 文本格式的指标原子地写入 PATH\n");
+    fprintf(stderr, "                       (供 node_exporter textfile collector 采集)\n");
+    fprintf(stderr, "      --metrics-interval=S\n");
+    fprintf(stderr, "                       指标文件的刷新间隔秒数 (默认 %d)\n", METRICS_DEFAULT_INTERVAL);
+    fprintf(stderr, "      --shm-stats      运行期间定期把本进程的计数累加到主机级共享内存段 " SHM_STATS_NAME "\n");
+    fprintf(stderr, "                       (段由第一个使用者以 0660 创建，其他组的用户无法加入)\n");
+    fprintf(stderr, "  -x, --hex            以 xxd 兼容的格式输出十六进制转储\n");
+    fprintf(stderr, "      --base64         Base64 编码 (输出不换行)\n");
+    fprintf(stderr, "      --base64-decode  Base64 解码 (忽略换行符)\n");
+    fprintf(stderr, "      --encrypt=KEYFILE\n");
+    fprintf(stderr, "                       用 AES-GCM 加密 (AES-NI/PCLMULQDQ)，每 64KB 为一个独立认证的帧；\n");
+    fprintf(stderr, "                       KEYFILE 为 16/32 字节的原始密钥或 32/64 个十六进制字符；\n");
+    fprintf(stderr, "                       每个流由文件头中的 96 位随机盐派生独立的子密钥\n");
+    fprintf(stderr, "      --decrypt=KEYFILE\n");
+    fprintf(stderr, "                       解密 --encrypt 的输出，每帧认证通过后才输出明文\n");
+    fprintf(stderr, "      --crlf-to-lf     把 CRLF 换行转换为 LF\n");
+    fprintf(stderr, "      --lf-to-crlf     把 LF 换行转换为 CRLF (已有的 CRLF 保持不变)\n");
+}
+
+// 只有长格式的选项
+enum {
+    OPT_VALIDATE_UTF8 = 256,
+    OPT_STATS,
+    OPT_BACKGROUND,
+    OPT_PIN_BUFFERS,
+    OPT_ENGINE,
+    OPT_PROGRESS,
+    OPT_METRICS_FILE,
+    OPT_METRICS_INTERVAL,
+    OPT_SHM_STATS,
+    OPT_TOP,
+    OPT_WARM,
+    OPT_FLUSH_INTERVAL,
+    OPT_LINE,
+    OPT_LINES,
+    OPT_INDEX,
+    OPT_UPDATE,
+    OPT_ENCRYPT,
+    OPT_DECRYPT,
+    OPT_MANIFEST,
+    OPT_MAX_OPEN,
+    OPT_SOURCE,
+    OPT_SIZE,
+    OPT_SINK,
+    OPT_EVICT,
+    OPT_LOCK,
+    OPT_CRLF_TO_LF,
+    OPT_LF_TO_CRLF,
+    OPT_BASE64,
+    OPT_BASE64_DECODE,
+};
+
+// parse_options 函数：解析命令行选项，填充 g_opts
+// 返回值: 输入文件名在 argv 中的下标
+int parse_options(int argc, char *argv[]) {
+    static const struct option long_options[] = {
+        { "number",  no_argument,       NULL, 'n' },
+        { "threads", required_argument, NULL, 'j' },
+        { "hex",     no_argument,       NULL, 'x' },
+        { "stats",   no_argument,       NULL, OPT_STATS },
+        { "background", no_argument,    NULL, OPT_BACKGROUND },
+        { "pin-buffers", no_argument,   NULL, OPT_PIN_BUFFERS },
+        { "engine",  required_argument, NULL, OPT_ENGINE },
+        { "progress", optional_argument, NULL, OPT_PROGRESS },
+        { "metrics-file", required_argument, NULL, OPT_METRICS_FILE },
+        { "metrics-interval", required_argument, NULL, OPT_METRICS_INTERVAL },
+        { "shm-stats", no_argument,     NULL, OPT_SHM_STATS },
+        { "top",     no_argument,       NULL, OPT_TOP },
+        { "warm",    no_argument,       NULL, OPT_WARM },
+        { "flush-interval", required_argument, NULL, OPT_FLUSH_INTERVAL },
+        { "line",    required_argument, NULL, OPT_LINE },
+        { "lines",   required_argument, NULL, OPT_LINES },
+        { "index",   required_argument, NULL, OPT_INDEX },
+        { "update",  required_argument, NULL, OPT_UPDATE },
+        { "manifest", required_argument, NULL, OPT_MANIFEST },
+        { "max-open", required_argument, NULL, OPT_MAX_OPEN },
+        { "source",  required_argument, NULL, OPT_SOURCE },
+        { "size",    required_argument, NULL, OPT_SIZE },
+        { "sink",    required_argument, NULL, OPT_SINK },
+        { "evict",   no_argument,       NULL, OPT_EVICT },
+        { "lock",    no_argument,       NULL, OPT_LOCK },
+        { "validate-utf8", optional_argument, NULL, OPT_VALIDATE_UTF8 },
+        { "crlf-to-lf",    no_argument,       NULL, OPT_CRLF_TO_LF },
+        { "lf-to-crlf",    no_argument,       NULL, OPT_LF_TO_CRLF },
+        { "base64",        no_argument,       NULL, OPT_BASE64 },
+        { "base64-decode", no_argument,       NULL, OPT_BASE64_DECODE },
+        { "encrypt",       required_argument, NULL, OPT_ENCRYPT },
+        { "decrypt",       required_argument, NULL, OPT_DECRYPT },
+        { NULL, 0, NULL, 0 }
+    };
+    g_opts.metrics_interval = METRICS_DEFAULT_INTERVAL;
+    g_opts.source_size = SOURCE_DEFAULT_SIZE;
+    int c;
+    while ((c = getopt_long(argc, argv, "nj:x", long_options, NULL)) != -1) {
+        switch (c) {
+        case 'n':
+            g_opts.number_lines = 1;
+            add_number_stage();
+            break;
+        case 'j':
+            g_opts.threads = atoi(optarg);
+            if (g_opts.threads < 1) {
+                fprintf(stderr, "无效的线程数: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'x':
+            add_hex_stage();
+            break;
+        case OPT_STATS:
+            g_opts.stats = 1;
+            break;
+        case OPT_BACKGROUND:
+            g_opts.background = 1;
+            break;
+        case OPT_PIN_BUFFERS:
+            g_opts.pin_buffers = 1;
+            break;
+        case OPT_ENGINE:
+            if (strcmp(optarg, "rw") == 0) {
+                g_opts.engine = ENGINE_RW;
+            } else if (strcmp(optarg, "mmap") == 0) {
+                g_opts.engine = ENGINE_MMAP;
+            } else if (strcmp(optarg, "auto") == 0) {
+                g_opts.engine = ENGINE_AUTO;
+            } else {
+                fprintf(stderr, "无效的复制引擎: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            g_opts.engine_explicit = 1;
+            break;
+        case OPT_PROGRESS:
+            g_opts.progress_interval = optarg != NULL ? atoi(optarg) : 1;
+            if (g_opts.progress_interval < 1) {
+                fprintf(stderr, "无效的进度报告间隔: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_METRICS_FILE:
+            g_opts.metrics_path = optarg;
+            break;
+        case OPT_METRICS_INTERVAL:
+            g_opts.metrics_interval = atoi(optarg);
+            if (g_opts.metrics_interval < 1) {
+                fprintf(stderr, "无效的指标刷新间隔: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SHM_STATS:
+            g_opts.shm_stats = 1;
+            break;
+        case OPT_TOP:
+            g_opts.top = 1;
+            break;
+        case OPT_SOURCE:
+            if (strcmp(optarg, "zero") == 0) {
+                g_opts.source = SOURCE_ZERO;
+            } else if (strcmp(optarg, "random") == 0) {
+                g_opts.source = SOURCE_RANDOM;
+            } else if (strcmp(optarg, "pattern") == 0) {
+                g_opts.source = SOURCE_PATTERN;
+            } else {
+                fprintf(stderr, "无效的数据源: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SIZE:
+            if (parse_size(optarg, &g_opts.source_size) == -1) {
+                fprintf(stderr, "无效的大小: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_SINK:
+            if (strcmp(optarg, "null") == 0) {
+                g_opts.sink = SINK_NULL;
+            } else if (strcmp(optarg, "touch") == 0) {
+                g_opts.sink = SINK_TOUCH;
+            } else {
+                fprintf(stderr, "无效的接收端: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_MANIFEST:
+            g_opts.manifest = optarg;
+            break;
+        case OPT_MAX_OPEN:
+            g_opts.max_open = atoi(optarg);
+            if (g_opts.max_open < 2) {
+                fprintf(stderr, "无效的文件描述符上限: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_FLUSH_INTERVAL:
+            g_opts.flush_interval = atoi(optarg);
+            if (g_opts.flush_interval < 1) {
+                fprintf(stderr, "无效的刷新间隔: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case OPT_LINE:
+        case OPT_LINES: {
+            char *end;
+            g_opts.first_line = strtoull(optarg, &end, 10);
+            g_opts.last_line = g_opts.first_line;
+            if (c == OPT_LINES) {
+                if (*end != ':') {
+                    end = optarg; // 强制报错
+                } else if (end[1] == '\0') {
+                    g_opts.last_line = UINT64_MAX;
+                    end++;
+                } else {
+                    g_opts.last_line = strtoull(end + 1, &end, 10);
+                }
+            }
+            if (optarg[0] == '-' || *end != '\0' || g_opts.first_line == 0
+                || g_opts.last_line < g_opts.first_line) {
+                fprintf(stderr, "无效的行号范围: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            break;
+        }
+        case OPT_INDEX:
+            g_opts.index_path = optarg;
+            break;
+        case OPT_UPDATE:
+            g_opts.update_path = optarg;
+            break;
+        case OPT_WARM:
+            g_opts.cache_command = CACHE_CMD_WARM;
+            break;
+        case OPT_EVICT:
+            g_opts.cache_command = CACHE_CMD_EVICT;
+            break;
+        case OPT_LOCK:
+            g_opts.cache_command = CACHE_CMD_LOCK;
+            break;
+        case OPT_VALIDATE_UTF8:
+            if (optarg != NULL && strcmp(optarg, "repair") != 0) {
+                fprintf(stderr, "无效的 --validate-utf8 模式: %s\n", optarg);
+                exit(EXIT_FAILURE);
+            }
+            add_utf8_stage(optarg != NULL);
+            break;
+        case OPT_CRLF_TO_LF:
+            add_eol_stage(EOL_CRLF_TO_LF);
+            break;
+        case OPT_LF_TO_CRLF:
+            add_eol_stage(EOL_LF_TO_CRLF);
+            break;
+        case OPT_BASE64:
+            add_base64_stage(0);
+            break;
+        case OPT_BASE64_DECODE:
+            add_base64_stage(1);
+            break;
+        case OPT_ENCRYPT:
+            add_gcm_stage(optarg, 0);
+            break;
+        case OPT_DECRYPT:
+            add_gcm_stage(optarg, 1);
+            break;
+        default:
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (g_opts.top || g_opts.source != SOURCE_FILE || g_opts.manifest != NULL ? optind != argc
+                                                                            : optind >= argc) {
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    return optind;
+}
+
+int main(int argc, char *argv[]) {
+    int fd_in;           // 输入文件描述符
+    char *buffer = NULL; // 缓冲区指针
+    size_t buffer_size;  // 缓冲区大小
+    ssize_t bytes_read = 0; // read() 函数返回的字节数
+
+    // 1. 解析命令行选项，读取 cgroup 资源限制
+    clock_gettime(CLOCK_MONOTONIC, &g_stats.start);
+    page_faults(&g_stats.minflt_start, &g_stats.majflt_start);
+    int file_arg = parse_options(argc, argv);
+    if (g_opts.top) {
+        return run_top();
+    }
+    if (g_opts.cache_command != CACHE_CMD_NONE) {
+        detect_resource_limits();
+        return run_cache_command(argc - file_arg, argv + file_arg);
+    }
+    detect_resource_limits();
+    install_progress_signal();
+    // 后台模式要先于任何线程设置，之后创建的线程 (指标、共享内存统计) 才会继承这些属性
+    if (g_opts.background) {
+        enter_background_mode();
+    }
+    start_metrics();
+    start_shm_stats();
+
+    if (g_opts.manifest != NULL) {
+        if (g_ntransforms > 0 || g_opts.source != SOURCE_FILE || g_opts.sink != SINK_STDOUT) {
+            fprintf(stderr, "--manifest 不能与变换阶段、--source 或 --sink 同时使用\n");
+            exit(EXIT_FAILURE);
+        }
+        g_stats.succeeded = run_manifest() == EXIT_SUCCESS;
+        finish_reporting();
+        return g_stats.succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (g_opts.update_path != NULL) {
+        if (g_ntransforms > 0 || g_opts.source != SOURCE_FILE || g_opts.sink != SINK_STDOUT
+            || g_opts.first_line > 0 || argc - file_arg != 1) {
+            fprintf(stderr, "--update 只能用于单个输入文件，且不能与变换阶段、--line、--source 或 --sink 同时使用\n");
+            exit(EXIT_FAILURE);
+        }
+        fd_in = open(argv[file_arg], O_RDONLY);
+        if (fd_in == -1) {
+            perror("打开文件失败");
+            exit(EXIT_FAILURE);
+        }
+        g_stats.succeeded = run_update(fd_in) == EXIT_SUCCESS;
+        close(fd_in);
+        finish_reporting();
+        return g_stats.succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (g_opts.first_line > 0) {
+        if (g_ntransforms > 0 || g_opts.source != SOURCE_FILE || argc - file_arg != 1) {
+            fprintf(stderr, "--line/--lines 只能用于单个输入文件，且不能与变换阶段或 --source 同时使用\n");
+            exit(EXIT_FAILURE);
+        }
+        fd_in = open(argv[file_arg], O_RDONLY);
+        if (fd_in == -1) {
+            perror("打开文件失败");
+            exit(EXIT_FAILURE);
+        }
+        g_stats.succeeded = print_lines(fd_in, argv[file_arg], g_opts.first_line, g_opts.last_line)
+                            == EXIT_SUCCESS;
+        close(fd_in);
+        finish_reporting();
+        return g_stats.succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // 2. 打开输入文件；多个文件，或者没有变换时的伪文件系统文件，走批量读取。
+    //    --source 时没有输入文件，数据在复制循环中生成
+    struct stat st_in;
+    int seekable = 0;
+    if (g_opts.source != SOURCE_FILE) {
+        fd_in = -1;
+        memset(&st_in, 0, sizeof(st_in));
+    } else if (argc - file_arg > 1) {
+        if (g_ntransforms > 0) {
+            fprintf(stderr, "多个输入文件时不支持变换阶段\n");
+            exit(EXIT_FAILURE);
+        }
+        g_stats.succeeded = cat_files(argc - file_arg, argv + file_arg, -1) == EXIT_SUCCESS;
+        finish_reporting();
+        return g_stats.succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+    } else {
+        fd_in = open(argv[file_arg], O_RDONLY);
+        if (fd_in == -1) {
+            perror("打开文件失败");
+            exit(EXIT_FAILURE);
+        }
+        seekable = fstat(fd_in, &st_in) == 0 && S_ISREG(st_in.st_mode) && st_in.st_size > 0;
+        if (!seekable && g_ntransforms == 0 && is_pseudo_fs(fd_in)) {
+            g_stats.succeeded = cat_files(1, argv + file_arg, fd_in) == EXIT_SUCCESS;
+            finish_reporting();
+            return g_stats.succeeded ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+
+        // 3. 根据输入在页缓存中的比例选择读取策略 (预读提示、O_DIRECT 或复制引擎)
+        apply_cache_policy(fd_in, seekable ? st_in.st_size : 0);
+    }
+
+    // 4. 获取缓冲区大小（现在是固定值）
+    buffer_size = io_blocksize();
+    if (buffer_size < OPTIMAL_BUFFER_SIZE) {
+        fprintf(stderr, "受 cgroup 内存限制，缓冲区缩小为: %zu 字节\n", buffer_size);
+    } else {
+        fprintf(stderr, "使用实验确定的最佳固定缓冲区大小: %zu 字节\n", buffer_size);
+    }
+    g_stats.buffer_size = buffer_size;
+    g_stats.threads = 1;
+    set_engine("read/write");
+
+    // 5. 使用 align_alloc 动态分配页对齐的缓冲区内存 (--pin-buffers 时预缺页并锁定)
+    buffer = io_buffer_alloc(buffer_size);
+    if (buffer == NULL) {
+        perror("分配页对齐缓冲区内存失败");
+        close(fd_in);
+        exit(EXIT_FAILURE);
+    }
+
+    // 5.1 块设备: 按 ioctl 查询到的参数读取；没有变换时用 O_DIRECT 多请求并行读取
+    uint64_t input_size = seekable ? (uint64_t)st_in.st_size : 0; // 进度报告的总字节数
+    if (g_opts.source != SOURCE_FILE) {
+        input_size = g_opts.source_size;
+    }
+    struct blockdev_info blk;
+    if (S_ISBLK(st_in.st_mode) && blockdev_probe(fd_in, &blk) == 0) {
+        fprintf(stderr, "输入是块设备: %llu 字节，逻辑扇区 %d 字节，最佳 I/O %u 字节\n",
+                (unsigned long long)blk.size, blk.sector_size, blk.io_opt);
+        input_size = blk.size;
+        if (g_ntransforms == 0) {
+            start_progress(input_size);
+            int depth = g_opts.threads > 0 ? g_opts.threads : BLOCKDEV_QUEUE_DEPTH;
+            set_engine("pread");
+            if (fcntl(fd_in, F_SETFL, fcntl(fd_in, F_GETFL) | O_DIRECT) == 0) {
+                set_engine("O_DIRECT pread");
+            } else {
+                perror("警告: 无法为块设备设置 O_DIRECT，使用带缓存的读取");
+            }
+            g_stats.threads = depth;
+            page_faults(&g_stats.minflt_prepared, &g_stats.majflt_prepared);
+            int rc = blockdev_copy(fd_in, &blk, depth);
+            g_stats.succeeded = rc == 0;
+            finish_reporting();
+            close(fd_in);
+            io_buffer_free(buffer, buffer_size);
+            return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    // 6. 只有行号一个阶段且输入是可定位的普通文件时，走两遍并行编号；
+    //    其余情况 (管道、与其他变换组合) 由行号阶段在复制循环中顺序编号
+    if (g_opts.number_lines && g_ntransforms == 1 && seekable) {
+        page_faults(&g_stats.minflt_prepared, &g_stats.majflt_prepared);
+        start_progress((uint64_t)st_in.st_size * 2); // 两遍各读一次
+        int nthreads = g_opts.threads > 0 ? g_opts.threads : default_thread_count();
+        fprintf(stderr, "使用 %d 个线程并行编号。\n", nthreads);
+        g_stats.threads = nthreads;
+        int rc = number_lines_parallel(fd_in, st_in.st_size, nthreads);
+        g_stats.succeeded = rc == 0;
+        finish_reporting();
+        close(fd_in);
+        io_buffer_free(buffer, buffer_size);
+        return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    // 6.1 没有变换阶段时，文件到文件的复制可以交给其他引擎
+    start_progress(input_size);
+    if (g_opts.engine != ENGINE_RW && g_ntransforms == 0 && g_opts.sink == SINK_STDOUT) {
+        page_faults(&g_stats.minflt_prepared, &g_stats.majflt_prepared);
+        int rc = try_file_copy(fd_in);
+        if (rc != 0) {
+            g_stats.succeeded = rc == 1;
+            finish_reporting();
+            close(fd_in);
+            io_buffer_free(buffer, buffer_size);
+            return rc == 1 ? EXIT_SUCCESS : EXIT_FAILURE;
+        }
+    }
+
+    // 7. 循环读取文件内容到缓冲区，经过各变换阶段后写入标准输出
+    if (setup_transforms(buffer_size) == -1) {
+        perror("分配变换阶段缓冲区失败");
+        close(fd_in);
+        io_buffer_free(buffer, buffer_size);
+        exit(EXIT_FAILURE);
+    }
+    page_faults(&g_stats.minflt_prepared, &g_stats.majflt_prepared);
+    size_t read_size = transform_read_size(buffer_size);
+    struct drop_behind drop;
+    if (g_opts.background) {
+        drop_behind_init(&drop, fd_in);
+    }
+    int stop = 0;
+    if (g_opts.flush_interval > 0 && g_opts.source == SOURCE_FILE) {
+        bytes_read = coalesced_copy(fd_in, buffer, read_size, &stop, g_opts.background ? &drop : NULL);
+    } else {
+        size_t chunk = slow_start_next(0, read_size);
+        while (!stop && (bytes_read = source_read(fd_in, buffer, chunk)) > 0) {
+            chunk = slow_start_next(chunk, read_size);
+            size_t out_len;
+            char *out = run_transforms(buffer, (size_t)bytes_read, 0, &out_len, &stop);
+            if (emit_output(out, out_len) == -1) {
+                perror("写入标准输出失败或未完全写入");
+                close(fd_in);
+                io_buffer_free(buffer, buffer_size);
+                exit(EXIT_FAILURE);
+            }
+            if (g_opts.background) {
+                drop_behind_block(&drop, (size_t)bytes_read, out_len);
+            }
+        }
+    }
+    if (!stop && bytes_read == 0) {
+        // 输入结束，冲刷各阶段残留的状态
+        size_t out_len;
+        char *out = run_transforms(buffer, 0, 1, &out_len, &stop);
+        if (emit_output(out, out_len) == -1) {
+            perror("写入标准输出失败或未完全写入");
+            close(fd_in);
+            io_buffer_free(buffer, buffer_size);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (g_opts.background) {
+        drop_behind_finish(&drop);
+    }
+    free_transforms();
+    if (stop) {
+        close(fd_in);
+        io_buffer_free(buffer, buffer_size);
+        exit(EXIT_FAILURE);
+    }
+
+    // 8. 检查循环终止原因
+    if (bytes_read == -1) {
+        perror("读取文件失败");
+        close(fd_in);
+        io_buffer_free(buffer, buffer_size);
+        exit(EXIT_FAILURE);
+    }
+
+    // 9. 关闭文件
+    if (fd_in != -1 && close(fd_in) == -1) {
+        perror("关闭文件失败");
+        io_buffer_free(buffer, buffer_size);
+        exit(EXIT_FAILURE);
+    }
+
+    // 10. 释放动态分配的缓冲区内存
+    io_buffer_free(buffer, buffer_size);
+
+    g_stats.succeeded = 1;
+    finish_reporting();
+
+    // 程序成功执行完毕
+    return EXIT_SUCCESS;
 }
\ No newline at end of file
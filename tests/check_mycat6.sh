@@ -0,0 +1,510 @@
+#!/usr/bin/env bash
+# mycat6 回归检查: 编译 mycat6.c，把各模式的输出与参考工具比对，
+# 并覆盖数据跨越多次 read 的边界情况。
+# 用法: tests/check_mycat6.sh，全部通过时退出状态为 0
+
+set -u
+
+ROOT=$(cd "$(dirname "$0")/.." && pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+M="$WORK/mycat6"
+if ! gcc -O2 -Wall -Wextra -pthread "$ROOT/mycat6.c" -o "$M"; then
+    echo "编译 mycat6.c 失败"
+    exit 1
+fi
+
+failures=0
+
+# check 函数：执行一条检查命令，打印结果并统计失败次数
+# 参数: $1 - 检查的名称，其余参数 - 检查命令 (退出状态为 0 表示通过)
+check() {
+    local name=$1
+    shift
+    if "$@"; then
+        echo "ok   $name"
+    else
+        echo "FAIL $name"
+        failures=$((failures + 1))
+    fi
+}
+
+# feed 函数：把每个参数 (printf 格式) 分别写到标准输出，中间停顿，
+# 让经过管道的读取端每次 read 只拿到一段
+feed() {
+    local piece
+    for piece in "$@"; do
+        printf "$piece"
+        sleep 0.2
+    done
+}
+
+# ---------------------------------------------------------------------------
+# UTF-8 校验 (--validate-utf8)
+# ---------------------------------------------------------------------------
+
+# utf8_split_valid: 一个 4 字节序列被拆到三次读取中，必须原样输出且退出状态为 0
+utf8_split_valid() {
+    printf 'ab\xf0\x9f\x98\x80cd\n' > "$WORK/expect"
+    feed 'ab\xf0' '\x9f' '\x98\x80cd\n' | "$M" --validate-utf8 /dev/stdin > "$WORK/out" 2> /dev/null \
+        && cmp -s "$WORK/out" "$WORK/expect"
+}
+check "utf8: 序列跨越三次读取" utf8_split_valid
+
+# utf8_split_bytewise: 每个字节单独一次读取
+utf8_split_bytewise() {
+    printf 'x\xe4\xb8\xad\xf0\x9f\x98\x80y\n' > "$WORK/expect"
+    feed 'x' '\xe4' '\xb8' '\xad' '\xf0' '\x9f' '\x98' '\x80' 'y\n' \
+        | "$M" --validate-utf8 /dev/stdin > "$WORK/out" 2> /dev/null \
+        && cmp -s "$WORK/out" "$WORK/expect"
+}
+check "utf8: 逐字节读取" utf8_split_bytewise
+
+# utf8_split_invalid: 跨读取的无效序列必须以非零状态退出
+utf8_split_invalid() {
+    ! feed 'ab\xf0' '\x9f' '\x28cd\n' | "$M" --validate-utf8 /dev/stdin > /dev/null 2>&1
+}
+check "utf8: 跨读取的无效序列被拒绝" utf8_split_invalid
+
+# utf8_truncated: 输入在序列中间结束
+utf8_truncated() {
+    ! feed 'ab\xf0' '\x9f' | "$M" --validate-utf8 /dev/stdin > /dev/null 2>&1
+}
+check "utf8: 以不完整序列结尾被拒绝" utf8_truncated
+
+# utf8_repair_split: 修复模式下跨读取的合法序列保持不变
+utf8_repair_split() {
+    printf 'ab\xf0\x9f\x98\x80\xffcd\n' > "$WORK/in"
+    printf 'ab\xf0\x9f\x98\x80\xef\xbf\xbdcd\n' > "$WORK/expect"
+    feed 'ab\xf0' '\x9f' '\x98\x80\xff' 'cd\n' | "$M" --validate-utf8=repair /dev/stdin > "$WORK/out" 2> /dev/null \
+        && cmp -s "$WORK/out" "$WORK/expect"
+}
+check "utf8: 修复模式跨读取" utf8_repair_split
+
+# utf8_repair_then_validate: 修复阶段之后再接一个校验阶段，两者各自保持状态，校验必须通过
+utf8_repair_then_validate() {
+    printf 'a\xef\xbf\xbdb\n' > "$WORK/expect"
+    printf 'a\xffb\n' | "$M" --validate-utf8=repair --validate-utf8 /dev/stdin > "$WORK/out" 2> /dev/null \
+        && cmp -s "$WORK/out" "$WORK/expect"
+}
+check "utf8: 修复后再校验" utf8_repair_then_validate
+
+# ---------------------------------------------------------------------------
+# 换行转换 (--crlf-to-lf / --lf-to-crlf)，参考实现为 perl
+# ---------------------------------------------------------------------------
+
+# 混有 CRLF、单独的 LF 和单独的 CR 的文本，足够大以跨越多个分块
+yes $'ab\r\ncd\ne\rf\r\r\n' | head -c 6000000 > "$WORK/crlf"
+
+# crlf_match: 整个文件的转换结果与 perl 一致
+crlf_match() {
+    local opt=$1 expr=$2
+    "$M" "$opt" "$WORK/crlf" 2> /dev/null | cmp -s - <(perl -0777 -pe "$expr" "$WORK/crlf")
+}
+check "crlf: --crlf-to-lf 与 perl 一致" crlf_match --crlf-to-lf 's/\r\n/\n/g'
+check "crlf: --lf-to-crlf 与 perl 一致" crlf_match --lf-to-crlf 's/(?<!\r)\n/\r\n/g'
+
+# crlf_split: CR 和 LF 落在两次读取中
+crlf_split() {
+    local opt=$1 expect=$2
+    shift 2
+    [ "$(feed "$@" | "$M" "$opt" /dev/stdin 2> /dev/null | od -An -c | tr -s ' ')" = "$expect" ]
+}
+check "crlf: --crlf-to-lf 的 CR|LF 跨读取" crlf_split --crlf-to-lf ' a \n b \n' 'a\r' '\nb\r' '\n'
+check "crlf: --crlf-to-lf 末尾单独的 CR 保留" crlf_split --crlf-to-lf ' a \r' 'a' '\r'
+check "crlf: --lf-to-crlf 的 CR|LF 跨读取" crlf_split --lf-to-crlf ' a \r \n b \r \n' 'a\r' '\nb' '\n'
+
+# crlf_both: 两个方向串在同一条变换链中，各自保持自己的状态
+crlf_both() {
+    "$M" --lf-to-crlf --crlf-to-lf "$WORK/crlf" 2> /dev/null \
+        | cmp -s - <(perl -0777 -pe 's/(?<!\r)\n/\r\n/g; s/\r\n/\n/g' "$WORK/crlf")
+}
+check "crlf: --lf-to-crlf --crlf-to-lf 串联" crlf_both
+
+# ---------------------------------------------------------------------------
+# 十六进制转储 (-x)，参考实现为 xxd
+# ---------------------------------------------------------------------------
+
+# hex_match: 长度为 $1 的随机数据的转储与 xxd 一致 (覆盖不满一行的末尾)
+hex_match() {
+    head -c "$1" /dev/urandom > "$WORK/hexin"
+    "$M" -x "$WORK/hexin" 2> /dev/null | cmp -s - <(xxd "$WORK/hexin")
+}
+check "hex: 1 字节" hex_match 1
+check "hex: 15 字节" hex_match 15
+check "hex: 16 字节" hex_match 16
+check "hex: 17 字节" hex_match 17
+check "hex: 多个分块 (5000003 字节)" hex_match 5000003
+
+# hex_split: 一行的 16 个字节分散在多次读取中
+hex_split() {
+    printf '0123456789abcdefghijklmnopqrstuvwxyz\n' > "$WORK/hexin"
+    feed '0123456' '789abcdefghijkl' 'mnopqrstuvwxyz\n' | "$M" -x /dev/stdin 2> /dev/null \
+        | cmp -s - <(xxd "$WORK/hexin")
+}
+check "hex: 一行跨越多次读取" hex_split
+
+# hex_twice: 两个 -x 阶段串联 (各自的偏移和残留字节互不干扰)，与 xxd | xxd 一致
+hex_twice() {
+    head -c 100000 /dev/urandom > "$WORK/hexin"
+    "$M" -x -x "$WORK/hexin" 2> /dev/null | cmp -s - <(xxd "$WORK/hexin" | xxd)
+}
+check "hex: -x -x 与 xxd | xxd 一致" hex_twice
+
+# ---------------------------------------------------------------------------
+# Base64 (--base64 / --base64-decode)，参考实现为 coreutils base64
+# ---------------------------------------------------------------------------
+
+# base64_encode_match: 长度为 $1 的随机数据的编码与 base64 -w0 一致 (覆盖三种填充情况)
+base64_encode_match() {
+    head -c "$1" /dev/urandom > "$WORK/b64in"
+    "$M" --base64 "$WORK/b64in" 2> /dev/null | cmp -s - <(base64 -w0 "$WORK/b64in")
+}
+check "base64: 编码 1 字节" base64_encode_match 1
+check "base64: 编码 2 字节" base64_encode_match 2
+check "base64: 编码 3 字节" base64_encode_match 3
+check "base64: 编码多个分块 (5000001 字节)" base64_encode_match 5000001
+
+# base64_decode_match: 解码 base64 (默认每 76 字符换行) 的输出得到原始数据
+base64_decode_match() {
+    head -c "$1" /dev/urandom > "$WORK/b64in"
+    base64 "$WORK/b64in" > "$WORK/b64enc"
+    "$M" --base64-decode "$WORK/b64enc" 2> /dev/null | cmp -s - "$WORK/b64in"
+}
+check "base64: 解码带换行的输入" base64_decode_match 1000
+check "base64: 解码多个分块 (5000002 字节)" base64_decode_match 5000002
+
+# base64_split: 编码时一个三字节组、解码时一个四字符组和填充跨越多次读取
+base64_split() {
+    [ "$(feed 'a' 'bcd' 'e' | "$M" --base64 /dev/stdin 2> /dev/null)" = "YWJjZGU=" ] \
+        && [ "$(feed 'YW' 'Jj\nZ' 'G' 'U=' | "$M" --base64-decode /dev/stdin 2> /dev/null)" = "abcde" ]
+}
+check "base64: 分组跨越多次读取" base64_split
+
+# base64_chained: 编码两次与 base64 -w0 | base64 -w0 一致；编码后再解码得到原文
+base64_chained() {
+    head -c 1000000 /dev/urandom > "$WORK/b64in"
+    "$M" --base64 --base64 "$WORK/b64in" 2> /dev/null \
+        | cmp -s - <(base64 -w0 "$WORK/b64in" | base64 -w0) \
+        && "$M" --base64 --base64-decode "$WORK/b64in" 2> /dev/null | cmp -s - "$WORK/b64in"
+}
+check "base64: 多个阶段串联" base64_chained
+
+# base64_invalid: 非法字符和截断的输入以非零状态退出
+base64_invalid() {
+    ! printf 'YW!j' | "$M" --base64-decode /dev/stdin > /dev/null 2>&1 \
+        && ! printf 'YWJjZ' | "$M" --base64-decode /dev/stdin > /dev/null 2>&1
+}
+check "base64: 拒绝无效输入" base64_invalid
+
+# base64_bad_padding: 填充多于 2 个或没有正好补齐一组时以非零状态退出；跨越读取的合法填充照常解码
+base64_bad_padding() {
+    local bad
+    for bad in 'YQ===' 'YWI==' 'YQ=' 'YQ=A' 'YWJj='; do
+        if printf '%s' "$bad" | "$M" --base64-decode /dev/stdin > /dev/null 2>&1; then
+            return 1
+        fi
+    done
+    [ "$(feed 'YQ=' '=' | "$M" --base64-decode /dev/stdin 2> /dev/null)" = "a" ]
+}
+check "base64: 拒绝多余或不完整的填充" base64_bad_padding
+
+# ---------------------------------------------------------------------------
+# AES-GCM (--encrypt / --decrypt)，参考实现为 OpenSSL libcrypto
+# ---------------------------------------------------------------------------
+
+# 参考解密器: 按 mycat6 的帧格式解析，用 OpenSSL 逐帧认证并解密，明文写到标准输出
+cat > "$WORK/gcmref.c" << 'END'
+#include <openssl/evp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int main(int argc, char **argv) {
+    unsigned char key[33];
+    FILE *kf = argc == 3 ? fopen(argv[1], "rb") : NULL;
+    size_t key_len = kf != NULL ? fread(key, 1, sizeof(key), kf) : 0;
+    FILE *f = argc == 3 ? fopen(argv[2], "rb") : NULL;
+    if ((key_len != 16 && key_len != 32) || f == NULL) {
+        return 2;
+    }
+    static unsigned char d[1 << 26];
+    size_t n = fread(d, 1, sizeof(d), f);
+    if (n < 20 || memcmp(d, "MCATGCM\2", 8) != 0) {
+        return 1;
+    }
+    // 子密钥的第 j 块 = AES-ECB(主密钥, 12 字节盐 + 大端 j)
+    const EVP_CIPHER *ecb = key_len == 16 ? EVP_aes_128_ecb() : EVP_aes_256_ecb();
+    unsigned char subkey[32];
+    for (size_t j = 0; j * 16 < key_len; j++) {
+        unsigned char block[16] = { 0 };
+        int block_len;
+        memcpy(block, d + 8, 12);
+        block[15] = (unsigned char)j;
+        EVP_CIPHER_CTX *e = EVP_CIPHER_CTX_new();
+        EVP_EncryptInit_ex(e, ecb, NULL, key, NULL);
+        EVP_CIPHER_CTX_set_padding(e, 0);
+        EVP_EncryptUpdate(e, subkey + j * 16, &block_len, block, 16);
+        EVP_CIPHER_CTX_free(e);
+    }
+    size_t p = 20;
+    for (uint32_t idx = 0;; idx++) {
+        // 帧: LE32 (长度 | 最后一帧标志 << 31) + 密文 + 16 字节标签
+        if (n - p < 4) {
+            return 1;
+        }
+        uint32_t field = d[p] | d[p + 1] << 8 | d[p + 2] << 16 | (uint32_t)d[p + 3] << 24;
+        size_t len = field & 0x7fffffff;
+        unsigned char final = field >> 31;
+        if (n - p - 4 < len + 16) {
+            return 1;
+        }
+        // IV = 8 个零字节 + 大端帧序号；AAD 为最后一帧标志
+        unsigned char iv[12] = { 0 };
+        iv[8] = idx >> 24;
+        iv[9] = idx >> 16;
+        iv[10] = idx >> 8;
+        iv[11] = idx;
+        EVP_CIPHER_CTX *c = EVP_CIPHER_CTX_new();
+        unsigned char *out = malloc(len + 16);
+        int out_len;
+        EVP_DecryptInit_ex(c, key_len == 16 ? EVP_aes_128_gcm() : EVP_aes_256_gcm(), NULL, subkey, iv);
+        EVP_DecryptUpdate(c, NULL, &out_len, &final, 1);
+        EVP_DecryptUpdate(c, out, &out_len, d + p + 4, (int)len);
+        EVP_CIPHER_CTX_ctrl(c, EVP_CTRL_GCM_SET_TAG, 16, d + p + 4 + len);
+        if (EVP_DecryptFinal_ex(c, out + out_len, &out_len) <= 0) {
+            return 1;
+        }
+        fwrite(out, 1, len, stdout);
+        free(out);
+        EVP_CIPHER_CTX_free(c);
+        p += 4 + len + 16;
+        if (final) {
+            return p == n ? 0 : 1;
+        }
+    }
+}
+END
+GCMREF=
+if gcc -O2 "$WORK/gcmref.c" -o "$WORK/gcmref" -lcrypto 2> /dev/null; then
+    GCMREF="$WORK/gcmref"
+fi
+
+head -c 16 /dev/urandom > "$WORK/key16"
+head -c 32 /dev/urandom > "$WORK/key32"
+xxd -p -c 64 "$WORK/key32" > "$WORK/key32.hex"
+
+# gcm_openssl: 长度为 $2 的随机数据用密钥 $1 加密后，OpenSSL 能认证并解密出原文
+gcm_openssl() {
+    local key=$1 size=$2
+    head -c "$size" /dev/urandom > "$WORK/gcmin"
+    "$M" --encrypt="$key" "$WORK/gcmin" > "$WORK/gcmenc" 2> /dev/null \
+        && "$GCMREF" "$key" "$WORK/gcmenc" | cmp -s - "$WORK/gcmin"
+}
+if [ -n "$GCMREF" ]; then
+    check "gcm: OpenSSL 解密 AES-128 空输入" gcm_openssl "$WORK/key16" 0
+    check "gcm: OpenSSL 解密 AES-128 正好一帧 (65536 字节)" gcm_openssl "$WORK/key16" 65536
+    check "gcm: OpenSSL 解密 AES-256 多帧 (3000017 字节)" gcm_openssl "$WORK/key32" 3000017
+else
+    echo "skip gcm: 没有 OpenSSL 开发库，跳过与 OpenSSL 的比对"
+fi
+
+# gcm_roundtrip: 用十六进制密钥文件加密再解密得到原文
+gcm_roundtrip() {
+    head -c "$1" /dev/urandom > "$WORK/gcmin"
+    "$M" --encrypt="$WORK/key32.hex" "$WORK/gcmin" 2> /dev/null \
+        | "$M" --decrypt="$WORK/key32.hex" /dev/stdin 2> /dev/null | cmp -s - "$WORK/gcmin"
+}
+check "gcm: 往返 65537 字节" gcm_roundtrip 65537
+check "gcm: 往返 5000000 字节" gcm_roundtrip 5000000
+
+# gcm_same_chain: 同一条变换链中先加密再解密，两个阶段的密钥和帧状态互不干扰
+gcm_same_chain() {
+    head -c 1000000 /dev/urandom > "$WORK/gcmin"
+    "$M" --encrypt="$WORK/key16" --decrypt="$WORK/key16" "$WORK/gcmin" 2> /dev/null | cmp -s - "$WORK/gcmin"
+}
+check "gcm: --encrypt --decrypt 串联" gcm_same_chain
+
+# gcm_split: 明文以小片段到达；密文在文件头、帧头和标签中间被切开
+gcm_split() {
+    printf 'hello, world\n' > "$WORK/gcmin"
+    feed 'hel' 'lo, ' 'world\n' | "$M" --encrypt="$WORK/key16" /dev/stdin > "$WORK/gcmenc" 2> /dev/null \
+        || return 1
+    local size
+    size=$(stat -c %s "$WORK/gcmenc")
+    { head -c 10 "$WORK/gcmenc"; sleep 0.2
+      head -c 22 "$WORK/gcmenc" | tail -c 12; sleep 0.2
+      head -c $((size - 5)) "$WORK/gcmenc" | tail -c $((size - 27)); sleep 0.2
+      tail -c 5 "$WORK/gcmenc"; } \
+        | "$M" --decrypt="$WORK/key16" /dev/stdin 2> /dev/null | cmp -s - "$WORK/gcmin"
+}
+check "gcm: 文件头、帧头和标签跨越多次读取" gcm_split
+
+# gcm_tamper: 改动密文中的一个字节后解密失败
+gcm_tamper() {
+    head -c 200000 /dev/urandom > "$WORK/gcmin"
+    "$M" --encrypt="$WORK/key16" "$WORK/gcmin" > "$WORK/gcmenc" 2> /dev/null || return 1
+    local byte
+    byte=$(od -An -tu1 -j 150000 -N 1 "$WORK/gcmenc")
+    printf "\\x$(printf %02x $(((byte + 1) % 256)))" \
+        | dd of="$WORK/gcmenc" bs=1 seek=150000 conv=notrunc 2> /dev/null
+    ! "$M" --decrypt="$WORK/key16" "$WORK/gcmenc" > /dev/null 2>&1
+}
+check "gcm: 拒绝被篡改的密文" gcm_tamper
+
+# gcm_truncated: 在帧边界处截掉最后一帧后解密失败
+gcm_truncated() {
+    head -c 200000 /dev/urandom > "$WORK/gcmin"
+    "$M" --encrypt="$WORK/key16" "$WORK/gcmin" > "$WORK/gcmenc" 2> /dev/null || return 1
+    head -c $((20 + 3 * (4 + 65536 + 16))) "$WORK/gcmenc" > "$WORK/gcmcut"
+    ! "$M" --decrypt="$WORK/key16" "$WORK/gcmcut" > /dev/null 2>&1
+}
+check "gcm: 拒绝在帧边界处截断的密文" gcm_truncated
+
+# gcm_wrong_key: 用另一个密钥解密失败
+gcm_wrong_key() {
+    printf 'secret\n' | "$M" --encrypt="$WORK/key16" /dev/stdin > "$WORK/gcmenc" 2> /dev/null || return 1
+    ! "$M" --decrypt="$WORK/key32" "$WORK/gcmenc" > /dev/null 2>&1
+}
+check "gcm: 拒绝错误的密钥" gcm_wrong_key
+
+# ---------------------------------------------------------------------------
+# 变换流水线: 多个阶段串联，数据按 L2 大小的分块流过，分块边界落在任意位置
+# ---------------------------------------------------------------------------
+
+# pipeline_utf8_large: 多字节字符密集的大文件校验通过且原样输出
+pipeline_utf8_large() {
+    yes '中文😀abcé' | head -n 400000 > "$WORK/utf8big"
+    "$M" --validate-utf8 "$WORK/utf8big" 2> /dev/null | cmp -s - "$WORK/utf8big"
+}
+check "pipeline: 大文件 UTF-8 校验跨越分块" pipeline_utf8_large
+
+# pipeline_crlf_base64: --crlf-to-lf --base64 与 perl | base64 -w0 一致
+pipeline_crlf_base64() {
+    "$M" --crlf-to-lf --base64 "$WORK/crlf" 2> /dev/null \
+        | cmp -s - <(perl -0777 -pe 's/\r\n/\n/g' "$WORK/crlf" | base64 -w0)
+}
+check "pipeline: --crlf-to-lf --base64" pipeline_crlf_base64
+
+# pipeline_decode_hex: --base64-decode --lf-to-crlf -x 与 base64 -d | perl | xxd 一致
+pipeline_decode_hex() {
+    base64 "$WORK/crlf" > "$WORK/crlf.b64"
+    "$M" --base64-decode --lf-to-crlf -x "$WORK/crlf.b64" 2> /dev/null \
+        | cmp -s - <(base64 -d "$WORK/crlf.b64" | perl -0777 -pe 's/(?<!\r)\n/\r\n/g' | xxd)
+}
+check "pipeline: --base64-decode --lf-to-crlf -x" pipeline_decode_hex
+
+# pipeline_gcm: 变换后再加密，解密后与直接变换的结果一致
+pipeline_gcm() {
+    "$M" --lf-to-crlf --encrypt="$WORK/key16" "$WORK/crlf" 2> /dev/null \
+        | "$M" --decrypt="$WORK/key16" --crlf-to-lf /dev/stdin 2> /dev/null \
+        | cmp -s - <("$M" --lf-to-crlf --crlf-to-lf "$WORK/crlf" 2> /dev/null)
+}
+check "pipeline: --lf-to-crlf --encrypt / --decrypt --crlf-to-lf" pipeline_gcm
+
+# ---------------------------------------------------------------------------
+# 复制引擎 (--engine)
+# ---------------------------------------------------------------------------
+
+head -c 100000 /dev/urandom > "$WORK/src100k"
+
+# engine_keeps_longer_dst: 以 1<> 打开的更长目标文件不能被截短，结果应与 rw 引擎一致
+engine_keeps_longer_dst() {
+    local engine=$1
+    head -c 300000 /dev/urandom > "$WORK/dst_rw"
+    cp "$WORK/dst_rw" "$WORK/dst_$engine"
+    "$M" --engine=rw "$WORK/src100k" 1<> "$WORK/dst_rw" 2> /dev/null \
+        && "$M" --engine="$engine" "$WORK/src100k" 1<> "$WORK/dst_$engine" 2> /dev/null \
+        && cmp -s "$WORK/dst_rw" "$WORK/dst_$engine"
+}
+check "engine: mmap 不截短更长的目标" engine_keeps_longer_dst mmap
+check "engine: auto 不截短更长的目标" engine_keeps_longer_dst auto
+
+# ---------------------------------------------------------------------------
+# 并行编号 (-n)
+# ---------------------------------------------------------------------------
+
+# number_match: -n --threads=N 的输出与 cat -n 一致
+number_match() {
+    local file=$1 threads=$2
+    "$M" -n --threads="$threads" "$file" 2> /dev/null | cmp -s - <(cat -n "$file")
+}
+yes '' | head -c 12000000 > "$WORK/newlines"
+seq 1 1000000 > "$WORK/seq"
+check "number: 纯换行输入 (输出远大于块)" number_match "$WORK/newlines" 4
+check "number: 普通文本" number_match "$WORK/seq" 3
+
+# number_pipe: 管道输入走变换阶段，换行密集时缩小每次读取，输出仍与 cat -n 一致
+number_pipe() {
+    cat "$WORK/newlines" | "$M" -n /dev/stdin 2> "$WORK/err" | cmp -s - <(cat -n "$WORK/newlines") \
+        && grep -q '每次读取缩小为' "$WORK/err"
+}
+check "number: 管道输入限制输出缓冲区" number_pipe
+
+# ---------------------------------------------------------------------------
+# 指标导出 (--metrics-file)
+# ---------------------------------------------------------------------------
+
+# metrics_file: 指标文件 (不受 umask 影响) 权限为 0644，目录中不留下临时文件
+metrics_file() {
+    mkdir -p "$WORK/metrics"
+    (umask 077 && "$M" --metrics-file="$WORK/metrics/m.prom" "$WORK/seq" > /dev/null 2>&1) \
+        && grep -q '^mycat_read_bytes_total ' "$WORK/metrics/m.prom" \
+        && [ "$(stat -c %a "$WORK/metrics/m.prom")" = 644 ] \
+        && [ "$(ls "$WORK/metrics")" = m.prom ]
+}
+check "metrics: 安全地原子替换指标文件" metrics_file
+
+# ---------------------------------------------------------------------------
+# 行索引 (--line / --lines)
+# ---------------------------------------------------------------------------
+
+seq 1 5000 | sed 's/^/line/' > "$WORK/lines"
+
+# lines_match: --lines=A:B 的输出与 sed -n 'A,Bp' 一致
+lines_match() {
+    local a=$1 b=$2
+    "$M" --lines="$a:$b" "$WORK/lines" > "$WORK/out" 2> /dev/null \
+        && sed -n "${a},${b}p" "$WORK/lines" | cmp -s - "$WORK/out"
+}
+check "lines: 1:1" lines_match 1 1
+check "lines: 跨越采样点 1020:1030" lines_match 1020 1030
+check "lines: 末尾 4999:6000" lines_match 4999 6000
+
+# lines_same_size_rewrite: 长度和末尾内容都不变的改写 (并恢复 mtime) 之后索引必须重建
+lines_same_size_rewrite() {
+    "$M" --line=3000 "$WORK/lines" > /dev/null 2>&1
+    (seq 501 4000; seq 1 500; seq 4001 5000) | sed 's/^/line/' > "$WORK/rewrite"
+    touch -r "$WORK/lines" "$WORK/rewrite.ref"
+    cat "$WORK/rewrite" > "$WORK/lines"
+    touch -r "$WORK/rewrite.ref" "$WORK/lines"
+    [ "$("$M" --line=3000 "$WORK/lines" 2> /dev/null)" = "line3500" ]
+}
+check "lines: 同长度改写后重建索引" lines_same_size_rewrite
+
+# lines_append: 追加之后在原索引上扩展 (而不是重建)，并能查到新的行
+lines_append() {
+    "$M" --line=1 "$WORK/lines" > /dev/null 2>&1
+    printf 'appended\n' >> "$WORK/lines"
+    [ "$("$M" --line=5001 "$WORK/lines" 2> "$WORK/err")" = "appended" ] && grep -q '扩展行索引' "$WORK/err"
+}
+check "lines: 追加后扩展索引并查询新行" lines_append
+
+# lines_append_after_rewrite: 开头被同长度改写后又追加，前缀校验和不符，必须重建
+lines_append_after_rewrite() {
+    "$M" --line=1 "$WORK/lines" > /dev/null 2>&1
+    { printf 'LINE1\n'; tail -n +2 "$WORK/lines"; printf 'more\n'; } > "$WORK/rewrite"
+    cat "$WORK/rewrite" > "$WORK/lines"
+    [ "$("$M" --lines=1:1 "$WORK/lines" 2> "$WORK/err")" = "LINE1" ] && grep -q '建立行索引' "$WORK/err" \
+        && [ "$("$M" --line=5002 "$WORK/lines" 2> /dev/null)" = "more" ]
+}
+check "lines: 前缀改写后追加时重建索引" lines_append_after_rewrite
+
+echo
+if [ "$failures" -ne 0 ]; then
+    echo "$failures 项检查失败"
+    exit 1
+fi
+echo "全部检查通过"